@@ -1,7 +1,13 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "diskimage.h"
+#include "diskimage_probes.h"
 
 
 typedef struct errormessage {
@@ -140,6 +146,15 @@ int set_status(DiskImage *di, int status, int track, int sector) {
 }
 
 
+/* set the status of a single file, leaving the image untouched */
+static int set_file_status(ImageFile *imgfile, int status, int track, int sector) {
+	imgfile->status = status;
+	imgfile->statusts.track = track;
+	imgfile->statusts.sector = sector;
+	return status;
+}
+
+
 /* return write interleave */
 int interleave(ImageType type) {
 	switch (type) {
@@ -263,7 +278,121 @@ int di_get_block_num(ImageType type, TrackSector ts) {
 
 /* get a pointer to block data */
 unsigned char *di_get_ts_addr(DiskImage *di, TrackSector ts) {
-	return di->image + di_get_block_num(di->type, ts) * 256;
+	int block;
+
+	block = di_get_block_num(di->type, ts);
+	/* a snapshot reads the sectors modified since it was taken from its own
+	   copies, and the other ones from the image */
+	if (di->sectors && di->sectors[block]) {
+		return di->sectors[block];
+	}
+	return di->image + block * 256;
+}
+
+
+/* number of bytes of the dirty sector bitmap */
+static int dirty_size(DiskImage *di) {
+	return ((di->size + 255) / 256 + 7) / 8;
+}
+
+
+static void put_le32(unsigned char *p, unsigned int value) {
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
+
+static unsigned int get_le32(unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+
+/* stop sharing the sectors of the image with a snapshot */
+static void unlink_snapshot(DiskImage *snapshot) {
+	DiskImage **link;
+
+	link = &snapshot->live->snapshots;
+	while (*link != snapshot) {
+		link = &(*link)->nextsnapshot;
+	}
+	*link = snapshot->nextsnapshot;
+	/* nothing to copy anymore */
+	if (snapshot->live->snapshots == NULL) {
+		free(snapshot->live->shared);
+		snapshot->live->shared = NULL;
+	}
+	snapshot->live = NULL;
+}
+
+
+/* give the snapshots still sharing a sector their own copy of it, before
+   the image modifies it. A snapshot that cannot get its copy would show the
+   new contents, it is dropped instead: it keeps its memory until freed, but
+   di_snapshot_is_lost tells it must not be read anymore */
+static void unshare_sector(DiskImage *di, int sector) {
+	DiskImage *snapshot, *next;
+	int offset, len;
+
+	offset = sector * 256;
+	len = (offset + 256 < di->size ? 256 : di->size - offset);
+	for (snapshot = di->snapshots; snapshot; snapshot = next) {
+		next = snapshot->nextsnapshot;
+		if (snapshot->sectors[sector] == NULL) {
+			if ((snapshot->sectors[sector] = malloc(256)) == NULL) {
+				unlink_snapshot(snapshot);
+				snapshot->image = NULL;
+				continue;
+			}
+			memcpy(snapshot->sectors[sector], di->image + offset, len);
+		}
+	}
+	if (di->shared) {
+		di->shared[sector / 8] &= ~(1 << (sector & 7));
+	}
+}
+
+
+static void unshare_all_sectors(DiskImage *di) {
+	int sector, nbrsectors;
+
+	nbrsectors = (di->size + 255) / 256;
+	for (sector = 0; sector < nbrsectors && di->shared; ++sector) {
+		if (di->shared[sector / 8] & (1 << (sector & 7))) {
+			unshare_sector(di, sector);
+		}
+	}
+}
+
+
+/* flag the sector holding p as to be written back by di_sync; to be called
+   before modifying it, so that the snapshots keep its current contents */
+static void mark_dirty(DiskImage *di, void *p) {
+	int sector;
+
+	sector = ((unsigned char *) p - di->image) / 256;
+	if (di->shared && (di->shared[sector / 8] & (1 << (sector & 7)))) {
+		unshare_sector(di, sector);
+	}
+	di->dirty[sector / 8] |= 1 << (sector & 7);
+	di->modified = 1;
+}
+
+
+static void mark_all_dirty(DiskImage *di) {
+	if (di->shared) {
+		unshare_all_sectors(di);
+	}
+	memset(di->dirty, 0xff, dirty_size(di));
+	di->modified = 1;
+}
+
+
+/* flag a block about to be modified through di_get_ts_addr as to be written
+   back */
+void di_mark_dirty(DiskImage *di, TrackSector ts) {
+	mark_dirty(di, di_get_ts_addr(di, ts));
 }
 
 
@@ -303,6 +432,8 @@ TrackSector next_ts_in_chain(DiskImage *di, TrackSector ts) {
 	newts.track = p[0];
 	newts.sector = p[1];
 
+	DI_PROBE5(chain__next, di->filename, ts.track, ts.sector, newts.track, newts.sector);
+
 	return newts;
 }
 
@@ -346,7 +477,8 @@ unsigned char *di_title(DiskImage *di) {
 
 
 /* return number of free blocks in track */
-int di_track_blocks_free(DiskImage *di, int track) {
+/* free sector count of a track, as stored in the BAM */
+static int bam_track_blocks_free(DiskImage *di, int track) {
 	unsigned char *bam;
 
 	switch (di->type) {
@@ -374,22 +506,8 @@ int di_track_blocks_free(DiskImage *di, int track) {
 }
 
 
-/* count number of free blocks */
-int blocks_free(DiskImage *di) {
-	int track;
-	int blocks = 0;
-
-	for (track = 1; track <= di_tracks(di->type); ++track) {
-		if (track != di->dir.track) {
-			blocks += di_track_blocks_free(di, track);
-		}
-	}
-	return blocks;
-}
-
-
-/* check if track, sector is free in BAM */
-int di_is_ts_free(DiskImage *di, TrackSector ts) {
+/* check if track, sector is free in the BAM itself */
+static int bam_is_ts_free(DiskImage *di, TrackSector ts) {
 	unsigned char mask;
 	unsigned char *bam;
 
@@ -428,15 +546,82 @@ int di_is_ts_free(DiskImage *di, TrackSector ts) {
 }
 
 
+/* rebuild the free sector bitmaps and counters mirroring the BAM, which
+   di_alloc_ts and di_free_ts then keep up to date */
+static void load_bam(DiskImage *di) {
+	TrackSector ts;
+	int spt;
+
+	memset(di->freemap, 0, sizeof(di->freemap));
+	memset(di->trackfree, 0, sizeof(di->trackfree));
+	di->freecount = 0;
+	for (ts.track = 1; ts.track <= di_tracks(di->type); ++ts.track) {
+		spt = di_sectors_per_track(di->type, ts.track);
+		for (ts.sector = 0; ts.sector < spt; ++ts.sector) {
+			if (bam_is_ts_free(di, ts)) {
+				di->freemap[ts.track] |= 1ULL << ts.sector;
+			}
+		}
+		di->trackfree[ts.track] = bam_track_blocks_free(di, ts.track);
+		if (ts.track != di->dir.track) {
+			di->freecount += di->trackfree[ts.track];
+		}
+	}
+}
+
+
+/* rebuild the mirrors of the BAM after its sectors were written through
+   di_get_ts_addr */
+void di_reload_bam(DiskImage *di) {
+	load_bam(di);
+	di->blocksfree = blocks_free(di);
+}
+
+
+int di_track_blocks_free(DiskImage *di, int track) {
+	return di->trackfree[track];
+}
+
+
+/* count number of free blocks */
+int blocks_free(DiskImage *di) {
+	return di->freecount;
+}
+
+
+/* check if track, sector is free in BAM */
+int di_is_ts_free(DiskImage *di, TrackSector ts) {
+	if (ts.track == 0 || ts.track > MAXTRACKS) {
+		return 0;
+	}
+	return (di->freemap[ts.track] >> ts.sector) & 1;
+}
+
+
+/* update the mirror of the BAM for a block allocated (-1) or freed (+1) */
+static void count_ts(DiskImage *di, TrackSector ts, int delta) {
+	if (delta < 0) {
+		di->freemap[ts.track] &= ~(1ULL << ts.sector);
+	} else {
+		di->freemap[ts.track] |= 1ULL << ts.sector;
+	}
+	di->trackfree[ts.track] += delta;
+	if (ts.track != di->dir.track) {
+		di->freecount += delta;
+	}
+}
+
+
 /* allocate track, sector in BAM */
 void di_alloc_ts(DiskImage *di, TrackSector ts) {
 	unsigned char mask;
 	unsigned char *bam;
 
-	di->modified = 1;
+	count_ts(di, ts, -1);
 	switch (di->type) {
 	case D64:
 		bam = di_get_ts_addr(di, di->bam);
+		mark_dirty(di, bam);
 		bam[ts.track * 4] -= 1;
 		mask = 1<<(ts.sector & 7);
 		bam[ts.track * 4 + ts.sector / 8 + 1] &= ~mask;
@@ -445,20 +630,25 @@ void di_alloc_ts(DiskImage *di, TrackSector ts) {
 		mask = 1<<(ts.sector & 7);
 		if (ts.track < 36) {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 			bam[ts.track * 4] -= 1;
 			bam[ts.track * 4 + ts.sector / 8 + 1] &= ~mask;
 		} else {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 			bam[ts.track + 185] -= 1;
 			bam = di_get_ts_addr(di, di->bam2);
+			mark_dirty(di, bam);
 			bam[(ts.track - 35) * 3 + ts.sector / 8 - 3] &= ~mask;
 		}
 		break;
 	case D81:
 		if (ts.track < 41) {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 		} else {
 			bam = di_get_ts_addr(di, di->bam2);
+			mark_dirty(di, bam);
 			ts.track -= 40;
 		}
 		bam[ts.track * 6 + 10] -= 1;
@@ -469,10 +659,35 @@ void di_alloc_ts(DiskImage *di, TrackSector ts) {
 }
 
 
+/* first free sector of a track, starting the search at sector start and
+   wrapping around */
+static int first_free_sector(DiskImage *di, int track, int start) {
+	unsigned long long free, after;
+
+	free = di->freemap[track];
+	after = free >> start;
+	if (after) {
+		return start + __builtin_ctzll(after);
+	}
+	return __builtin_ctzll(free);
+}
+
+
+/* allocate the block of the track following prevts at the interleave, the
+   track having free blocks */
+static TrackSector alloc_on_track(DiskImage *di, TrackSector prevts, int track) {
+	TrackSector ts;
+
+	ts.track = track;
+	ts.sector = first_free_sector(di, track, (prevts.sector + di->interleave) % di_sectors_per_track(di->type, track));
+	di_alloc_ts(di, ts);
+	return ts;
+}
+
+
 /* allocate next available block */
 TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts) {
-	unsigned char *bam;
-	int spt, s1, s2, t1, t2, bpt, boff, res1, res2;
+	int s1, s2, t1, t2, res1, res2;
 	TrackSector ts;
 
 	switch (di->type) {
@@ -484,8 +699,6 @@ TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts) {
 		t2 = 35;
 		res1 = 18;
 		res2 = 0;
-		bpt = 4;
-		boff = 0;
 		break;
 	case D71:
 		s1 = 1;
@@ -494,8 +707,6 @@ TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts) {
 		t2 = 70;
 		res1 = 18;
 		res2 = 53;
-		bpt = 4;
-		boff = 0;
 		break;
 	case D81:
 		s1 = 1;
@@ -504,41 +715,19 @@ TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts) {
 		t2 = 80;
 		res1 = 40;
 		res2 = 0;
-		bpt = 6;
-		boff = 10;
 		break;
 	}
 
-	bam = di_get_ts_addr(di, di->bam);
 	for (ts.track = s1; ts.track <= t1; ++ts.track) {
-		if (ts.track != res1) {
-			if  (bam[ts.track * bpt + boff]) {
-				spt = di_sectors_per_track(di->type, ts.track);
-				ts.sector = (prevts.sector + di->interleave) % spt;
-				for (; ; ts.sector = (ts.sector + 1) % spt) {
-					if (di_is_ts_free(di, ts)) {
-						di_alloc_ts(di, ts);
-						return ts;
-					}
-				}
-			}
+		if (ts.track != res1 && di->trackfree[ts.track] && di->freemap[ts.track]) {
+			return alloc_on_track(di, prevts, ts.track);
 		}
 	}
 
 	if (di->type == D71 || di->type == D81) {
-		bam = di_get_ts_addr(di, di->bam2);
 		for (ts.track = s2; ts.track <= t2; ++ts.track) {
-			if (ts.track != res2) {
-				if  (bam[(ts.track - t1) * bpt + boff]) {
-					spt = di_sectors_per_track(di->type, ts.track);
-					ts.sector = (prevts.sector + di->interleave) % spt;
-					for (; ; ts.sector = (ts.sector + 1) % spt) {
-						if (di_is_ts_free(di, ts)) {
-							di_alloc_ts(di, ts);
-							return ts;
-						}
-					}
-				}
+			if (ts.track != res2 && di->trackfree[ts.track] && di->freemap[ts.track]) {
+				return alloc_on_track(di, prevts, ts.track);
 			}
 		}
 	}
@@ -549,6 +738,24 @@ TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts) {
 }
 
 
+/* allocate the block following prevts on the given track, as alloc_next_ts
+   does on the first track with free blocks, so that the callers can choose
+   the order of the tracks. Returns track 0 when the track is full or
+   reserved */
+TrackSector di_alloc_next_ts_on_track(DiskImage *di, TrackSector prevts, int track) {
+	TrackSector ts;
+
+	if (track >= 1 && track <= di_tracks(di->type) && track != di->dir.track
+	    && !(di->type == D71 && track == 53)
+	    && di->trackfree[track] && di->freemap[track]) {
+		return alloc_on_track(di, prevts, track);
+	}
+	ts.track = 0;
+	ts.sector = 0;
+	return ts;
+}
+
+
 /* allocate next available directory block */
 TrackSector alloc_next_dir_ts(DiskImage *di) {
 	unsigned char *p;
@@ -575,12 +782,13 @@ TrackSector alloc_next_dir_ts(DiskImage *di) {
 			if (di_is_ts_free(di, ts)) {
 				di_alloc_ts(di, ts);
 				p = di_get_ts_addr(di, lastts);
+				mark_dirty(di, p);
 				p[0] = ts.track;
 				p[1] = ts.sector;
 				p = di_get_ts_addr(di, ts);
+				mark_dirty(di, p);
 				memset(p, 0, 256);
 				p[1] = 0xff;
-				di->modified = 1;
 				return ts;
 			}
 		}
@@ -597,11 +805,12 @@ void di_free_ts(DiskImage *di, TrackSector ts) {
 	unsigned char mask;
 	unsigned char *bam;
 
-	di->modified = 1;
+	count_ts(di, ts, 1);
 	switch (di->type) {
 	case D64:
 		mask = 1<<(ts.sector & 7);
 		bam = di_get_ts_addr(di, di->bam);
+		mark_dirty(di, bam);
 		bam[ts.track * 4 + ts.sector / 8 + 1] |= mask;
 		bam[ts.track * 4] += 1;
 		break;
@@ -609,20 +818,25 @@ void di_free_ts(DiskImage *di, TrackSector ts) {
 		mask = 1<<(ts.sector & 7);
 		if (ts.track < 36) {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 			bam[ts.track * 4 + ts.sector / 8 + 1] |= mask;
 			bam[ts.track * 4] += 1;
 		} else {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 			bam[ts.track + 185] += 1;
 			bam = di_get_ts_addr(di, di->bam2);
+			mark_dirty(di, bam);
 			bam[(ts.track - 35) * 3 + ts.sector / 8 - 3] |= mask;
 		}
 		break;
 	case D81:
 		if (ts.track < 41) {
 			bam = di_get_ts_addr(di, di->bam);
+			mark_dirty(di, bam);
 		} else {
 			bam = di_get_ts_addr(di, di->bam2);
+			mark_dirty(di, bam);
 			ts.track -= 40;
 		}
 		mask = 1<<(ts.sector & 7);
@@ -635,72 +849,72 @@ void di_free_ts(DiskImage *di, TrackSector ts) {
 }
 
 
-/* free a chain of blocks */
+/* free a chain of blocks, stopping at invalid links and at blocks that are
+   already free, so that cyclic chains end */
 void free_chain(DiskImage *di, TrackSector ts) {
-	while (ts.track) {
+	while (ts.track && di_ts_is_valid(di->type, ts) && !di_is_ts_free(di, ts)) {
 		di_free_ts(di, ts);
 		ts = next_ts_in_chain(di, ts);
 	}
 }
 
 
-DiskImage *di_load_image(const char *name) {
-	FILE *file;
-	int filesize, l, read;
-	DiskImage *di;
-
-	/* open image */
-	if ((file = fopen(name, "rb")) == NULL) {
-		return NULL;
-	}
-
-	/* get file size*/
-	if (fseek(file, 0, SEEK_END)) {
-		fclose(file);
-		return NULL;
-	}
-	filesize = ftell(file);
-	fseek(file, 0, SEEK_SET);
+/* count the blocks free_chain would give back to blocks_free: the distinct
+   allocated blocks up to the first invalid link or free block, outside the
+   directory track */
+int di_chain_blocks_freed(DiskImage *di, TrackSector ts) {
+	unsigned char visited[MAXTRACKS * MAXSECTORS];
+	int blocks = 0, num;
 
-	if ((di = malloc(sizeof(*di))) == NULL) {
-		fclose(file);
-		return NULL;
+	memset(visited, 0, sizeof(visited));
+	while (ts.track && di_ts_is_valid(di->type, ts) && !di_is_ts_free(di, ts)) {
+		num = di_get_block_num(di->type, ts);
+		if (visited[num]) {
+			break;
+		}
+		visited[num] = 1;
+		if (ts.track != di->dir.track) {
+			++blocks;
+		}
+		ts = next_ts_in_chain(di, ts);
 	}
+	return blocks;
+}
 
-	di->size = filesize;
-
-	/* allocate buffer for image */
-	if ((di->image = malloc(filesize)) == NULL) {
-		free(di);
-		fclose(file);
-		return NULL;
-	}
 
-	/* read file into buffer */
-	read = 0;
-	while (read < filesize) {
-		if ((l = fread(di->image, 1, filesize - read, file))) {
-			read += l;
-		} else {
-			free(di->image);
-			free(di);
-			fclose(file);
-			return NULL;
-		}
+/* release the image buffer, whether read in memory or mapped */
+static void free_image_buffer(DiskImage *di) {
+	if (di->mapped) {
+		munmap(di->image, di->size);
+	} else {
+		free(di->image);
 	}
+}
 
-	fclose(file);
 
+/* finish loading an image whose contents are in di->image: check the type
+   and set up the bookkeeping. di is freed on failure */
+static DiskImage *setup_loaded_image(DiskImage *di, const char *name) {
 	di->errinfo = NULL;
+	di->overlay = NULL;
+	di->overlaymap = NULL;
+	di->journal = NULL;
+	di->shared = NULL;
+	di->snapshots = NULL;
+	di->nextsnapshot = NULL;
+	di->live = NULL;
+	di->sectors = NULL;
 
 	/* check image type */
-	switch (filesize) {
+	switch (di->size) {
 	case D64ERRSIZE: /* D64 with error info */
 		//di->errinfo = &(di->error_);
 	case D64SIZE: /* standard D64 */
 		di->type = D64;
 		di->bam.track = 18;
 		di->bam.sector = 0;
+		/* a single BAM sector */
+		di->bam2 = di->bam;
 		di->dir = di->bam;
 		break;
 
@@ -728,128 +942,701 @@ DiskImage *di_load_image(const char *name) {
 		break;
 
 	default:
-		free(di->image);
+		free_image_buffer(di);
 		free(di);
 		return NULL;
 	}
 
 	if ((di->filename = malloc(strlen(name) + 1)) == NULL) {
-		free(di->image);
+		free_image_buffer(di);
 		free(di);
+		return NULL;
 	}
 	strcpy(di->filename, name);
+	if ((di->dirty = calloc(dirty_size(di), 1)) == NULL) {
+		free(di->filename);
+		free_image_buffer(di);
+		free(di);
+		return NULL;
+	}
 	di->openfiles = 0;
+	load_bam(di);
 	di->blocksfree = blocks_free(di);
 	di->modified = 0;
 	di->interleave = interleave(di->type);
 	set_status(di, 254, 0, 0);
+	DI_PROBE3(load__image__return, di->filename, di->size, di->type);
 	return di;
 }
 
 
-DiskImage *di_create_image(char *name, int size) {
-	DiskImage *di;
+DiskImage *di_load_image(const char *name) {
+	FILE *file;
+	int filesize, l, read;
+	unsigned char *buffer;
 
-	if ((di = malloc(sizeof(*di))) == NULL) {
+	DI_PROBE1(load__image__entry, name);
+
+	/* open image */
+	if ((file = fopen(name, "rb")) == NULL) {
+		return NULL;
+	}
+
+	/* get file size*/
+	if (fseek(file, 0, SEEK_END)) {
+		fclose(file);
 		return NULL;
 	}
+	filesize = ftell(file);
+	fseek(file, 0, SEEK_SET);
 
 	/* allocate buffer for image */
-	if ((di->image = malloc(size)) == NULL) {
-		free(di);
+	if ((buffer = malloc(filesize)) == NULL) {
+		fclose(file);
 		return NULL;
 	}
-	memset(di->image, 0, size);
 
-	di->size = size;
+	/* read file into buffer */
+	read = 0;
+	while (read < filesize) {
+		if ((l = fread(buffer + read, 1, filesize - read, file))) {
+			read += l;
+		} else {
+			free(buffer);
+			fclose(file);
+			return NULL;
+		}
+	}
 
-	/* check image type */
-	switch (size) {
+	fclose(file);
 
-	case D64ERRSIZE: /* D64 with error info */
-		//di->errinfo = &(di->image[D64SIZE]);
-	case D64SIZE: /* standard D64 */
-		di->type = D64;
-		di->bam.track = 18;
-		di->bam.sector = 0;
-		di->dir = di->bam;
-		break;
+	return di_load_image_buffer(name, buffer, filesize);
+}
 
-	case D71ERRSIZE: /* D71 with error info */
-		//di->errinfo = &(di->image[D71SIZE]);
-	case D71SIZE:
-		di->type = D71;
-		di->bam.track = 18;
-		di->bam.sector = 0;
-		di->bam2.track = 53;
-		di->bam2.sector = 0;
-		di->dir = di->bam;
-		break;
 
-	case D81ERRSIZE: /* D81 with error info */
-		//di->errinfo = &(di->image[D81SIZE]);
-	case D81SIZE:
-		di->type = D81;
-		di->bam.track = 40;
-		di->bam.sector = 1;
-		di->bam2.track = 40;
-		di->bam2.sector = 2;
-		di->dir.track = 40;
-		di->dir.sector = 0;
-		break;
+/* load an image whose contents were read by the caller: buffer must come
+   from malloc, and belongs to the image from then on, even on failure */
+DiskImage *di_load_image_buffer(const char *name, unsigned char *buffer, int size) {
+	DiskImage *di;
 
-	default:
-		free(di->image);
-		free(di);
+	if ((di = malloc(sizeof(*di))) == NULL) {
+		free(buffer);
 		return NULL;
 	}
 
-	if ((di->filename = malloc(strlen(name) + 1)) == NULL) {
-		free(di->image);
-		free(di);
-		return NULL;
-	}
-	strcpy(di->filename, name);
-	di->openfiles = 0;
-	di->blocksfree = blocks_free(di);
-	di->modified = 1;
-	di->interleave = interleave(di->type);
-	set_status(di, 254, 0, 0);
+	di->size = size;
+	di->image = buffer;
+	di->mapped = 0;
+	return setup_loaded_image(di, name);
+}
+
+
+/* The overlay file holds the sectors written to an image whose own file is
+   left untouched: a header, the map of the sectors it holds, then the
+   sectors at the same offsets as in the image, past the map. The sectors that
+   were never written are holes, so that the file stays sparse. */
+#define OVERLAY_MAGIC "DIOVRLAY"
+#define OVERLAY_HEADER_SIZE 256
+
+static int overlay_data_offset(DiskImage *di) {
+	return OVERLAY_HEADER_SIZE + (dirty_size(di) + 255) / 256 * 256;
+}
+
+
+/* apply the sectors of the overlay file to the image, if it exists. Any
+   other failure to open it is an error: the first sync would otherwise
+   replace the sectors it holds */
+static int load_overlay(DiskImage *di) {
+	unsigned char header[OVERLAY_HEADER_SIZE];
+	int fd, sector, nbrsectors, offset, len, size;
+
+	if ((fd = open(di->overlay, O_RDONLY)) == -1) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (pread(fd, header, sizeof(header), 0) != sizeof(header)
+	    || memcmp(header, OVERLAY_MAGIC, 8) != 0) {
+		close(fd);
+		return -1;
+	}
+	size = get_le32(header + 8);
+	if (size != di->size
+	    || pread(fd, di->overlaymap, dirty_size(di), OVERLAY_HEADER_SIZE) != dirty_size(di)) {
+		close(fd);
+		return -1;
+	}
+	nbrsectors = (di->size + 255) / 256;
+	for (sector = 0; sector < nbrsectors; ++sector) {
+		if (di->overlaymap[sector / 8] & (1 << (sector & 7))) {
+			offset = sector * 256;
+			len = (offset + 256 < di->size ? 256 : di->size - offset);
+			if (pread(fd, di->image + offset, len, overlay_data_offset(di) + offset) != len) {
+				close(fd);
+				return -1;
+			}
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+
+/* load an image whose writes go to the overlay file instead: the image file
+   is mapped privately, so that only the pages of the sectors read from the
+   overlay or modified use memory of their own */
+DiskImage *di_load_image_overlay(const char *name, const char *overlay) {
+	struct stat st;
+	DiskImage *di;
+	int fd;
+
+	DI_PROBE1(load__image__entry, name);
+
+	if ((fd = open(name, O_RDONLY)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || (di = malloc(sizeof(*di))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	di->size = st.st_size;
+	di->image = mmap(NULL, di->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (di->image == MAP_FAILED) {
+		free(di);
+		return NULL;
+	}
+	di->mapped = 1;
+	if ((di = setup_loaded_image(di, name)) == NULL) {
+		return NULL;
+	}
+
+	if ((di->overlay = malloc(strlen(overlay) + 1)) == NULL
+	    || (di->overlaymap = calloc(dirty_size(di), 1)) == NULL) {
+		di_free_image(di);
+		return NULL;
+	}
+	strcpy(di->overlay, overlay);
+	if (load_overlay(di)) {
+		di_free_image(di);
+		return NULL;
+	}
+	load_bam(di);
+	di->blocksfree = blocks_free(di);
 	return di;
 }
 
 
-void di_sync(DiskImage *di) {
-	FILE *file;
-	int l, left;
-	unsigned char *image;
-
-	if ((file = fopen(di->filename, "wb"))) {
-		image = di->image;
-		left = di->size;
-		l = 0;
-		while (left) {
-			if ((l = fwrite(image, 1, left, file)) == 0) {
-				fclose(file);
-				return;
+/* write the dirty sectors to the overlay file, then its map. When durable,
+   they reach the disk before the map, and the map before returning */
+static int sync_overlay(DiskImage *di, int durable) {
+	unsigned char header[OVERLAY_HEADER_SIZE];
+	int fd, sector, nbrsectors, offset, len;
+
+	if ((fd = open(di->overlay, O_WRONLY | O_CREAT, 0666)) == -1) {
+		return -1;
+	}
+	nbrsectors = (di->size + 255) / 256;
+	for (sector = 0; sector < nbrsectors; ++sector) {
+		if (di->dirty[sector / 8] & (1 << (sector & 7))) {
+			offset = sector * 256;
+			len = (offset + 256 < di->size ? 256 : di->size - offset);
+			DI_PROBE3(sync__write, di->overlay, overlay_data_offset(di) + offset, len);
+			if (pwrite(fd, di->image + offset, len, overlay_data_offset(di) + offset) != len) {
+				close(fd);
+				return -1;
 			}
-			left -= l;
-			image += l;
+			di->overlaymap[sector / 8] |= 1 << (sector & 7);
 		}
-		fclose(file);
+	}
+
+	/* the map is written last, so that it never refers to missing sectors */
+	if (durable && fdatasync(fd)) {
+		close(fd);
+		return -1;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, OVERLAY_MAGIC, 8);
+	put_le32(header + 8, di->size);
+	if (pwrite(fd, di->overlaymap, dirty_size(di), OVERLAY_HEADER_SIZE) != dirty_size(di)
+	    || pwrite(fd, header, sizeof(header), 0) != sizeof(header)
+	    || (durable && fdatasync(fd))) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+
+DiskImage *di_create_image(char *name, int size) {
+	DiskImage *di;
+
+	if ((di = malloc(sizeof(*di))) == NULL) {
+		return NULL;
+	}
+
+	/* allocate buffer for image */
+	if ((di->image = malloc(size)) == NULL) {
+		free(di);
+		return NULL;
+	}
+	memset(di->image, 0, size);
+
+	di->size = size;
+	di->mapped = 0;
+	di->overlay = NULL;
+	di->overlaymap = NULL;
+	di->journal = NULL;
+	di->shared = NULL;
+	di->snapshots = NULL;
+	di->nextsnapshot = NULL;
+	di->live = NULL;
+	di->sectors = NULL;
+
+	/* check image type */
+	switch (size) {
+
+	case D64ERRSIZE: /* D64 with error info */
+		//di->errinfo = &(di->image[D64SIZE]);
+	case D64SIZE: /* standard D64 */
+		di->type = D64;
+		di->bam.track = 18;
+		di->bam.sector = 0;
+		/* a single BAM sector */
+		di->bam2 = di->bam;
+		di->dir = di->bam;
+		break;
+
+	case D71ERRSIZE: /* D71 with error info */
+		//di->errinfo = &(di->image[D71SIZE]);
+	case D71SIZE:
+		di->type = D71;
+		di->bam.track = 18;
+		di->bam.sector = 0;
+		di->bam2.track = 53;
+		di->bam2.sector = 0;
+		di->dir = di->bam;
+		break;
+
+	case D81ERRSIZE: /* D81 with error info */
+		//di->errinfo = &(di->image[D81SIZE]);
+	case D81SIZE:
+		di->type = D81;
+		di->bam.track = 40;
+		di->bam.sector = 1;
+		di->bam2.track = 40;
+		di->bam2.sector = 2;
+		di->dir.track = 40;
+		di->dir.sector = 0;
+		break;
+
+	default:
+		free(di->image);
+		free(di);
+		return NULL;
+	}
+
+	if ((di->filename = malloc(strlen(name) + 1)) == NULL) {
+		free(di->image);
+		free(di);
+		return NULL;
+	}
+	strcpy(di->filename, name);
+	if ((di->dirty = malloc(dirty_size(di))) == NULL) {
+		free(di->filename);
+		free(di->image);
+		free(di);
+		return NULL;
+	}
+	mark_all_dirty(di);
+	di->openfiles = 0;
+	load_bam(di);
+	di->blocksfree = blocks_free(di);
+	di->interleave = interleave(di->type);
+	set_status(di, 254, 0, 0);
+	return di;
+}
+
+
+/* write the dirty sectors back to the image file, one pwrite per run of
+   consecutive dirty sectors, without truncating the file. When durable, they
+   have reached the disk on return */
+static int sync_image_file(DiskImage *di, int durable) {
+	int fd, sector, first, nbrsectors, offset, len;
+
+	if ((fd = open(di->filename, O_WRONLY | O_CREAT, 0666)) == -1) {
+		return -1;
+	}
+	nbrsectors = (di->size + 255) / 256;
+	for (sector = 0; sector < nbrsectors; ) {
+		if ((di->dirty[sector / 8] & (1 << (sector & 7))) == 0) {
+			++sector;
+			continue;
+		}
+		first = sector;
+		while (sector < nbrsectors && (di->dirty[sector / 8] & (1 << (sector & 7)))) {
+			++sector;
+		}
+		offset = first * 256;
+		len = (sector * 256 < di->size ? sector * 256 : di->size) - offset;
+		DI_PROBE3(sync__write, di->filename, offset, len);
+		if (pwrite(fd, di->image + offset, len, offset) != len) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (durable && fdatasync(fd)) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+
+static int sync_dirty(DiskImage *di, int durable) {
+	if (di->overlay) {
+		return sync_overlay(di, durable);
+	}
+	return sync_image_file(di, durable);
+}
+
+
+/* The journal holds the dirty sectors of a di_sync in progress: a header with
+   the number of sectors and a checksum of the records, then a record per
+   sector, its number followed by its contents. It is on the disk before the
+   sectors are written in place, and emptied once they are, so that a sync
+   interrupted by a crash is either ignored, when the journal is incomplete,
+   or completed from the journal at the next di_set_journal. */
+#define JOURNAL_MAGIC "DIJOURNL"
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_RECORD_SIZE (4 + 256)
+
+/* FNV-1a, enough to tell a torn journal from a complete one */
+static unsigned int journal_checksum(unsigned char *p, int len) {
+	unsigned int hash = 2166136261u;
+
+	while (len--) {
+		hash = (hash ^ *p++) * 16777619u;
+	}
+	return hash;
+}
+
+
+/* write the dirty sectors to the journal, and wait for them to reach the
+   disk. Returns the number of sectors journaled, or -1 */
+static int write_journal(DiskImage *di) {
+	unsigned char *journal, *record;
+	int fd, sector, nbrsectors, nbrdirty, offset, len, size;
+
+	nbrsectors = (di->size + 255) / 256;
+	nbrdirty = 0;
+	for (sector = 0; sector < nbrsectors; ++sector) {
+		if (di->dirty[sector / 8] & (1 << (sector & 7))) {
+			++nbrdirty;
+		}
+	}
+	if (nbrdirty == 0) {
+		return 0;
+	}
+
+	size = JOURNAL_HEADER_SIZE + nbrdirty * JOURNAL_RECORD_SIZE;
+	if ((journal = calloc(size, 1)) == NULL) {
+		return -1;
+	}
+	record = journal + JOURNAL_HEADER_SIZE;
+	for (sector = 0; sector < nbrsectors; ++sector) {
+		if (di->dirty[sector / 8] & (1 << (sector & 7))) {
+			offset = sector * 256;
+			len = (offset + 256 < di->size ? 256 : di->size - offset);
+			put_le32(record, sector);
+			memcpy(record + 4, di->image + offset, len);
+			record += JOURNAL_RECORD_SIZE;
+		}
+	}
+	memcpy(journal, JOURNAL_MAGIC, 8);
+	put_le32(journal + 8, nbrdirty);
+	put_le32(journal + 12, journal_checksum(journal + JOURNAL_HEADER_SIZE, size - JOURNAL_HEADER_SIZE));
+
+	DI_PROBE3(journal__commit, di->journal, nbrdirty, size);
+	/* created by di_set_journal, whose directory entry is on the disk */
+	if ((fd = open(di->journal, O_WRONLY)) == -1) {
+		free(journal);
+		return -1;
+	}
+	if (pwrite(fd, journal, size, 0) != size || fdatasync(fd)) {
+		close(fd);
+		free(journal);
+		return -1;
+	}
+	free(journal);
+	if (close(fd) == -1) {
+		return -1;
+	}
+	return nbrdirty;
+}
+
+
+/* apply the sectors of a complete journal to the image, and flag them as
+   dirty. Returns their number, 0 when the journal is empty, missing or
+   incomplete, or -1 */
+static int read_journal(DiskImage *di) {
+	unsigned char *journal, *record;
+	unsigned int i, nbrrecords, nbrsectors, sector;
+	int fd, offset, len;
+	struct stat st;
+
+	if ((fd = open(di->journal, O_RDONLY)) == -1) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < JOURNAL_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+	if ((journal = malloc(st.st_size)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if (pread(fd, journal, st.st_size, 0) != st.st_size) {
+		close(fd);
+		free(journal);
+		return -1;
+	}
+	close(fd);
+
+	/* a torn header may hold any count: it is bounded by the size of the
+	   file and by the sectors of the image before the records are read */
+	nbrsectors = (di->size + 255) / 256;
+	nbrrecords = get_le32(journal + 8);
+	if (memcmp(journal, JOURNAL_MAGIC, 8) != 0
+	    || nbrrecords > (st.st_size - JOURNAL_HEADER_SIZE) / JOURNAL_RECORD_SIZE
+	    || nbrrecords > nbrsectors
+	    || get_le32(journal + 12) != journal_checksum(journal + JOURNAL_HEADER_SIZE, nbrrecords * JOURNAL_RECORD_SIZE)) {
+		free(journal);
+		return 0;
+	}
+
+	record = journal + JOURNAL_HEADER_SIZE;
+	for (i = 0; i < nbrrecords; ++i, record += JOURNAL_RECORD_SIZE) {
+		sector = get_le32(record);
+		if (sector >= nbrsectors) {
+			free(journal);
+			return -1;
+		}
+		offset = sector * 256;
+		len = (offset + 256 < di->size ? 256 : di->size - offset);
+		memcpy(di->image + offset, record + 4, len);
+		di->dirty[sector / 8] |= 1 << (sector & 7);
+	}
+	free(journal);
+	return nbrrecords;
+}
+
+
+/* fsync the directory holding a file, so that a file just created survives a
+   crash */
+static int sync_parent_directory(const char *filename) {
+	char *dirname, *slash;
+	int fd, result;
+
+	if ((dirname = malloc(strlen(filename) + 2)) == NULL) {
+		return -1;
+	}
+	strcpy(dirname, filename);
+	if ((slash = strrchr(dirname, '/')) == NULL) {
+		strcpy(dirname, ".");
+	} else if (slash == dirname) {
+		dirname[1] = 0;
+	} else {
+		*slash = 0;
+	}
+	fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	free(dirname);
+	if (fd == -1) {
+		return -1;
+	}
+	result = fsync(fd);
+	if (close(fd) == -1) {
+		return -1;
+	}
+	return result;
+}
+
+
+/* journal the writes of di_sync from now on, after completing the sync that
+   was interrupted, if any, since the journal was last used. The journal is
+   created empty here, once, with its directory synced, so that the syncs
+   never depend on a directory entry that may not be on the disk. Returns the
+   number of sectors recovered, or -1 */
+int di_set_journal(DiskImage *di, const char *journal) {
+	int fd, recovered;
+
+	free(di->journal);
+	if ((di->journal = malloc(strlen(journal) + 1)) == NULL) {
+		return -1;
+	}
+	strcpy(di->journal, journal);
+
+	if ((recovered = read_journal(di)) == -1) {
+		return -1;
+	}
+	if (recovered) {
+		if (sync_dirty(di, 1)) {
+			return -1;
+		}
+		memset(di->dirty, 0, dirty_size(di));
 		di->modified = 0;
+		load_bam(di);
+		di->blocksfree = blocks_free(di);
+	}
+	if ((fd = open(di->journal, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+		return -1;
+	}
+	if (close(fd) == -1 || sync_parent_directory(di->journal)) {
+		return -1;
+	}
+	return recovered;
+}
+
+
+/* write the dirty sectors back. With a journal, they have reached the disk on
+   return, and at most two fdatasyncs are needed whatever their number */
+int di_sync(DiskImage *di) {
+	int journaled;
+
+	journaled = 0;
+	if (di->journal) {
+		if ((journaled = write_journal(di)) == -1) {
+			return -1;
+		}
+		if (journaled == 0) {
+			di->modified = 0;
+			return 0;
+		}
+	}
+	if (sync_dirty(di, journaled)) {
+		return -1;
+	}
+	if (journaled && truncate(di->journal, 0)) {
+		return -1;
+	}
+	memset(di->dirty, 0, dirty_size(di));
+	di->modified = 0;
+	return 0;
+}
+
+
+/* di_sync and wait for the image file to reach the disk */
+int di_fsync(DiskImage *di) {
+	int fd, result;
+
+	if (di_sync(di)) {
+		return -1;
+	}
+	/* journaled syncs are already on the disk */
+	if (di->journal) {
+		return 0;
+	}
+	if ((fd = open(di->overlay ? di->overlay : di->filename, O_WRONLY | O_CREAT, 0666)) == -1) {
+		return -1;
+	}
+	result = fsync(fd);
+	close(fd);
+	return result;
+}
+
+
+/* take a read-only snapshot of the image. It shares the sectors of the image
+   until the image modifies them, so that taking it does not depend on the
+   size of the image. It is freed with di_free_image */
+DiskImage *di_snapshot(DiskImage *di) {
+	DiskImage *snapshot;
+
+	if (di->shared == NULL && (di->shared = malloc(dirty_size(di))) == NULL) {
+		return NULL;
+	}
+	if ((snapshot = malloc(sizeof(*snapshot))) == NULL) {
+		return NULL;
+	}
+	*snapshot = *di;
+	snapshot->sectors = calloc((di->size + 255) / 256, sizeof(unsigned char *));
+	snapshot->filename = malloc(strlen(di->filename) + 1);
+	if (snapshot->sectors == NULL || snapshot->filename == NULL) {
+		free(snapshot->sectors);
+		free(snapshot->filename);
+		free(snapshot);
+		return NULL;
 	}
+	strcpy(snapshot->filename, di->filename);
+	snapshot->mapped = 0;
+	snapshot->overlay = NULL;
+	snapshot->overlaymap = NULL;
+	snapshot->journal = NULL;
+	snapshot->errinfo = NULL;
+	snapshot->openfiles = 0;
+	snapshot->modified = 0;
+	snapshot->dirty = NULL;
+	snapshot->shared = NULL;
+	snapshot->snapshots = NULL;
+	snapshot->live = di;
+	snapshot->nextsnapshot = di->snapshots;
+	di->snapshots = snapshot;
+	memset(di->shared, 0xff, dirty_size(di));
+	return snapshot;
+}
+
+
+/* a snapshot dropped when it could not get its copy of a sector the image
+   modified */
+int di_snapshot_is_lost(DiskImage *di) {
+	return di->sectors != NULL && di->image == NULL;
+}
+
+
+static void free_snapshot(DiskImage *snapshot) {
+	int sector, nbrsectors;
+
+	if (snapshot->live) {
+		unlink_snapshot(snapshot);
+	}
+	nbrsectors = (snapshot->size + 255) / 256;
+	for (sector = 0; sector < nbrsectors; ++sector) {
+		free(snapshot->sectors[sector]);
+	}
+	free(snapshot->sectors);
+	free(snapshot->filename);
+	free(snapshot);
 }
 
 
 void di_free_image(DiskImage *di) {
+	DiskImage *snapshot;
+
+	if (di->sectors) {
+		free_snapshot(di);
+		return;
+	}
+	/* the snapshots outlive the image with their own copies of all its
+	   sectors */
+	if (di->shared) {
+		unshare_all_sectors(di);
+		for (snapshot = di->snapshots; snapshot; snapshot = snapshot->nextsnapshot) {
+			snapshot->live = NULL;
+		}
+		free(di->shared);
+	}
 	if (di->modified) {
 		di_sync(di);
 	}
 	if (di->filename) {
 		free(di->filename);
 	}
-	free(di->image);
+	free(di->dirty);
+	free(di->overlay);
+	free(di->overlaymap);
+	free(di->journal);
+	free_image_buffer(di);
 	free(di);
 }
 
@@ -910,7 +1697,7 @@ RawDirEntry *alloc_file_entry(DiskImage *di, unsigned char *rawname, FileType ty
 	int offset;
 
 	/* check if file already exists */
-	ts = next_ts_in_chain(di, di->bam);
+	ts = di_get_dir_ts(di);
 	while (ts.track) {
 		buffer = di_get_ts_addr(di, ts);
 		for (offset = 0; offset < 256; offset += 32) {
@@ -926,16 +1713,16 @@ RawDirEntry *alloc_file_entry(DiskImage *di, unsigned char *rawname, FileType ty
 	}
 
 	/* allocate empty slot */
-	ts = next_ts_in_chain(di, di->bam);
+	ts = di_get_dir_ts(di);
 	while (ts.track) {
 		buffer = di_get_ts_addr(di, ts);
 		for (offset = 0; offset < 256; offset += 32) {
 			rde = (RawDirEntry *)(buffer + offset);
 			if (rde->type == 0) {
+				mark_dirty(di, rde);
 				memset((unsigned char *)rde + 2, 0, 30);
 				memcpy(rde->rawname, rawname, 16);
 				rde->type = type;
-				di->modified = 1;
 				return rde;
 			}
 		}
@@ -947,10 +1734,10 @@ RawDirEntry *alloc_file_entry(DiskImage *di, unsigned char *rawname, FileType ty
 	ts = alloc_next_dir_ts(di);
 	if (ts.track) {
 		rde = (RawDirEntry *)di_get_ts_addr(di, ts);
+		mark_dirty(di, rde);
 		memset((unsigned char *)rde + 2, 0, 30);
 		memcpy(rde->rawname, rawname, 16);
 		rde->type = type;
-		di->modified = 1;
 		return rde;
 	} else {
 		set_status(di, 72, 0, 0);
@@ -960,12 +1747,47 @@ RawDirEntry *alloc_file_entry(DiskImage *di, unsigned char *rawname, FileType ty
 }
 
 
+/* set up imgfile for reading the chain starting at ts */
+static int open_chain(DiskImage *di, ImageFile *imgfile, TrackSector ts) {
+	unsigned char *p;
+
+	imgfile->ts = ts;
+
+	if (! di_ts_is_valid(di->type, imgfile->ts)) {
+		set_file_status(imgfile, 66, imgfile->ts.track, imgfile->ts.sector);
+		return 0;
+	}
+
+	p = di_get_ts_addr(di, ts);
+	imgfile->buffer = p + 2;
+	imgfile->nextts.track = p[0];
+	imgfile->nextts.sector = p[1];
+
+	if (imgfile->nextts.track == 0) {
+		if (imgfile->nextts.sector != 0) {
+			imgfile->buflen = imgfile->nextts.sector - 1;
+		} else {
+			imgfile->buflen = 254;
+		}
+	} else {
+		if (! di_ts_is_valid(di->type,imgfile->nextts)) {
+			set_file_status(imgfile, 66, imgfile->nextts.track, imgfile->nextts.sector);
+			return 0;
+		}
+		imgfile->buflen = 254;
+	}
+	return 1;
+}
+
+
 /* open a file */
 ImageFile *di_open(DiskImage *di, unsigned char *rawname, FileType type, char *mode) {
 	ImageFile *imgfile;
 	RawDirEntry *rde;
 	unsigned char *p;
 
+	DI_PROBE4(open, di->filename, rawname, type, mode);
+
 	set_status(di, 255, 0, 0);
 
 	if (strcmp("rb", mode) == 0) {
@@ -1001,31 +1823,11 @@ ImageFile *di_open(DiskImage *di, unsigned char *rawname, FileType type, char *m
 				return NULL;
 			}
 			imgfile->mode = 'r';
-			imgfile->ts = rde->startts;
-
-			if (! di_ts_is_valid(di->type, imgfile->ts)) {
-				set_status(di, 66, imgfile->ts.track, imgfile->ts.sector);
+			if (! open_chain(di, imgfile, rde->startts)) {
+				set_status(di, imgfile->status, imgfile->statusts.track, imgfile->statusts.sector);
+				free(imgfile);
 				return NULL;
 			}
-
-			p = di_get_ts_addr(di, rde->startts);
-			imgfile->buffer = p + 2;
-			imgfile->nextts.track = p[0];
-			imgfile->nextts.sector = p[1];
-
-			if (imgfile->nextts.track == 0) {
-				if (imgfile->nextts.sector != 0) {
-					imgfile->buflen = imgfile->nextts.sector - 1;
-				} else {
-					imgfile->buflen = 254;
-				}
-			} else {
-				if (! di_ts_is_valid(di->type,imgfile->nextts)) {
-					set_status(di, 66, imgfile->nextts.track, imgfile->nextts.sector);
-					return NULL;
-				}
-				imgfile->buflen = 254;
-			}
 		}
 
 	} else if (strcmp("wb", mode) == 0) {
@@ -1061,74 +1863,152 @@ ImageFile *di_open(DiskImage *di, unsigned char *rawname, FileType type, char *m
 }
 
 
-int di_read(ImageFile *imgfile, unsigned char *buffer, int len) {
+/* open a file for reading from a directory entry that has already been
+   looked up, without searching the directory again */
+ImageFile *di_open_entry(DiskImage *di, RawDirEntry *rde) {
+	ImageFile *imgfile;
+
+	imgfile = di_open_ts(di, rde->startts);
+	if (imgfile != NULL) {
+		imgfile->rawdirentry = rde;
+	}
+	return imgfile;
+}
+
+
+/* open the chain of blocks starting at ts for reading */
+ImageFile *di_open_ts(DiskImage *di, TrackSector ts) {
+	ImageFile *imgfile;
+
+	set_status(di, 255, 0, 0);
+
+	if ((imgfile = malloc(sizeof(*imgfile))) == NULL) {
+		return NULL;
+	}
+	if (di_open_ts_r(di, ts, imgfile)) {
+		set_status(di, imgfile->status, imgfile->statusts.track, imgfile->statusts.sector);
+		free(imgfile);
+		return NULL;
+	}
+
+	++(di->openfiles);
+	set_status(di, 0, 0, 0);
+	return imgfile;
+}
+
+
+/* reentrant variants: imgfile is provided by the caller, the image is not
+   modified and errors are only reported in imgfile->status, so any number of
+   threads can read the same image concurrently. The handles hold no
+   resources and must not be passed to di_close. */
+int di_open_entry_r(DiskImage *di, RawDirEntry *rde, ImageFile *imgfile) {
+	if (di_open_ts_r(di, rde->startts, imgfile) == 0) {
+		imgfile->rawdirentry = rde;
+	}
+	return imgfile->status;
+}
+
+
+int di_open_ts_r(DiskImage *di, TrackSector ts, ImageFile *imgfile) {
+	DI_PROBE4(open, di->filename, NULL, -1, "rb");
+
+	memset(imgfile->visited, 0, sizeof(imgfile->visited));
+	set_file_status(imgfile, 0, 0, 0);
+
+	imgfile->diskimage = di;
+	imgfile->rawdirentry = NULL;
+	imgfile->mode = 'r';
+	imgfile->position = 0;
+	imgfile->bufptr = 0;
+
+	open_chain(di, imgfile, ts);
+	return imgfile->status;
+}
+
+
+/* moves to the next block of the chain, returns 0 when the reading ends */
+static int read_next_block(ImageFile *imgfile) {
 	unsigned char *p;
+	int err;
+
+	if (imgfile->nextts.track == 0) {
+		return 0;
+	}
+	if (((imgfile->diskimage->type == D64) || (imgfile->diskimage->type == D71)) && imgfile->ts.track == 18 && imgfile->ts.sector == 0) {
+		imgfile->ts.track = 18;
+		imgfile->ts.sector = 1;
+	} else {
+		imgfile->ts = next_ts_in_chain(imgfile->diskimage, imgfile->ts);
+	}
+	if (imgfile->ts.track == 0) {
+		return 0;
+	}
+
+	/* check for cyclic files */
+	if (imgfile->visited[imgfile->ts.track - 1][imgfile->ts.sector]) {
+		/* return 52, file too long error */
+		set_file_status(imgfile, 52, imgfile->ts.track, imgfile->ts.sector);
+	} else {
+		imgfile->visited[imgfile->ts.track - 1][imgfile->ts.sector] = 1;
+	}
+
+	err = di_get_ts_err(imgfile->diskimage, imgfile->ts);
+	if(err) {
+		set_file_status(imgfile, err, imgfile->ts.track, imgfile->ts.sector);
+		return 0;
+	}
+
+	p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
+	imgfile->buffer = p + 2;
+	imgfile->nextts.track = p[0];
+	imgfile->nextts.sector = p[1];
+
+	if (imgfile->nextts.track == 0) {
+
+		if (imgfile->nextts.sector == 0) {
+			/* fixme, something is wrong if this happens, should be a proper error */
+			imgfile->buflen = 0;
+			set_file_status(imgfile, -1, imgfile->ts.track, imgfile->ts.sector);
+		} else {
+			imgfile->buflen = imgfile->nextts.sector - 1;
+		}
+
+	} else {
+
+		if (! di_ts_is_valid(imgfile->diskimage->type, imgfile->nextts)) {
+			set_file_status(imgfile, 66, imgfile->nextts.track, imgfile->nextts.sector);
+			return 0;
+		}
+
+		imgfile->buflen = 254;
+	}
+	imgfile->bufptr = 0;
+	return 1;
+}
+
+
+int di_read_r(ImageFile *imgfile, unsigned char *buffer, int len) {
 	int bytesleft;
 	int counter = 0;
 	int err;
 
+	DI_PROBE5(read, imgfile->diskimage->filename, imgfile->ts.track, imgfile->ts.sector, imgfile->position, len);
+
+	set_file_status(imgfile, 0, 0, 0);
+
 	while (len) {
 		bytesleft = imgfile->buflen - imgfile->bufptr;
 
 		err = di_get_ts_err(imgfile->diskimage, imgfile->ts);
 		if (err) {
-			set_status(imgfile->diskimage, err, imgfile->ts.track, imgfile->ts.sector);
+			set_file_status(imgfile, err, imgfile->ts.track, imgfile->ts.sector);
 			return counter;
 		}
 
 		if (bytesleft == 0) {
-			if (imgfile->nextts.track == 0) {
+			if (! read_next_block(imgfile)) {
 				return counter;
 			}
-			if (((imgfile->diskimage->type == D64) || (imgfile->diskimage->type == D71)) && imgfile->ts.track == 18 && imgfile->ts.sector == 0) {
-				imgfile->ts.track = 18;
-				imgfile->ts.sector = 1;
-			} else {
-				imgfile->ts = next_ts_in_chain(imgfile->diskimage, imgfile->ts);
-			}
-			if (imgfile->ts.track == 0) {
-				return counter;
-			}
-
-			/* check for cyclic files */
-			if (imgfile->visited[imgfile->ts.track][imgfile->ts.sector]) {
-				/* return 52, file too long error */
-				set_status(imgfile->diskimage, 52, imgfile->ts.track, imgfile->ts.sector);
-			} else {
-				imgfile->visited[imgfile->ts.track][imgfile->ts.sector] = 1;
-			}
-
-			err = di_get_ts_err(imgfile->diskimage, imgfile->ts);
-			if(err) {
-				set_status(imgfile->diskimage, err, imgfile->ts.track, imgfile->ts.sector);
-				return counter;
-			}
-
-			p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
-			imgfile->buffer = p + 2;
-			imgfile->nextts.track = p[0];
-			imgfile->nextts.sector = p[1];
-
-			if (imgfile->nextts.track == 0) {
-
-				if (imgfile->nextts.sector == 0) {
-					/* fixme, something is wrong if this happens, should be a proper error */
-					imgfile->buflen = 0;
-					set_status(imgfile->diskimage, -1, imgfile->ts.track, imgfile->ts.sector);
-				} else {
-					imgfile->buflen = imgfile->nextts.sector - 1;
-				}
-
-			} else {
-
-				if (! di_ts_is_valid(imgfile->diskimage->type, imgfile->nextts)) {
-					set_status(imgfile->diskimage, 66, imgfile->nextts.track, imgfile->nextts.sector);
-					return counter;
-				}
-
-				imgfile->buflen = 254;
-			}
-			imgfile->bufptr = 0;
 		} else {
 			if (len >= bytesleft) {
 				while (bytesleft) {
@@ -1153,6 +2033,51 @@ int di_read(ImageFile *imgfile, unsigned char *buffer, int len) {
 }
 
 
+/* points data to the rest of the current block, in the image, and moves past
+   it; returns its length, 0 at the end of the file */
+int di_read_block_r(ImageFile *imgfile, unsigned char **data) {
+	int bytesleft;
+	int err;
+
+	DI_PROBE5(read, imgfile->diskimage->filename, imgfile->ts.track, imgfile->ts.sector, imgfile->position, 254);
+
+	set_file_status(imgfile, 0, 0, 0);
+
+	while (1) {
+		bytesleft = imgfile->buflen - imgfile->bufptr;
+
+		err = di_get_ts_err(imgfile->diskimage, imgfile->ts);
+		if (err) {
+			set_file_status(imgfile, err, imgfile->ts.track, imgfile->ts.sector);
+			return 0;
+		}
+
+		if (bytesleft) {
+			break;
+		}
+		if (! read_next_block(imgfile)) {
+			return 0;
+		}
+	}
+
+	*data = imgfile->buffer + imgfile->bufptr;
+	imgfile->bufptr += bytesleft;
+	imgfile->position += bytesleft;
+	return bytesleft;
+}
+
+
+int di_read(ImageFile *imgfile, unsigned char *buffer, int len) {
+	int counter;
+
+	counter = di_read_r(imgfile, buffer, len);
+	if (imgfile->status) {
+		set_status(imgfile->diskimage, imgfile->status, imgfile->statusts.track, imgfile->statusts.sector);
+	}
+	return counter;
+}
+
+
 int di_write(ImageFile *imgfile, unsigned char *buffer, int len) {
 	unsigned char *p;
 	int bytesleft;
@@ -1166,15 +2091,18 @@ int di_write(ImageFile *imgfile, unsigned char *buffer, int len) {
 				return counter;
 			}
 			imgfile->nextts = alloc_next_ts(imgfile->diskimage, imgfile->ts);
+			mark_dirty(imgfile->diskimage, imgfile->rawdirentry);
 			if (imgfile->ts.track == 0) {
 				imgfile->rawdirentry->startts = imgfile->nextts;
 			} else {
 				p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
+				mark_dirty(imgfile->diskimage, p);
 				p[0] = imgfile->nextts.track;
 				p[1] = imgfile->nextts.sector;
 			}
 			imgfile->ts = imgfile->nextts;
 			p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
+			mark_dirty(imgfile->diskimage, p);
 			p[0] = 0;
 			p[1] = 0xff;
 			memcpy(p + 2, imgfile->buffer, 254);
@@ -1211,6 +2139,7 @@ void di_close(ImageFile *imgfile) {
 	unsigned char *p;
 
 	if (imgfile->mode == 'w') {
+		mark_dirty(imgfile->diskimage, imgfile->rawdirentry);
 		if (imgfile->bufptr) {
 			if (imgfile->diskimage->blocksfree) {
 				imgfile->nextts = alloc_next_ts(imgfile->diskimage, imgfile->ts);
@@ -1218,14 +2147,17 @@ void di_close(ImageFile *imgfile) {
 					imgfile->rawdirentry->startts = imgfile->nextts;
 				} else {
 					p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
+					mark_dirty(imgfile->diskimage, p);
 					p[0] = imgfile->nextts.track;
 					p[1] = imgfile->nextts.sector;
 				}
 				imgfile->ts = imgfile->nextts;
 				p = di_get_ts_addr(imgfile->diskimage, imgfile->ts);
+				mark_dirty(imgfile->diskimage, p);
 				p[0] = 0;
-				p[1] = 0xff;
-				memcpy(p + 2, imgfile->buffer, 254);
+				/* index of the last used byte */
+				p[1] = imgfile->bufptr + 1;
+				memcpy(p + 2, imgfile->buffer, imgfile->bufptr);
 				imgfile->bufptr = 0;
 				if (++(imgfile->rawdirentry->sizelo) == 0) {
 					++(imgfile->rawdirentry->sizehi);
@@ -1243,11 +2175,79 @@ void di_close(ImageFile *imgfile) {
 }
 
 
+/* replace the contents of the file of a directory entry with len bytes of
+   data: the old chain is freed and the new one allocated in a single pass */
+int di_write_entry(DiskImage *di, RawDirEntry *rde, unsigned char *data, int len) {
+	unsigned char *p;
+	int blocks, i, used;
+	TrackSector ts, prevts;
+
+	blocks = (len + 253) / 254;
+	if (blocks > blocks_free(di) + di_chain_blocks_freed(di, rde->startts)) {
+		return set_status(di, 72, 0, 0);
+	}
+
+	free_chain(di, rde->startts);
+	mark_dirty(di, rde);
+	rde->startts.track = 0;
+	rde->startts.sector = 0;
+
+	prevts.track = 0;
+	prevts.sector = 0;
+	for (i = 0; i < blocks; ++i) {
+		ts = alloc_next_ts(di, prevts);
+		if (ts.track == 0) {
+			di->blocksfree = blocks_free(di);
+			return set_status(di, 72, 0, 0);
+		}
+		if (prevts.track == 0) {
+			rde->startts = ts;
+		} else {
+			p = di_get_ts_addr(di, prevts);
+			p[0] = ts.track;
+			p[1] = ts.sector;
+		}
+		used = (i == blocks - 1) ? len - i * 254 : 254;
+		p = di_get_ts_addr(di, ts);
+		mark_dirty(di, p);
+		p[0] = 0;
+		p[1] = used + 1;
+		memcpy(p + 2, data + i * 254, used);
+		memset(p + 2 + used, 0, 254 - used);
+		prevts = ts;
+	}
+
+	rde->sizelo = blocks & 0xff;
+	rde->sizehi = blocks >> 8;
+	rde->type |= 0x80;
+	di->blocksfree = blocks_free(di);
+	return set_status(di, 0, 0, 0);
+}
+
+
+/* scratch the file of a directory entry */
+int di_delete_entry(DiskImage *di, RawDirEntry *rde) {
+	free_chain(di, rde->startts);
+	mark_dirty(di, rde);
+	rde->type = 0;
+	di->blocksfree = blocks_free(di);
+	return set_status(di, 1, 1, 0);
+}
+
+
+/* rename the file of a directory entry */
+int di_rename_entry(DiskImage *di, RawDirEntry *rde, unsigned char *newrawname) {
+	mark_dirty(di, rde);
+	memcpy(rde->rawname, newrawname, 16);
+	return set_status(di, 0, 0, 0);
+}
+
+
 int di_format(DiskImage *di, unsigned char *rawname, unsigned char *rawid) {
 	unsigned char *p;
 	TrackSector ts;
 
-	di->modified = 1;
+	mark_all_dirty(di);
 
 	/* erase disk */
 	if (rawid) {
@@ -1441,6 +2441,8 @@ int di_format(DiskImage *di, unsigned char *rawname, unsigned char *rawid) {
 
 	}
 
+	/* the BAM was rewritten in place */
+	load_bam(di);
 	di->blocksfree = blocks_free(di);
 
 	return set_status(di, 0, 0, 0);
@@ -1458,6 +2460,7 @@ int di_delete(DiskImage *di, unsigned char *rawpattern, FileType type) {
 	case T_USR:
 		while ((rde = find_file_entry(di, rawpattern, type))) {
 			free_chain(di, rde->startts);
+			mark_dirty(di, rde);
 			rde->type = 0;
 			++delcount;
 		}
@@ -1480,6 +2483,7 @@ int di_rename(DiskImage *di, unsigned char *oldrawname, unsigned char *newrawnam
 	RawDirEntry *rde;
 
 	if ((rde = find_file_entry(di, oldrawname, type))) {
+		mark_dirty(di, rde);
 		memcpy(rde->rawname, newrawname, 16);
 		return set_status(di, 0, 0, 0);
 	} else {
@@ -35,6 +35,15 @@ typedef struct diskimage {
   int size;
   ImageType type;
   unsigned char *image;
+  int mapped; /* image is a private mapping of the file */
+  char *overlay; /* file receiving the writes instead of filename, NULL when none */
+  unsigned char *overlaymap; /* one bit per sector stored in the overlay */
+  char *journal; /* write-ahead journal of di_sync, NULL when none */
+  unsigned char *shared; /* one bit per sector shared with a snapshot, NULL without snapshots */
+  struct diskimage *snapshots; /* taken with di_snapshot, linked by nextsnapshot */
+  struct diskimage *nextsnapshot;
+  struct diskimage *live; /* snapshot: the image it shares its unmodified sectors with */
+  unsigned char **sectors; /* snapshot: its copies of the sectors modified since, NULL when shared */
   unsigned char *errinfo;
   TrackSector bam;
   TrackSector bam2;
@@ -42,6 +51,10 @@ typedef struct diskimage {
   int openfiles;
   int blocksfree;
   int modified;
+  unsigned char *dirty; /* one bit per sector modified since the last di_sync */
+  unsigned long long freemap[MAXTRACKS + 1]; /* bit n set when sector n of the track is free */
+  int trackfree[MAXTRACKS + 1]; /* free sector counts of the BAM */
+  int freecount; /* free blocks outside of the directory track */
   int status;
   int interleave;
   TrackSector statusts;
@@ -71,31 +84,58 @@ typedef struct imagefile {
   int bufptr;
   int buflen;
   unsigned char visited[MAXTRACKS][MAXSECTORS];
+  int status;
+  TrackSector statusts;
 } ImageFile;
 
 
 DiskImage *di_load_image(const char *name);
+DiskImage *di_load_image_buffer(const char *name, unsigned char *buffer, int size);
+DiskImage *di_load_image_overlay(const char *name, const char *overlay);
+int di_set_journal(DiskImage *di, const char *journal);
+DiskImage *di_snapshot(DiskImage *di);
+int di_snapshot_is_lost(DiskImage *di);
 DiskImage *di_create_image(char *name, int size);
 void di_free_image(DiskImage *di);
-void di_sync(DiskImage *di);
+int di_sync(DiskImage *di);
+int di_fsync(DiskImage *di);
 
 int di_status(DiskImage *di, char *status);
 
 ImageFile *di_open(DiskImage *di, unsigned char *rawname, FileType type, char *mode);
+ImageFile *di_open_entry(DiskImage *di, RawDirEntry *rde);
+ImageFile *di_open_ts(DiskImage *di, TrackSector ts);
 void di_close(ImageFile *imgfile);
 int di_read(ImageFile *imgfile, unsigned char *buffer, int len);
+
+/* reentrant, read-only variants that leave the image untouched and report
+   errors in imgfile->status */
+int di_open_entry_r(DiskImage *di, RawDirEntry *rde, ImageFile *imgfile);
+int di_open_ts_r(DiskImage *di, TrackSector ts, ImageFile *imgfile);
+int di_read_r(ImageFile *imgfile, unsigned char *buffer, int len);
+int di_read_block_r(ImageFile *imgfile, unsigned char **data);
 int di_write(ImageFile *imgfile, unsigned char *buffer, int len);
 
 unsigned char *di_get_ts_addr(DiskImage *di, TrackSector ts);
+/* blocks modified through di_get_ts_addr must be flagged for di_sync, before
+   being modified so that the snapshots keep their previous contents */
+void di_mark_dirty(DiskImage *di, TrackSector ts);
 int di_get_ts_err(DiskImage *di, TrackSector ts);
 
 int di_format(DiskImage *di, unsigned char *rawname, unsigned char *rawid);
 int di_delete(DiskImage *di, unsigned char *rawpattern, FileType type);
 int di_rename(DiskImage *di, unsigned char *oldrawname, unsigned char *newrawname, FileType type);
 
+/* direct access to files whose directory entry has already been looked up */
+RawDirEntry *alloc_file_entry(DiskImage *di, unsigned char *rawname, FileType type);
+int di_write_entry(DiskImage *di, RawDirEntry *rde, unsigned char *data, int len);
+int di_delete_entry(DiskImage *di, RawDirEntry *rde);
+int di_rename_entry(DiskImage *di, RawDirEntry *rde, unsigned char *newrawname);
+
 int di_sectors_per_track(ImageType type, int track);
 int di_tracks(ImageType type);
 int di_get_block_num(ImageType type, TrackSector ts);
+int di_ts_is_valid(ImageType type, TrackSector ts);
 
 TrackSector di_get_dir_ts(DiskImage *di);
 unsigned char *di_title(DiskImage *di);
@@ -104,6 +144,13 @@ int di_is_ts_free(DiskImage *di, TrackSector ts);
 void di_alloc_ts(DiskImage *di, TrackSector ts);
 void di_free_ts(DiskImage *di, TrackSector ts);
 TrackSector next_ts_in_chain (DiskImage *di, TrackSector ts);
+int blocks_free(DiskImage *di);
+void di_reload_bam(DiskImage *di);
+int di_chain_blocks_freed(DiskImage *di, TrackSector ts);
+TrackSector alloc_next_ts(DiskImage *di, TrackSector prevts);
+TrackSector di_alloc_next_ts_on_track(DiskImage *di, TrackSector prevts, int track);
+RawDirEntry *find_file_entry(DiskImage *di, unsigned char *rawpattern, FileType type);
 
 int di_rawname_from_name(unsigned char *rawname, char *name);
+int match_pattern(unsigned char *rawpattern, unsigned char *rawname);
 int di_name_from_rawname(char *name, unsigned char *rawname);
@@ -0,0 +1,35 @@
+#ifndef DISKIMAGE_PROBES_H
+#define DISKIMAGE_PROBES_H
+
+/* USDT probes of the "di64base" provider:
+
+   load__image__entry (name)
+   load__image__return (name, size, type)
+   open (image, rawname, type, mode)
+   read (image, track, sector, position, len)
+   chain__next (image, track, sector, nexttrack, nextsector)
+   sync__write (image, offset, len)
+   journal__commit (journal, sectors, len)
+
+   The arguments are plain fields, so the probes need no semaphore and cost a
+   nop per site when no tracer is attached. */
+
+#if DI_USDT
+
+#include <sys/sdt.h>
+
+#define DI_PROBE1(name, a1) DTRACE_PROBE1(di64base, name, a1)
+#define DI_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(di64base, name, a1, a2, a3)
+#define DI_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(di64base, name, a1, a2, a3, a4)
+#define DI_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(di64base, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define DI_PROBE1(name, a1) do { } while (0)
+#define DI_PROBE3(name, a1, a2, a3) do { } while (0)
+#define DI_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define DI_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
+
+#endif
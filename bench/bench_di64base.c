@@ -0,0 +1,333 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "bench_images.h"
+#include "corpus.h"
+#include "utils.h"
+
+/* Library microbenchmarks: measures the di64base primitives used by d64-fuse
+   on generated images, without going through FUSE. Results are written as
+   JSON. */
+
+#define LOAD_ROUNDS 200
+#define FIND_ROUNDS 200
+#define READ_ROUNDS 50
+#define BLOCKS_FREE_ROUNDS 20000
+#define ALLOC_BLOCKS 64
+#define ALLOC_ROUNDS 200
+#define TS_ADDR_ROUNDS 200
+
+static const bench_image_spec image_specs[] = {
+  {"D64 CONTIGUOUS", D64SIZE, 64, 2000, false},
+  {"D64 FRAGMENTED", D64SIZE, 64, 2000, true},
+  {"D71 CONTIGUOUS", D71SIZE, 32, 4000, false},
+  {"D71 FRAGMENTED", D71SIZE, 32, 4000, true},
+  {"D81 CONTIGUOUS", D81SIZE, 32, 10000, false},
+  {"D81 FRAGMENTED", D81SIZE, 32, 10000, true},
+};
+
+#define NBR_IMAGE_SPECS (sizeof (image_specs) / sizeof (image_specs[0]))
+
+typedef struct image_results
+{
+  const bench_image_spec *spec;
+  double load_us;
+  double find_hit_ns;
+  double find_miss_ns;
+  double read_mb_per_s;
+  double read_by_entry_mb_per_s;
+  double blocks_free_ns;
+  double alloc_ns;
+  double ts_addr_ns;
+} image_results;
+
+/* keeps the compiler from discarding the measured calls */
+static volatile uintptr_t sink;
+
+static uint64_t now_ns ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void file_rawname (unsigned char *rawname, size_t file_nbr)
+{
+  char name[32];
+
+  snprintf (name, sizeof (name), CORPUS_FILE_NAME, file_nbr);
+  di_rawname_from_name (rawname, name);
+}
+
+static double bench_load (const char *image_filename)
+{
+  uint64_t start = now_ns ();
+  for (size_t round = 0; round < LOAD_ROUNDS; round++)
+    {
+      DiskImage *disk_image = di_load_image (image_filename);
+      if (is_null (disk_image))
+        return -1;
+      sink += (uintptr_t) disk_image->image[0];
+      di_free_image (disk_image);
+    }
+
+  return (now_ns () - start) / 1e3 / LOAD_ROUNDS;
+}
+
+static double bench_find (DiskImage *disk_image, size_t nbr_files, bool hit)
+{
+  unsigned char rawname[16];
+
+  uint64_t start = now_ns ();
+  for (size_t round = 0; round < FIND_ROUNDS; round++)
+    for (size_t i = 0; i < nbr_files; i++)
+      {
+        file_rawname (rawname, hit ? i : nbr_files + i);
+        sink += (uintptr_t) find_file_entry (disk_image, rawname, T_PRG);
+      }
+
+  return (double) (now_ns () - start) / (FIND_ROUNDS * nbr_files);
+}
+
+/* by_entry opens the files from their directory entries, looked up once
+   beforehand, instead of by name */
+static double bench_read (DiskImage *disk_image, const bench_image_spec *spec, bool by_entry)
+{
+  unsigned char rawname[16];
+  unsigned char *buffer = malloc (spec->file_size + CORPUS_BLOCK_SIZE);
+  RawDirEntry **entries = calloc (spec->nbr_files, sizeof (RawDirEntry *));
+  if (is_null (buffer) or is_null (entries))
+    {
+      free (buffer);
+      free (entries);
+      return -1;
+    }
+
+  for (size_t i = 0; i < spec->nbr_files; i++)
+    {
+      file_rawname (rawname, i);
+      entries[i] = find_file_entry (disk_image, rawname, T_PRG);
+    }
+
+  uint64_t bytes_read = 0;
+  uint64_t start = now_ns ();
+  for (size_t round = 0; round < READ_ROUNDS; round++)
+    for (size_t i = 0; i < spec->nbr_files; i++)
+      {
+        ImageFile *image_file;
+        if (by_entry)
+          image_file = di_open_entry (disk_image, entries[i]);
+        else
+          {
+            file_rawname (rawname, i);
+            image_file = di_open (disk_image, rawname, T_PRG, "rb");
+          }
+        if (is_null (image_file))
+          {
+            free (buffer);
+            free (entries);
+            return -1;
+          }
+        bytes_read += di_read (image_file, buffer, spec->file_size + CORPUS_BLOCK_SIZE);
+        di_close (image_file);
+      }
+  double elapsed = (now_ns () - start) / 1e9;
+
+  free (buffer);
+  free (entries);
+
+  return bytes_read / elapsed / (1024 * 1024);
+}
+
+static double bench_blocks_free (DiskImage *disk_image)
+{
+  uint64_t start = now_ns ();
+  for (size_t round = 0; round < BLOCKS_FREE_ROUNDS; round++)
+    sink += blocks_free (disk_image);
+
+  return (double) (now_ns () - start) / BLOCKS_FREE_ROUNDS;
+}
+
+/* allocates ALLOC_BLOCKS chained blocks and frees them again, so the image
+   is left as it was */
+static double bench_alloc (DiskImage *disk_image)
+{
+  TrackSector blocks[ALLOC_BLOCKS];
+  uint64_t elapsed = 0;
+
+  for (size_t round = 0; round < ALLOC_ROUNDS; round++)
+    {
+      TrackSector previous = {0, 0};
+      uint64_t start = now_ns ();
+      for (size_t i = 0; i < ALLOC_BLOCKS; i++)
+        previous = blocks[i] = alloc_next_ts (disk_image, previous);
+      elapsed += now_ns () - start;
+
+      for (size_t i = 0; i < ALLOC_BLOCKS; i++)
+        {
+          if (blocks[i].track == 0)
+            return -1;
+          di_free_ts (disk_image, blocks[i]);
+        }
+    }
+  disk_image->modified = 0;
+
+  return (double) elapsed / (ALLOC_ROUNDS * ALLOC_BLOCKS);
+}
+
+static double bench_ts_addr (DiskImage *disk_image)
+{
+  int nbr_tracks = di_tracks (disk_image->type);
+  uint64_t translations = 0;
+  uintptr_t sum = 0;
+
+  uint64_t start = now_ns ();
+  for (size_t round = 0; round < TS_ADDR_ROUNDS; round++)
+    for (int track = 1; track <= nbr_tracks; track++)
+      {
+        int nbr_sectors = di_sectors_per_track (disk_image->type, track);
+        for (int sector = 0; sector < nbr_sectors; sector++)
+          {
+            TrackSector ts = {track, sector};
+            sum += (uintptr_t) di_get_ts_addr (disk_image, ts);
+          }
+        translations += nbr_sectors;
+      }
+  double elapsed = now_ns () - start;
+  sink += sum;
+
+  return elapsed / translations;
+}
+
+static int bench_image (const char *work_dir, size_t image_nbr, image_results *results)
+{
+  const bench_image_spec *spec = image_specs + image_nbr;
+  char image_filename[PATH_MAX];
+
+  snprintf (image_filename, sizeof (image_filename), "%s/image%zu", work_dir, image_nbr);
+  if (bench_create_image (image_filename, spec) != 0)
+    {
+      fprintf (stderr, "Cannot create the image for %s\n", spec->name);
+      return -1;
+    }
+
+  results->spec = spec;
+  results->load_us = bench_load (image_filename);
+
+  int result = -1;
+  DiskImage *disk_image = di_load_image (image_filename);
+  if (is_not_null (disk_image))
+    {
+      results->find_hit_ns = bench_find (disk_image, spec->nbr_files, true);
+      results->find_miss_ns = bench_find (disk_image, spec->nbr_files, false);
+      results->read_mb_per_s = bench_read (disk_image, spec, false);
+      results->read_by_entry_mb_per_s = bench_read (disk_image, spec, true);
+      results->blocks_free_ns = bench_blocks_free (disk_image);
+      results->alloc_ns = bench_alloc (disk_image);
+      results->ts_addr_ns = bench_ts_addr (disk_image);
+      di_free_image (disk_image);
+
+      if (results->load_us >= 0 and results->read_mb_per_s >= 0 and results->read_by_entry_mb_per_s >= 0 and results->alloc_ns >= 0)
+        result = 0;
+    }
+  unlink (image_filename);
+
+  return result;
+}
+
+static void write_json (FILE *output, const image_results *results, size_t nbr_results)
+{
+  fprintf (output, "{\n  \"benchmark\": \"di64base\",\n  \"timestamp\": %ld,\n  \"images\": [\n", (long) time (NULL));
+  for (size_t i = 0; i < nbr_results; i++)
+    {
+      const image_results *result = results + i;
+      fprintf (output, "    {\n");
+      fprintf (output, "      \"name\": \"%s\",\n", result->spec->name);
+      fprintf (output, "      \"image_size\": %d,\n", result->spec->image_size);
+      fprintf (output, "      \"files\": %zu,\n", result->spec->nbr_files);
+      fprintf (output, "      \"file_size\": %zu,\n", result->spec->file_size);
+      fprintf (output, "      \"fragmented\": %s,\n", result->spec->fragmented ? "true" : "false");
+      fprintf (output, "      \"load_image_us\": %.2f,\n", result->load_us);
+      fprintf (output, "      \"find_file_entry_hit_ns\": %.1f,\n", result->find_hit_ns);
+      fprintf (output, "      \"find_file_entry_miss_ns\": %.1f,\n", result->find_miss_ns);
+      fprintf (output, "      \"open_read_mb_per_s\": %.2f,\n", result->read_mb_per_s);
+      fprintf (output, "      \"open_entry_read_mb_per_s\": %.2f,\n", result->read_by_entry_mb_per_s);
+      fprintf (output, "      \"blocks_free_ns\": %.1f,\n", result->blocks_free_ns);
+      fprintf (output, "      \"alloc_next_ts_ns\": %.1f,\n", result->alloc_ns);
+      fprintf (output, "      \"get_ts_addr_ns\": %.2f\n", result->ts_addr_ns);
+      fprintf (output, "    }%s\n", (i + 1 < nbr_results) ? "," : "");
+    }
+  fprintf (output, "  ]\n}\n");
+}
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s [--output=<file>]\n", progname);
+}
+
+int main (int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *output_filename = NULL;
+
+  int option;
+  while ((option = getopt_long (argc, argv, "o:h", long_options, NULL)) != -1)
+    switch (option)
+      {
+      case 'o':
+        output_filename = optarg;
+        break;
+      default:
+        show_help (argv[0]);
+        return -1;
+      }
+
+  char work_dir[] = "/tmp/d64-bench.XXXXXX";
+  if (is_null (mkdtemp (work_dir)))
+    {
+      perror ("Cannot create the work directory");
+      return -1;
+    }
+
+  image_results results[NBR_IMAGE_SPECS];
+  size_t nbr_results = 0;
+  int status = 0;
+  for (size_t i = 0; i < NBR_IMAGE_SPECS; i++)
+    {
+      fprintf (stderr, "benchmarking %s...\n", image_specs[i].name);
+      if (bench_image (work_dir, i, results + nbr_results) == 0)
+        nbr_results++;
+      else
+        status = -1;
+    }
+  rmdir (work_dir);
+
+  FILE *output = stdout;
+  if (is_not_null (output_filename))
+    {
+      output = fopen (output_filename, "w");
+      if (is_null (output))
+        {
+          perror ("Cannot open the output file");
+          return -1;
+        }
+    }
+  write_json (output, results, nbr_results);
+  if (output != stdout)
+    fclose (output);
+
+  return status;
+}
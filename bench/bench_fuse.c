@@ -0,0 +1,411 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "bench_images.h"
+#include "utils.h"
+
+/* End-to-end benchmark: mounts generated images with d64-fuse in a temporary
+   directory and measures the mount time, readdir, stat and read performance
+   as seen through the kernel. Results are written as JSON. */
+
+#ifndef D64FUSE_BINARY
+#define D64FUSE_BINARY "d64-fuse"
+#endif
+
+#define MOUNT_TIMEOUT_MS 5000
+#define WARM_READDIR_ROUNDS 100
+#define STAT_STORM_ROUNDS 50
+#define RANDOM_READS 20000
+#define RANDOM_READ_SIZE 256
+#define CONCURRENT_ROUNDS 4
+
+static const bench_image_spec image_specs[] = {
+  {"D64 MANY SMALL", D64SIZE, 144, 300, false},
+  {"D64 FEW LARGE", D64SIZE, 4, 40000, false},
+  {"D71 MEDIUM", D71SIZE, 32, 5000, false},
+  {"D81 LARGE", D81SIZE, 32, 10000, false},
+};
+
+static const size_t concurrent_threads[] = {1, 4, 16};
+
+#define NBR_IMAGE_SPECS (sizeof (image_specs) / sizeof (image_specs[0]))
+#define NBR_CONCURRENT_RUNS (sizeof (concurrent_threads) / sizeof (concurrent_threads[0]))
+
+typedef struct mounted_image
+{
+  char mount_point[PATH_MAX];
+  pid_t pid;
+  char **paths;
+  off_t *sizes;
+  size_t nbr_files;
+} mounted_image;
+
+typedef struct image_results
+{
+  const bench_image_spec *spec;
+  double mount_ms;
+  double readdir_cold_us;
+  double readdir_warm_us;
+  double stat_ops_per_s;
+  double sequential_mb_per_s;
+  double random_ops_per_s;
+  double concurrent_mb_per_s[NBR_CONCURRENT_RUNS];
+} image_results;
+
+typedef struct reader_thread
+{
+  pthread_t thread;
+  const mounted_image *image;
+  size_t first_file;
+  uint64_t bytes_read;
+} reader_thread;
+
+static uint64_t now_ns ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static bool is_mounted (const char *mount_point)
+{
+  struct stat mount_stat, parent_stat;
+  char parent[PATH_MAX + 4];
+
+  snprintf (parent, sizeof (parent), "%s/..", mount_point);
+  if (stat (mount_point, &mount_stat) != 0 or stat (parent, &parent_stat) != 0)
+    return false;
+
+  return mount_stat.st_dev != parent_stat.st_dev;
+}
+
+static int run_command (char *const argv[])
+{
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      execvp (argv[0], argv);
+      _exit (127);
+    }
+  if (pid < 0)
+    return -1;
+
+  int status;
+  if (waitpid (pid, &status, 0) != pid)
+    return -1;
+
+  return (WIFEXITED (status) and WEXITSTATUS (status) == 0) ? 0 : -1;
+}
+
+static int mount_image (const char *d64fuse, const char *image_filename, mounted_image *image, double *mount_ms)
+{
+  char image_option[PATH_MAX + 16];
+
+  snprintf (image_option, sizeof (image_option), "--image=%s", image_filename);
+  if (mkdir (image->mount_point, 0700) != 0)
+    return -1;
+
+  uint64_t start = now_ns ();
+  image->pid = fork ();
+  if (image->pid == 0)
+    {
+      execl (d64fuse, d64fuse, "-f", image_option, image->mount_point, (char *) NULL);
+      _exit (127);
+    }
+  if (image->pid < 0)
+    return -1;
+
+  for (long waited = 0; waited < MOUNT_TIMEOUT_MS * 10; waited++)
+    {
+      if (is_mounted (image->mount_point))
+        {
+          *mount_ms = (now_ns () - start) / 1e6;
+          return 0;
+        }
+      if (waitpid (image->pid, NULL, WNOHANG) == image->pid)
+        break;
+      const struct timespec delay = {.tv_sec = 0, .tv_nsec = 100000};
+      nanosleep (&delay, NULL);
+    }
+
+  fprintf (stderr, "%s was not mounted on %s\n", image_filename, image->mount_point);
+  kill (image->pid, SIGTERM);
+  waitpid (image->pid, NULL, 0);
+
+  return -1;
+}
+
+static void unmount_image (mounted_image *image)
+{
+  char *const argv[] = {"fusermount3", "-u", image->mount_point, NULL};
+
+  if (run_command (argv) != 0)
+    kill (image->pid, SIGTERM);
+  waitpid (image->pid, NULL, 0);
+  rmdir (image->mount_point);
+
+  for (size_t i = 0; i < image->nbr_files; i++)
+    free (image->paths[i]);
+  free (image->paths);
+  free (image->sizes);
+}
+
+/* lists the mount point, collecting the file paths on the first call */
+static int read_directory (mounted_image *image, bool collect)
+{
+  DIR *dir = opendir (image->mount_point);
+  if (is_null (dir))
+    return -1;
+
+  size_t capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir (dir)))
+    {
+      if (!collect or entry->d_name[0] == '.')
+        continue;
+
+      if (image->nbr_files == capacity)
+        {
+          capacity = capacity ? capacity * 2 : 64;
+          image->paths = realloc (image->paths, capacity * sizeof (char *));
+          image->sizes = realloc (image->sizes, capacity * sizeof (off_t));
+        }
+      char path[PATH_MAX + 256];
+      snprintf (path, sizeof (path), "%s/%s", image->mount_point, entry->d_name);
+      image->paths[image->nbr_files] = strdup (path);
+      image->sizes[image->nbr_files] = 0;
+      image->nbr_files++;
+    }
+  closedir (dir);
+
+  return 0;
+}
+
+static uint64_t read_whole_file (const char *path, char *buffer, size_t buffer_size)
+{
+  uint64_t total = 0;
+  ssize_t bytes_read;
+
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  while ((bytes_read = read (fd, buffer, buffer_size)) > 0)
+    total += bytes_read;
+  close (fd);
+
+  return total;
+}
+
+static void *reader_loop (void *arg)
+{
+  reader_thread *reader = arg;
+  const mounted_image *image = reader->image;
+  char buffer[65536];
+
+  for (size_t round = 0; round < CONCURRENT_ROUNDS; round++)
+    for (size_t i = 0; i < image->nbr_files; i++)
+      {
+        size_t file_nbr = (reader->first_file + i) % image->nbr_files;
+        reader->bytes_read += read_whole_file (image->paths[file_nbr], buffer, sizeof (buffer));
+      }
+
+  return NULL;
+}
+
+static double measure_concurrent_reads (const mounted_image *image, size_t nbr_threads)
+{
+  reader_thread *readers = calloc (nbr_threads, sizeof (reader_thread));
+  uint64_t bytes_read = 0;
+
+  uint64_t start = now_ns ();
+  for (size_t i = 0; i < nbr_threads; i++)
+    {
+      readers[i] = (reader_thread) {.image = image, .first_file = (i * image->nbr_files) / nbr_threads};
+      pthread_create (&readers[i].thread, NULL, reader_loop, readers + i);
+    }
+  for (size_t i = 0; i < nbr_threads; i++)
+    {
+      pthread_join (readers[i].thread, NULL);
+      bytes_read += readers[i].bytes_read;
+    }
+  uint64_t elapsed = now_ns () - start;
+  free (readers);
+
+  return (bytes_read / 1048576.0) / (elapsed / 1e9);
+}
+
+static int bench_image (const char *d64fuse, const char *work_dir, size_t image_nbr, image_results *results)
+{
+  const bench_image_spec *spec = image_specs + image_nbr;
+  char image_filename[PATH_MAX];
+  mounted_image image = {.paths = NULL};
+  struct stat file_stat;
+  char buffer[65536];
+
+  results->spec = spec;
+  snprintf (image_filename, sizeof (image_filename), "%s/image%zu.img", work_dir, image_nbr);
+  snprintf (image.mount_point, sizeof (image.mount_point), "%s/mount%zu", work_dir, image_nbr);
+  if (bench_create_image (image_filename, spec) != 0)
+    {
+      fprintf (stderr, "cannot create %s\n", image_filename);
+      return -1;
+    }
+  if (mount_image (d64fuse, image_filename, &image, &results->mount_ms) != 0)
+    return -1;
+
+  uint64_t start = now_ns ();
+  read_directory (&image, true);
+  results->readdir_cold_us = (now_ns () - start) / 1e3;
+
+  start = now_ns ();
+  for (size_t round = 0; round < WARM_READDIR_ROUNDS; round++)
+    read_directory (&image, false);
+  results->readdir_warm_us = (now_ns () - start) / 1e3 / WARM_READDIR_ROUNDS;
+
+  start = now_ns ();
+  for (size_t round = 0; round < STAT_STORM_ROUNDS; round++)
+    for (size_t i = 0; i < image.nbr_files; i++)
+      if (stat (image.paths[i], &file_stat) == 0)
+        image.sizes[i] = file_stat.st_size;
+  results->stat_ops_per_s = (STAT_STORM_ROUNDS * image.nbr_files) / ((now_ns () - start) / 1e9);
+
+  uint64_t bytes_read = 0;
+  start = now_ns ();
+  for (size_t i = 0; i < image.nbr_files; i++)
+    bytes_read += read_whole_file (image.paths[i], buffer, sizeof (buffer));
+  results->sequential_mb_per_s = (bytes_read / 1048576.0) / ((now_ns () - start) / 1e9);
+
+  unsigned int seed = 64;
+  size_t random_reads = 0;
+  start = now_ns ();
+  for (size_t i = 0; i < RANDOM_READS and image.nbr_files > 0; i++)
+    {
+      size_t file_nbr = rand_r (&seed) % image.nbr_files;
+      off_t offset = image.sizes[file_nbr] ? rand_r (&seed) % image.sizes[file_nbr] : 0;
+      int fd = open (image.paths[file_nbr], O_RDONLY);
+      if (fd < 0)
+        continue;
+      if (pread (fd, buffer, RANDOM_READ_SIZE, offset) >= 0)
+        random_reads++;
+      close (fd);
+    }
+  results->random_ops_per_s = random_reads / ((now_ns () - start) / 1e9);
+
+  for (size_t i = 0; i < NBR_CONCURRENT_RUNS; i++)
+    results->concurrent_mb_per_s[i] = measure_concurrent_reads (&image, concurrent_threads[i]);
+
+  unmount_image (&image);
+  unlink (image_filename);
+
+  return 0;
+}
+
+static void write_json (FILE *output, const image_results *results, size_t nbr_results)
+{
+  fprintf (output, "{\n  \"benchmark\": \"d64-fuse end-to-end\",\n  \"timestamp\": %ld,\n  \"images\": [\n", (long) time (NULL));
+  for (size_t i = 0; i < nbr_results; i++)
+    {
+      const image_results *result = results + i;
+      fprintf (output, "    {\n");
+      fprintf (output, "      \"name\": \"%s\",\n", result->spec->name);
+      fprintf (output, "      \"image_size\": %d,\n", result->spec->image_size);
+      fprintf (output, "      \"files\": %zu,\n", result->spec->nbr_files);
+      fprintf (output, "      \"file_size\": %zu,\n", result->spec->file_size);
+      fprintf (output, "      \"mount_ms\": %.3f,\n", result->mount_ms);
+      fprintf (output, "      \"readdir_cold_us\": %.1f,\n", result->readdir_cold_us);
+      fprintf (output, "      \"readdir_warm_us\": %.1f,\n", result->readdir_warm_us);
+      fprintf (output, "      \"stat_ops_per_s\": %.0f,\n", result->stat_ops_per_s);
+      fprintf (output, "      \"sequential_read_mb_per_s\": %.2f,\n", result->sequential_mb_per_s);
+      fprintf (output, "      \"random_read_ops_per_s\": %.0f,\n", result->random_ops_per_s);
+      fprintf (output, "      \"concurrent_read_mb_per_s\": {");
+      for (size_t run = 0; run < NBR_CONCURRENT_RUNS; run++)
+        fprintf (output, "%s\"%zu\": %.2f", run ? ", " : "", concurrent_threads[run], result->concurrent_mb_per_s[run]);
+      fprintf (output, "}\n    }%s\n", (i + 1 < nbr_results) ? "," : "");
+    }
+  fprintf (output, "  ]\n}\n");
+}
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s [--d64-fuse=<binary>] [--output=<file.json>]\n", progname);
+}
+
+int main (int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    {"d64-fuse", required_argument, NULL, 'd'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *d64fuse = D64FUSE_BINARY;
+  const char *output_filename = NULL;
+
+  int option;
+  while ((option = getopt_long (argc, argv, "d:o:h", long_options, NULL)) != -1)
+    switch (option)
+      {
+      case 'd':
+        d64fuse = optarg;
+        break;
+      case 'o':
+        output_filename = optarg;
+        break;
+      default:
+        show_help (argv[0]);
+        return -1;
+      }
+
+  char work_dir[] = "/tmp/d64-bench.XXXXXX";
+  if (is_null (mkdtemp (work_dir)))
+    {
+      perror ("Cannot create the work directory");
+      return -1;
+    }
+
+  image_results results[NBR_IMAGE_SPECS];
+  size_t nbr_results = 0;
+  int status = 0;
+  for (size_t i = 0; i < NBR_IMAGE_SPECS; i++)
+    {
+      fprintf (stderr, "benchmarking %s...\n", image_specs[i].name);
+      if (bench_image (d64fuse, work_dir, i, results + nbr_results) == 0)
+        nbr_results++;
+      else
+        status = -1;
+    }
+  rmdir (work_dir);
+
+  FILE *output = stdout;
+  if (is_not_null (output_filename))
+    {
+      output = fopen (output_filename, "w");
+      if (is_null (output))
+        {
+          perror ("Cannot open the output file");
+          return -1;
+        }
+    }
+  write_json (output, results, nbr_results);
+  if (output != stdout)
+    fclose (output);
+
+  return status;
+}
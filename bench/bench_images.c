@@ -0,0 +1,20 @@
+#include "diskimage.h"
+
+#include "bench_images.h"
+#include "corpus.h"
+
+/* writes an image made of nbr_files PRG files of file_size bytes, with
+   contents depending only on the file number */
+int bench_create_image (const char *filename, const bench_image_spec *spec)
+{
+  corpus_spec corpus = {.label = spec->name,
+                        .image_size = spec->image_size,
+                        .fill_ratio = 1.0,
+                        .max_files = spec->nbr_files,
+                        .sizes = CORPUS_SIZES_FIXED,
+                        .min_size = spec->file_size,
+                        .max_size = spec->file_size,
+                        .streams = spec->fragmented ? 2 : 1};
+
+  return (corpus_create_image (filename, &corpus) == (int) spec->nbr_files) ? 0 : -1;
+}
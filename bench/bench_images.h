@@ -0,0 +1,18 @@
+#ifndef BENCH_IMAGES
+#define BENCH_IMAGES 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct bench_image_spec
+{
+  const char *name;
+  int image_size;   /* D64SIZE, D71SIZE or D81SIZE */
+  size_t nbr_files;
+  size_t file_size;
+  bool fragmented;  /* files written two at a time, so their chains interleave */
+} bench_image_spec;
+
+int bench_create_image (const char *, const bench_image_spec *);
+
+#endif /* BENCH_IMAGES */
@@ -1,16 +1,27 @@
 #include <errno.h>
 #include <fuse.h>
 #include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
 #include "diskimage.h"
 
+#include "common_operations.h"
+#include "control_files.h"
 #include "d64fuse_context.h"
+#include "hashes.h"
+#include "log.h"
+#include "search.h"
+#include "snapshots.h"
+#include "stats.h"
 #include "utils.h"
 
 static const char *type_labels[] = {"DEL", "SEQ", "PRG", "USR", "REL", "CBM", "DIR"};
@@ -28,12 +39,129 @@ static const char *type_mime_types[] = {"application/x-c64-file",
 #define XATTR_VALUE_IS_SPLAT "d64fuse.is_splat"
 #define XATTR_VALUE_IS_LOCKED "d64fuse.is_locked"
 #define XATTR_VALUE_MIME_TYPE "user.mime_type"
+#define XATTR_VALUE_STATS "d64fuse.stats"
+#define XATTR_VALUE_SHA256 "d64fuse.sha256"
+#define XATTR_VALUE_CRC32 "d64fuse.crc32"
+#define XATTR_VALUE_DIRECTORY "d64fuse.directory"
+
+/* guards the directory listing of the context */
+static pthread_mutex_t directory_listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the file data of a file of the image or of a snapshot, and the image
+   holding it when disk_image is not NULL; to be called with the image lock
+   held */
+static d64fuse_file_data *find_any_file_data (d64fuse_context *context, const char *filename, struct diskimage **disk_image)
+{
+  if (is_snapshots_path (filename))
+    return find_snapshot_file_data (context, filename, disk_image);
+
+  if (is_not_null (disk_image))
+    *disk_image = context->disk_image;
+  return find_file_data (context, filename);
+}
+
+static bool is_hash_attr (const char *attr_name)
+{
+  return strcmp (attr_name, XATTR_VALUE_SHA256) == 0 or strcmp (attr_name, XATTR_VALUE_CRC32) == 0;
+}
+
+/* formats the hash attr_name of the file, or of the image when file_data is
+   NULL, in lowercase hexadecimal; to be called with the image lock held */
+static const char *format_hash (d64fuse_context *context, d64fuse_file_data *file_data, struct diskimage *disk_image, const char *attr_name, char *text)
+{
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  uint32_t crc32;
+
+  if (is_null (file_data))
+    d64fuse_image_hashes (context, sha256, &crc32);
+  else
+    d64fuse_file_hashes (context, file_data, disk_image, sha256, &crc32);
+
+  if (strcmp (attr_name, XATTR_VALUE_CRC32) == 0)
+    sprintf (text, "%08x", (unsigned int) crc32);
+  else
+    for (int i = 0; i < D64FUSE_SHA256_SIZE; i++)
+      sprintf (text + 2 * i, "%02x", sha256[i]);
+
+  return text;
+}
+
+static void write_json_string (FILE *stream, const char *text)
+{
+  fputc ('"', stream);
+  for (const unsigned char *current = (const unsigned char *) text; *current != '\0'; current++)
+    if (*current == '"' or *current == '\\')
+      fprintf (stream, "\\%c", *current);
+    else if (*current < 0x20 or *current >= 0x7f)
+      fprintf (stream, "\\u%04x", *current);
+    else
+      fputc (*current, stream);
+  fputc ('"', stream);
+}
+
+/* the d64fuse.directory xattr: every entry of the directory, in directory
+   order, as one JSON object; to be called with the image lock held */
+static char *format_directory_listing (d64fuse_context *context)
+{
+  char *listing = NULL;
+  size_t listing_size = 0;
+
+  FILE *stream = open_memstream (&listing, &listing_size);
+  if (is_null (stream))
+    return NULL;
+
+  fprintf (stream, "{\"label\":");
+  write_json_string (stream, context->disk_label);
+  fprintf (stream, ",\"files\":[");
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    {
+      const d64fuse_file_data *file_data = context->file_data[i];
+      const struct rawdirentry *rde = file_data->dir_entry;
+
+      fprintf (stream, "%s{\"name\":", (i > 0) ? "," : "");
+      write_json_string (stream, file_data->filename);
+      fprintf (stream, ",\"rawname\":\"");
+      for (int j = 0; j < 16; j++)
+        fprintf (stream, "%02x", rde->rawname[j]);
+      fprintf (stream, "\",\"type\":\"%s\",\"size\":%lld,\"blocks\":%u,\"splat\":%s,\"locked\":%s,\"track\":%u,\"sector\":%u}",
+               type_labels[file_data->file_type], (long long) file_data->file_size, rde->sizehi << 8 | rde->sizelo,
+               file_data->splat_file ? "true" : "false", file_data->locked_file ? "true" : "false",
+               rde->startts.track, rde->startts.sector);
+    }
+  fprintf (stream, "]}\n");
+
+  fclose (stream);
+
+  return listing;
+}
+
+/* returns a copy of the directory listing, built at the first request after
+   a change of the image */
+static char *get_directory_listing (d64fuse_context *context)
+{
+  ensure_stats_initialized (context);
+  d64fuse_read_lock_image ();
+  pthread_mutex_lock (&directory_listing_lock);
+  if (is_null (context->directory_listing) or context->directory_listing_generation != context->generation)
+    {
+      free (context->directory_listing);
+      context->directory_listing = format_directory_listing (context);
+      context->directory_listing_generation = context->generation;
+    }
+  char *listing = NULL;
+  if (is_not_null (context->directory_listing))
+    listing = strdup (context->directory_listing);
+  pthread_mutex_unlock (&directory_listing_lock);
+  d64fuse_unlock_image ();
+
+  return listing;
+}
 
 /* d64fuse_operations */
 
 int d64fuse_access (const char *filename, int perms)
 {
-  fprintf (stderr, "d64fuse %s: filename='%s', perms=%d\n", __func__, filename, perms);
+  d64fuse_log_debug ("filename='%s', perms=%d", filename, perms);
 
   if (is_null (filename))
     return -EINVAL;
@@ -42,18 +170,50 @@ int d64fuse_access (const char *filename, int perms)
   if (is_null (context))
     return -EINVAL;
 
+  if (is_control_path (filename))
+    {
+      struct stat entry_stat;
+      if (d64fuse_control_getattr (filename, &entry_stat, context) != 0)
+        return -ENOENT;
+      if ((perms & W_OK) == W_OK or ((perms & X_OK) == X_OK and !S_ISDIR (entry_stat.st_mode)))
+        return -EPERM;
+      return 0;
+    }
+
+  /* only the snapshots directory is writable, to take and drop snapshots */
+  if (is_snapshots_path (filename) or is_search_path (filename))
+    {
+      struct stat entry_stat;
+      int result = d64fuse_getattr (filename, &entry_stat, NULL);
+      if (result != 0)
+        return result;
+      if ((perms & W_OK) == W_OK and (entry_stat.st_mode & S_IWUSR) == 0)
+        return -EROFS;
+      if ((perms & X_OK) == X_OK and !S_ISDIR (entry_stat.st_mode))
+        return -EPERM;
+      return 0;
+    }
+
   if (perms == F_OK)
     {
       if (is_root_directory (filename))
         return 0;
+      d64fuse_read_lock_image ();
       const d64fuse_file_data * file_data = find_file_data (context, filename);
+      d64fuse_unlock_image ();
       if (is_not_null (file_data))
         return 0;
       return -ENOENT;
     }
 
   if ((perms & W_OK) == W_OK)
-    return -EPERM;
+    {
+      if (!context->writable)
+        return -EPERM;
+      /* with an overlay, the image itself is never written */
+      if (is_null (context->overlay_filename) and access (context->image_filename, W_OK) == -1)
+        return -errno;
+    }
 
   if (((perms & X_OK) == X_OK) && !is_root_directory (filename))
     return -EPERM;
@@ -65,10 +225,41 @@ int d64fuse_access (const char *filename, int perms)
   return 0;
 }
 
+int d64fuse_statfs (const char *filename, struct statvfs *fs_stat)
+{
+  unused_arg (filename);
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    return -EIO;
+
+  d64fuse_read_lock_image ();
+  size_t free_blocks = blocks_free (context->disk_image);
+  size_t nbr_files = context->nbr_files;
+  d64fuse_unlock_image ();
+
+  *fs_stat = (struct statvfs) {.f_bsize = 254,
+                               .f_frsize = 254,
+                               .f_blocks = context->total_blocks,
+                               .f_bfree = free_blocks,
+                               .f_bavail = free_blocks,
+                               .f_files = context->max_files,
+                               .f_ffree = (nbr_files < context->max_files) ? context->max_files - nbr_files : 0,
+                               .f_favail = (nbr_files < context->max_files) ? context->max_files - nbr_files : 0,
+                               .f_flag = context->writable ? 0 : ST_RDONLY,
+                               .f_namemax = 16};
+
+  return 0;
+}
+
 static void fill_directory_stat (struct stat *entry_stat, d64fuse_context *context)
 {
   entry_stat->st_ino = 1;
-  entry_stat->st_nlink = 2 + context->nbr_files;
+  entry_stat->st_nlink = 6 + context->nbr_files;
   entry_stat->st_mode = S_IFDIR | (context->image_stat.st_mode & 0777);
   if (entry_stat->st_mode & S_IRUSR)
     entry_stat->st_mode |= S_IXUSR;
@@ -85,6 +276,8 @@ static void fill_file_stat (struct stat *entry_stat, const d64fuse_file_data *fi
   entry_stat->st_nlink = 1;
   entry_stat->st_mode = S_IFREG | (context->image_stat.st_mode & 0666);
   entry_stat->st_size = file_data->file_size;
+  entry_stat->st_mtim = file_data->mtime;
+  entry_stat->st_ctim = file_data->mtime;
 }
 
 int d64fuse_getattr (const char *filename, struct stat *entry_stat, struct fuse_file_info *fi)
@@ -94,7 +287,7 @@ int d64fuse_getattr (const char *filename, struct stat *entry_stat, struct fuse_
   if (is_null (filename))
     return -EINVAL;
 
-  fprintf (stderr, "d64fuse %s: filename='%s', ....\n", __func__, filename);
+  d64fuse_log_debug ("filename='%s'", filename);
 
   d64fuse_context *context = d64fuse_get_context ();
   if (is_null (context))
@@ -113,12 +306,42 @@ int d64fuse_getattr (const char *filename, struct stat *entry_stat, struct fuse_
       return 0;
     }
 
-  const d64fuse_file_data *file_data = find_file_data (context, filename);
-  if (is_null (file_data))
-    return -ENOENT;
-  fill_file_stat (entry_stat, file_data, context);
+  if (is_control_path (filename))
+    return d64fuse_control_getattr (filename, entry_stat, context);
 
-  return 0;
+  if (is_snapshots_path (filename) and !is_snapshot_file_path (filename))
+    return d64fuse_snapshots_getattr (filename, entry_stat, context);
+
+  if (is_search_path (filename))
+    return d64fuse_search_getattr (filename, entry_stat, context);
+
+  d64fuse_read_lock_image ();
+  const d64fuse_file_data *file_data = find_any_file_data (context, filename, NULL);
+  if (is_not_null (file_data))
+    {
+      fill_file_stat (entry_stat, file_data, context);
+      if (is_snapshots_path (filename))
+        entry_stat->st_mode &= ~0222;
+    }
+  d64fuse_unlock_image ();
+
+  return is_null (file_data) ? -ENOENT : 0;
+}
+
+/* the only symlinks are the ones of the search directory */
+int d64fuse_readlink (const char *filename, char *buffer, size_t buffer_size)
+{
+  if (is_null (filename))
+    return -EINVAL;
+
+  if (!is_search_path (filename))
+    return -EINVAL;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  return d64fuse_search_readlink (filename, buffer, buffer_size, context);
 }
 
 int d64fuse_getxattr (const char *filename, const char *attr_name, char *attr_value, size_t attr_value_size)
@@ -128,6 +351,9 @@ int d64fuse_getxattr (const char *filename, const char *attr_name, char *attr_va
     return -EINVAL;
 
   const char *value = NULL;
+  char *report = NULL;
+  size_t report_size = 0;
+  char hash_text[2 * D64FUSE_SHA256_SIZE + 1];
 
   if (is_root_directory (filename))
     {
@@ -137,12 +363,32 @@ int d64fuse_getxattr (const char *filename, const char *attr_name, char *attr_va
         value = context->disk_label;
       else if (strcmp(attr_name, XATTR_VALUE_MIME_TYPE) == 0)
         value = type_mime_types[T_DIR];
+      else if (strcmp(attr_name, XATTR_VALUE_STATS) == 0)
+        value = report = d64fuse_stats_format (&report_size);
+      else if (strcmp(attr_name, XATTR_VALUE_DIRECTORY) == 0)
+        value = report = get_directory_listing (context);
+      else if (is_hash_attr (attr_name))
+        {
+          ensure_stats_initialized (context);
+          if (is_null (context->disk_image))
+            return -EIO;
+          d64fuse_read_lock_image ();
+          value = format_hash (context, NULL, NULL, attr_name, hash_text);
+          d64fuse_unlock_image ();
+        }
     }
+  else if (is_control_path (filename) or is_search_path (filename) or (is_snapshots_path (filename) and !is_snapshot_file_path (filename)))
+    return -ENODATA;
   else
     {
-      d64fuse_file_data *file_data = find_file_data (context, filename);
+      d64fuse_read_lock_image ();
+      struct diskimage *disk_image = NULL;
+      d64fuse_file_data *file_data = find_any_file_data (context, filename, &disk_image);
       if (is_null (file_data))
-        return -ENOENT;
+        {
+          d64fuse_unlock_image ();
+          return -ENOENT;
+        }
 
       if (strcmp(attr_name, XATTR_VALUE_FILE_TYPE) == 0)
         value = type_labels[file_data->file_type];
@@ -152,21 +398,37 @@ int d64fuse_getxattr (const char *filename, const char *attr_name, char *attr_va
         value = file_data->splat_file ? "true" : "false";
       else if (strcmp(attr_name, XATTR_VALUE_IS_LOCKED) == 0)
         value = file_data->locked_file ? "true" : "false";
+      else if (is_hash_attr (attr_name))
+        value = format_hash (context, file_data, disk_image, attr_name, hash_text);
+      d64fuse_unlock_image ();
     }
 
   if (!value)
     return -ENODATA;
 
-  if (attr_value_size == 0)
-    return strlen (value) + 1;
+  /* the size probed and the size fetched are both the one of the value with
+     its NUL; a value grown since the probe does not fit and is fetched again
+     by the caller */
+  int result = strlen (value) + 1;
+  /* the directory of a large image may not fit in any xattr buffer */
+  if (result > XATTR_SIZE_MAX)
+    result = -E2BIG;
+  else if (attr_value_size > 0)
+    {
+      if ((size_t) result > attr_value_size)
+        result = -ERANGE;
+      else
+        memcpy (attr_value, value, result);
+    }
+  free (report);
 
-  return snprintf (attr_value, attr_value_size, "%s", value);
+  return result;
 }
 
 int d64fuse_listxattr (const char *filename, char *list, size_t list_size)
 {
-  static const char dir_attr_list_str[] = XATTR_VALUE_IMAGE_FILENAME "\0" XATTR_VALUE_DISK_LABEL "\0" XATTR_VALUE_MIME_TYPE;
-  static const char file_attr_list_str[] = XATTR_VALUE_FILE_TYPE "\0" XATTR_VALUE_MIME_TYPE "\0" XATTR_VALUE_IS_SPLAT "\0" XATTR_VALUE_IS_LOCKED;
+  static const char dir_attr_list_str[] = XATTR_VALUE_IMAGE_FILENAME "\0" XATTR_VALUE_DISK_LABEL "\0" XATTR_VALUE_MIME_TYPE "\0" XATTR_VALUE_STATS "\0" XATTR_VALUE_SHA256 "\0" XATTR_VALUE_CRC32 "\0" XATTR_VALUE_DIRECTORY;
+  static const char file_attr_list_str[] = XATTR_VALUE_FILE_TYPE "\0" XATTR_VALUE_MIME_TYPE "\0" XATTR_VALUE_IS_SPLAT "\0" XATTR_VALUE_IS_LOCKED "\0" XATTR_VALUE_SHA256 "\0" XATTR_VALUE_CRC32;
   const char *attr_list_str;
   size_t attr_list_len;
 
@@ -175,13 +437,17 @@ int d64fuse_listxattr (const char *filename, char *list, size_t list_size)
       attr_list_str = dir_attr_list_str;
       attr_list_len = sizeof (dir_attr_list_str);
     }
+  else if (is_control_path (filename) or is_search_path (filename) or (is_snapshots_path (filename) and !is_snapshot_file_path (filename)))
+    return 0;
   else
     {
       d64fuse_context *context = d64fuse_get_context ();
       if (is_null (context))
         return -EINVAL;
 
-      d64fuse_file_data * file_data = find_file_data (context, filename);
+      d64fuse_read_lock_image ();
+      d64fuse_file_data * file_data = find_any_file_data (context, filename, NULL);
+      d64fuse_unlock_image ();
       if (is_null (file_data))
         return -ENOENT;
 
@@ -2,9 +2,12 @@
 #define COMMON_OPERATIONS 1
 
 struct fuse_file_info;
+struct statvfs;
 
 int d64fuse_access (const char *, int);
 int d64fuse_getattr (const char *, struct stat *, struct fuse_file_info *);
+int d64fuse_statfs (const char *, struct statvfs *);
+int d64fuse_readlink (const char *, char *, size_t);
 int d64fuse_getxattr (const char *, const char *, char *, size_t);
 int d64fuse_listxattr (const char *, char *, size_t);
 
@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fuse.h>
+
+#include "control_files.h"
+#include "d64fuse_context.h"
+#include "stats.h"
+#include "utils.h"
+
+typedef char *(*control_file_generator) (size_t *);
+
+typedef struct control_file
+{
+  const char *name;
+  control_file_generator generate;
+} control_file;
+
+/* snapshot of a control file, taken at open time */
+typedef struct control_handle
+{
+  char *contents;
+  size_t size;
+} control_handle;
+
+static const control_file control_files[] = {
+  {"stats", d64fuse_stats_format},
+};
+
+#define NBR_CONTROL_FILES (sizeof (control_files) / sizeof (control_files[0]))
+
+static const char control_directory[] = "/" CONTROL_DIRECTORY_NAME;
+
+bool is_control_path (const char *path)
+{
+  size_t length = sizeof (control_directory) - 1;
+
+  return (strncmp (path, control_directory, length) == 0
+          and (path[length] == '\0' or path[length] == '/'));
+}
+
+bool is_control_directory (const char *path)
+{
+  return strcmp (path, control_directory) == 0;
+}
+
+static const control_file *find_control_file (const char *path)
+{
+  if (!is_control_path (path) or is_control_directory (path))
+    return NULL;
+
+  const char *name = path + sizeof (control_directory);
+  for (size_t i = 0; i < NBR_CONTROL_FILES; i++)
+    if (strcmp (name, control_files[i].name) == 0)
+      return control_files + i;
+
+  return NULL;
+}
+
+int d64fuse_control_getattr (const char *path, struct stat *entry_stat, d64fuse_context *context)
+{
+  ensure_stats_initialized (context);
+
+  mode_t read_mode = context->image_stat.st_mode & 0444;
+
+  if (is_control_directory (path))
+    {
+      entry_stat->st_nlink = 2;
+      entry_stat->st_mode = S_IFDIR | read_mode | (read_mode >> 2);
+      return 0;
+    }
+
+  const control_file *file = find_control_file (path);
+  if (is_null (file))
+    return -ENOENT;
+
+  /* the size is only known at open time, reads are done with direct_io */
+  entry_stat->st_nlink = 1;
+  entry_stat->st_mode = S_IFREG | read_mode;
+  entry_stat->st_size = 0;
+
+  return 0;
+}
+
+int d64fuse_control_readdir (const char *path, void *buffer, fuse_fill_dir_t fill_dir)
+{
+  if (!is_control_directory (path))
+    return -ENOTDIR;
+
+  for (size_t i = 0; i < NBR_CONTROL_FILES; i++)
+    if (fill_dir (buffer, control_files[i].name, NULL, 0, 0) == 1)
+      break;
+
+  return 0;
+}
+
+int d64fuse_control_open (const char *path, struct fuse_file_info *fi)
+{
+  const control_file *file = find_control_file (path);
+  if (is_null (file))
+    return -ENOENT;
+
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
+
+  control_handle *handle = malloc (sizeof (control_handle));
+  if (is_null (handle))
+    return -ENOMEM;
+
+  handle->contents = file->generate (&handle->size);
+  if (is_null (handle->contents))
+    {
+      free (handle);
+      return -ENOMEM;
+    }
+
+  fi->fh = (uintptr_t) handle;
+  fi->direct_io = 1;
+
+  return 0;
+}
+
+int d64fuse_control_read (const char *path, char *buffer, size_t buffer_size, off_t offset, struct fuse_file_info *fi)
+{
+  unused_arg (path);
+
+  const control_handle *handle = (const control_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle))
+    return -EBADF;
+
+  if (offset >= (off_t) handle->size)
+    return 0;
+
+  size_t copy_size = handle->size - offset;
+  if (copy_size > buffer_size)
+    copy_size = buffer_size;
+  memcpy (buffer, handle->contents + offset, copy_size);
+
+  return copy_size;
+}
+
+int d64fuse_control_release (const char *path, struct fuse_file_info *fi)
+{
+  unused_arg (path);
+
+  control_handle *handle = (control_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle))
+    return -EBADF;
+
+  free (handle->contents);
+  free (handle);
+  fi->fh = 0;
+
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef CONTROL_FILES
+#define CONTROL_FILES 1
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "d64fuse_context.h"
+
+/* virtual directory exposing the daemon internals, next to the image files */
+#define CONTROL_DIRECTORY_NAME ".d64fuse"
+
+bool is_control_path (const char *);
+bool is_control_directory (const char *);
+
+int d64fuse_control_getattr (const char *, struct stat *, d64fuse_context *);
+int d64fuse_control_readdir (const char *, void *, fuse_fill_dir_t);
+int d64fuse_control_open (const char *, struct fuse_file_info *);
+int d64fuse_control_read (const char *, char *, size_t, off_t, struct fuse_file_info *);
+int d64fuse_control_release (const char *, struct fuse_file_info *);
+
+#endif /* CONTROL_FILES */
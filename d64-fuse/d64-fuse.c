@@ -10,11 +10,22 @@
 #include <fuse.h>
 
 #include "d64fuse_context.h"
+#include "log.h"
+#include "trace.h"
 #include "operations.h"
 #include "utils.h"
+#include "writeback.h"
 
 typedef struct d64fuse_options {
   const char *image_filename;
+  const char *log_level;
+  const char *trace_filename;
+  const char *overlay_filename;
+  const char *journal_filename;
+  const char *index_filename;
+  const char *hash_cache_filename;
+  int writable;
+  unsigned int writeback_interval_ms;
   int show_help;
 } d64fuse_options;
 
@@ -22,7 +33,7 @@ typedef struct d64fuse_options {
 
 static void show_help (const char *progname)
 {
-  fprintf (stderr, "usage: %s --image=[image{.d64,.d71,.d81}] <mountpoint>\n", progname);
+  fprintf (stderr, "usage: %s --image=[image{.d64,.d71,.d81}] [--log-level=none|error|warning|info|debug] [--record-trace=<file>] [--writable] [--overlay=<file>] [--journal=<file>] [--index=<file>] [--hash-cache=<file>] [--writeback-interval=<ms>] <mountpoint>\n", progname);
 }
 
 int parse_args(struct fuse_args *args, d64fuse_options *options_ptr)
@@ -30,6 +41,14 @@ int parse_args(struct fuse_args *args, d64fuse_options *options_ptr)
   struct fuse_opt option_spec[] = {
     OPTION ("-I %s", image_filename, 0),
     OPTION ("--image=%s", image_filename, 0),
+    OPTION ("--log-level=%s", log_level, 0),
+    OPTION ("--record-trace=%s", trace_filename, 0),
+    OPTION ("--writable", writable, 1),
+    OPTION ("--overlay=%s", overlay_filename, 0),
+    OPTION ("--journal=%s", journal_filename, 0),
+    OPTION ("--index=%s", index_filename, 0),
+    OPTION ("--hash-cache=%s", hash_cache_filename, 0),
+    OPTION ("--writeback-interval=%u", writeback_interval_ms, 0),
     OPTION ("-h", show_help, 1),
     OPTION ("--help", show_help, 1),
     FUSE_OPT_END
@@ -52,6 +71,13 @@ int parse_args(struct fuse_args *args, d64fuse_options *options_ptr)
       return -1;
     }
 
+  if (is_not_null (options_ptr->log_level)
+      and d64fuse_log_parse_level (options_ptr->log_level, &d64fuse_current_log_level) != 0)
+    {
+      fprintf (stderr, "Invalid '--log-level' value: %s\n", options_ptr->log_level);
+      return -1;
+    }
+
   if (access (options_ptr->image_filename, F_OK) != 0)
     {
       perror ("Image file does not exist");
@@ -64,16 +90,62 @@ int parse_args(struct fuse_args *args, d64fuse_options *options_ptr)
       return -1;
     }
 
+  /* the changes go to the overlay, which is created on the first write back
+     when it does not exist */
+  if (is_not_null (options_ptr->overlay_filename))
+    options_ptr->writable = 1;
+  else if (options_ptr->writable and access (options_ptr->image_filename, W_OK) != 0)
+    {
+      perror ("Image file cannot be written");
+      return -1;
+    }
+
+  if (is_not_null (options_ptr->journal_filename) and !options_ptr->writable)
+    {
+      fprintf (stderr, "'--journal' requires '--writable' or '--overlay'.\n");
+      return -1;
+    }
+
   return 0;
 }
 
+/* fuse runs in / once daemonized, and the overlay or the journal may not
+   exist yet, so they cannot be canonicalized */
+static char *absolute_filename (const char *filename)
+{
+  char *absolute = canonicalize_file_name (filename);
+  if (is_not_null (absolute))
+    return absolute;
+  if (filename[0] == '/')
+    return strdup (filename);
+
+  char *cwd = get_current_dir_name ();
+  if (is_null (cwd))
+    return NULL;
+  if (asprintf (&absolute, "%s/%s", cwd, filename) == -1)
+    absolute = NULL;
+  free (cwd);
+
+  return absolute;
+}
+
 d64fuse_context make_context (const d64fuse_options * options)
 {
   d64fuse_context context;
 
   memset (&context, 0, sizeof (context));
   context.nbr_files = -1;
+  context.writable = options->writable;
+  context.writeback_interval_ms = options->writeback_interval_ms;
   context.image_filename = canonicalize_file_name (options->image_filename);
+  if (is_not_null (options->overlay_filename))
+    context.overlay_filename = absolute_filename (options->overlay_filename);
+  if (is_not_null (options->journal_filename))
+    context.journal_filename = absolute_filename (options->journal_filename);
+  if (is_not_null (options->index_filename))
+    context.index_filename = absolute_filename (options->index_filename);
+  if (is_not_null (options->hash_cache_filename))
+    context.hash_cache_filename = absolute_filename (options->hash_cache_filename);
 
   return context;
 }
@@ -81,8 +153,29 @@ d64fuse_context make_context (const d64fuse_options * options)
 int run_d64fuse (const d64fuse_options * options, const struct fuse_args *args)
 {
   d64fuse_context context = make_context (options);
+
+  if (is_not_null (options->trace_filename))
+    {
+      int error = d64fuse_trace_open (options->trace_filename, context.image_filename);
+      if (error != 0)
+        {
+          fprintf (stderr, "Cannot record the trace to '%s': %s\n", options->trace_filename, strerror (-error));
+          free (context.image_filename);
+          free (context.overlay_filename);
+          free (context.journal_filename);
+          free (context.index_filename);
+          free (context.hash_cache_filename);
+          return -1;
+        }
+    }
+
   int result = fuse_main (args->argc, args->argv, &operations, &context);
+  d64fuse_trace_close ();
   free (context.image_filename);
+  free (context.overlay_filename);
+  free (context.journal_filename);
+  free (context.index_filename);
+  free (context.hash_cache_filename);
 
   return result;
 }
@@ -90,7 +183,7 @@ int run_d64fuse (const d64fuse_options * options, const struct fuse_args *args)
 int main (int argc, char * argv[])
 {
   struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
-  d64fuse_options options;
+  d64fuse_options options = {.writeback_interval_ms = D64FUSE_DEFAULT_WRITEBACK_INTERVAL_MS};
 
   if (parse_args (&args, &options) != 0)
     {
@@ -1,4 +1,6 @@
+#include <endian.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,24 +12,74 @@
 #include "utils.h"
 
 #include "d64fuse_context.h"
+#include "hashes.h"
+#include "index.h"
+#include "log.h"
+#include "search.h"
+#include "snapshots.h"
+
+/* context used when the operations are called outside of a FUSE session, as
+   done by the replay tool */
+static d64fuse_context *default_context;
+
+/* serializes the lazy loading of the image and of the file data; once
+   published, both are only read */
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* taken after the file data has been published, by the operations reading the
+   image and the file data (read) and by the ones modifying them (write) */
+static pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void d64fuse_set_default_context (d64fuse_context *context)
+{
+  default_context = context;
+}
 
 d64fuse_context *d64fuse_get_context ()
 {
+  if (is_not_null (default_context))
+    return default_context;
+
   struct fuse_context *fuse_context = fuse_get_context ();
   if (is_null (fuse_context))
     {
-      fprintf (stderr, "d64fuse %s: missing fuse_context\n", __func__);
+      d64fuse_log_error ("missing fuse_context");
       return NULL;
     }
 
   d64fuse_context *context = fuse_context->private_data;
   if (is_null (context))
-      fprintf (stderr, "d64fuse %s: missing d64fuse_context\n", __func__);
+      d64fuse_log_error ("missing d64fuse_context");
 
   return context;
 }
 
-typedef void (*for_each_file_cb_t) (off_t file_nbr, d64fuse_context *context, RawDirEntry *rde);
+void d64fuse_read_lock_image ()
+{
+  pthread_rwlock_rdlock (&image_lock);
+}
+
+void d64fuse_write_lock_image ()
+{
+  pthread_rwlock_wrlock (&image_lock);
+}
+
+void d64fuse_unlock_image ()
+{
+  pthread_rwlock_unlock (&image_lock);
+}
+
+/* the image being indexed and its index */
+typedef struct file_index
+{
+  d64fuse_context *context;
+  struct diskimage *disk_image;
+  d64fuse_file_data **file_data;
+  const d64fuse_index_file *indexed_files; /* from the library index, NULL when the image is not in it */
+  size_t nbr_indexed_files;
+} file_index;
+
+typedef void (*for_each_file_cb_t) (off_t file_nbr, file_index *index, RawDirEntry *rde);
 
 static inline bool is_of_file_type (unsigned char type)
 {
@@ -39,47 +91,47 @@ static inline bool is_valid_rawname (const unsigned char *rawname)
     return !(rawname[0] == 0xa || rawname[0] == 0);
 }
 
-static void for_each_file (for_each_file_cb_t cb, d64fuse_context *context)
+/* cb may be NULL to only count the files */
+static ssize_t for_each_file (for_each_file_cb_t cb, file_index *index)
 {
   ssize_t current_file_nbr = 0;
 
-  TrackSector ts = di_get_dir_ts (context->disk_image);
+  TrackSector ts = di_get_dir_ts (index->disk_image);
   while (ts.track)
     {
-      unsigned char *di_buffer = di_get_ts_addr(context->disk_image, ts);
+      unsigned char *di_buffer = di_get_ts_addr(index->disk_image, ts);
       for (off_t offset = 0; offset < 8; offset++)
         {
           RawDirEntry *rde = (RawDirEntry *) (di_buffer + (offset * 32));
           if (is_of_file_type (rde->type) && is_valid_rawname (rde->rawname))
             {
-              cb (current_file_nbr, context, rde);
+              if (cb != NULL)
+                cb (current_file_nbr, index, rde);
               current_file_nbr++;
             }
         }
-      ts = next_ts_in_chain(context->disk_image, ts);
+      ts = next_ts_in_chain(index->disk_image, ts);
     }
-}
 
-static void count_files (off_t file_nbr, d64fuse_context *context, RawDirEntry *rde)
-{
-  unused_arg (rde);
-  context->nbr_files = file_nbr + 1;
+  return current_file_nbr;
 }
 
-static size_t get_exact_file_size(struct diskimage *disk_image, unsigned char * rawname, unsigned char file_type)
+static size_t get_exact_file_size(struct diskimage *disk_image, RawDirEntry *rde)
 {
   size_t file_size = 0;
   unsigned char buffer[65536];
+  ImageFile image_file;
 
-  ImageFile *image_file = di_open (disk_image, rawname, file_type, "rb");
+  if (di_open_entry_r (disk_image, rde, &image_file) != 0)
+    return 0;
   while (true)
     {
-      int data_len = di_read (image_file, buffer, 65536);
-      if (data_len == 0)
-        break;
+      int data_len = di_read_r (&image_file, buffer, 65536);
       file_size += data_len;
+      /* a cyclic chain reports 52 (file too long) and would never end */
+      if (data_len == 0 or image_file.status != 0)
+        break;
     }
-  di_close (image_file);
 
   return file_size;
 }
@@ -96,53 +148,201 @@ static void ensure_valid_filename (char * filename)
       }
 }
 
-static void fill_file_data (off_t file_nbr, d64fuse_context *context, RawDirEntry *rde)
+static void fill_file_name (d64fuse_file_data *current_stat, RawDirEntry *rde)
 {
-  unsigned char type = rde->type & 0x07;
-  d64fuse_file_data *current_stat = context->file_data + file_nbr;
   current_stat->filename[16] = 0;
-  current_stat->file_type = type;
-  current_stat->rawname = rde->rawname;
   di_name_from_rawname (current_stat->filename, rde->rawname);
   ensure_valid_filename (current_stat->filename);
-  size_t fn_len = strlen (current_stat->filename);
-  if (fn_len == 0)
+}
+
+static d64fuse_file_data *make_file_data (d64fuse_context *context, RawDirEntry *rde)
+{
+  d64fuse_file_data *current_stat = calloc (1, sizeof (d64fuse_file_data));
+  if (is_null (current_stat))
+    return NULL;
+
+  current_stat->file_type = rde->type & 0x07;
+  current_stat->splat_file = (rde->type & 0x80) == 0;
+  current_stat->locked_file = (rde->type & 0x40) != 0;
+  current_stat->dir_entry = rde;
+  current_stat->mtime = context->image_stat.st_mtim;
+  /* snapshots are indexed under the read lock, concurrently with each other */
+  current_stat->dir_file_nbr = __atomic_fetch_add (&context->next_dir_file_nbr, 1, __ATOMIC_RELAXED);
+  fill_file_name (current_stat, rde);
+  if (strlen (current_stat->filename) == 0)
+    d64fuse_log_warning ("empty name for file %ld", (long) current_stat->dir_file_nbr);
+
+  return current_stat;
+}
+
+/* the library index lists the files in directory order too, but only an
+   entry with the same name and type is trusted */
+static const d64fuse_index_file *find_indexed_file (file_index *index, off_t file_nbr, RawDirEntry *rde)
+{
+  if ((size_t) file_nbr >= index->nbr_indexed_files)
+    return NULL;
+
+  const d64fuse_index_file *indexed_file = index->indexed_files + file_nbr;
+  if (indexed_file->type != rde->type or memcmp (indexed_file->rawname, rde->rawname, sizeof (indexed_file->rawname)) != 0)
+    return NULL;
+
+  return indexed_file;
+}
+
+static void fill_file_data (off_t file_nbr, file_index *index, RawDirEntry *rde)
+{
+  d64fuse_file_data *current_stat = make_file_data (index->context, rde);
+  if (is_null (current_stat))
+    return;
+
+  // size_t file_size = 254 * ((size_t) rde->sizehi << 8 | rde->sizelo);
+  const d64fuse_index_file *indexed_file = find_indexed_file (index, file_nbr, rde);
+  if (is_not_null (indexed_file))
+    current_stat->file_size = le32toh (indexed_file->size);
+  else
+    current_stat->file_size = get_exact_file_size (index->disk_image, rde);
+  index->file_data[file_nbr] = current_stat;
+}
+
+static ssize_t index_files (file_index *index, d64fuse_file_data ***file_data)
+{
+  ssize_t nbr_files = for_each_file (NULL, index);
+  index->file_data = calloc (nbr_files, sizeof (d64fuse_file_data *));
+  if (is_not_null (index->file_data))
+    for_each_file (fill_file_data, index);
+  /* drops the entries that could not be allocated */
+  ssize_t nbr_filled = 0;
+  for (ssize_t i = 0; i < nbr_files and is_not_null (index->file_data); i++)
+    if (is_not_null (index->file_data[i]))
+      index->file_data[nbr_filled++] = index->file_data[i];
+  *file_data = index->file_data;
+
+  return nbr_filled;
+}
+
+/* indexes the files of disk_image into a new *file_data array, and returns
+   their number */
+ssize_t d64fuse_index_files (d64fuse_context *context, struct diskimage *disk_image, d64fuse_file_data ***file_data)
+{
+  file_index index = {.context = context, .disk_image = disk_image};
+
+  return index_files (&index, file_data);
+}
+
+/* indexes the files of the mounted image, taking their sizes from the library
+   index when it holds the image as it is on disk. The overlay may have changed
+   the files since */
+static ssize_t index_image_files (d64fuse_context *context)
+{
+  file_index index = {.context = context, .disk_image = context->disk_image};
+  d64fuse_index library_index = {.data = NULL};
+
+  if (is_not_null (context->index_filename) and is_null (context->overlay_filename))
+    {
+      int error = d64fuse_index_open (context->index_filename, &library_index);
+      if (error != 0)
+        d64fuse_log_warning ("cannot open the index %s: %s", context->index_filename, strerror (-error));
+      else
+        {
+          const d64fuse_index_image *image = d64fuse_index_find (&library_index, context->image_filename, &context->image_stat);
+          if (is_not_null (image))
+            {
+              index.indexed_files = d64fuse_index_image_files (&library_index, image);
+              index.nbr_indexed_files = le32toh (image->nbr_files);
+            }
+          else
+            d64fuse_log_info ("%s is not in the index or has changed since", context->image_filename);
+        }
+    }
+
+  ssize_t nbr_files = index_files (&index, &context->file_data);
+  d64fuse_index_close (&library_index);
+
+  return nbr_files;
+}
+
+static void load_disk_image (d64fuse_context *context)
+{
+  DiskImage *disk_image;
+  if (is_not_null (context->overlay_filename))
+    disk_image = di_load_image_overlay (context->image_filename, context->overlay_filename);
+  else
+    disk_image = di_load_image (context->image_filename);
+  if (is_null (disk_image))
     {
-      fprintf (stderr, "empty name?");
+      d64fuse_log_error ("cannot load the image %s", context->image_filename);
       return;
     }
 
-  // size_t file_size = 254 * ((size_t) rde->sizehi << 8 | rde->sizelo);
-  size_t file_size = get_exact_file_size (context->disk_image, rde->rawname, type);
-  current_stat->file_size = file_size;
-  current_stat->dir_file_nbr = file_nbr;
+  /* completes the writeback interrupted by a crash, if any, before the
+     image is used */
+  if (is_not_null (context->journal_filename))
+    {
+      int recovered = di_set_journal (disk_image, context->journal_filename);
+      if (recovered < 0)
+        {
+          d64fuse_log_error ("cannot recover the journal %s", context->journal_filename);
+          di_free_image (disk_image);
+          return;
+        }
+      if (recovered > 0)
+        d64fuse_log_warning ("recovered %d sectors from the journal %s", recovered, context->journal_filename);
+    }
+
+  unsigned char *title = di_title (disk_image);
+  di_name_from_rawname (context->disk_label, title);
+
+  /* the geometry never changes, unlike the free blocks which are counted by
+     the library as they are allocated */
+  int dir_track = disk_image->dir.track;
+  /* the second side of a D71 keeps its BAM on track 53 */
+  int bam2_track = (disk_image->type == D71) ? disk_image->bam2.track : 0;
+  context->total_blocks = 0;
+  for (int track = 1; track <= di_tracks (disk_image->type); track++)
+    if (track != dir_track and track != bam2_track)
+      context->total_blocks += di_sectors_per_track (disk_image->type, track);
+  /* the header and BAM sectors of the directory track hold no entries */
+  int reserved_sectors = (disk_image->type == D81) ? 3 : 1;
+  context->max_files = 8 * (di_sectors_per_track (disk_image->type, dir_track) - reserved_sectors);
+  __atomic_store_n (&context->disk_image, disk_image, __ATOMIC_RELEASE);
 }
 
 void ensure_disk_image_loaded (d64fuse_context *context)
 {
-  if (is_not_null (context->disk_image))
+  if (is_not_null (__atomic_load_n (&context->disk_image, __ATOMIC_ACQUIRE)))
     return;
-  context->disk_image = di_load_image (context->image_filename);
 
-  unsigned char *title = di_title (context->disk_image);
-  di_name_from_rawname (context->disk_label, title);
+  pthread_mutex_lock (&context_lock);
+  if (is_null (context->disk_image))
+    load_disk_image (context);
+  pthread_mutex_unlock (&context_lock);
 }
 
 void ensure_stats_initialized (d64fuse_context *context)
 {
-  if (context->nbr_files > -1)
+  if (__atomic_load_n (&context->nbr_files, __ATOMIC_ACQUIRE) > -1)
     return;
 
-  ensure_disk_image_loaded (context);
-  if (stat (context->image_filename, &context->image_stat) == -1)
-    fprintf (stderr, "d64fuse %s: error executing stat on image file: %s\n", __func__, strerror (errno));
+  pthread_mutex_lock (&context_lock);
+  if (context->nbr_files == -1)
+    {
+      if (is_null (context->disk_image))
+        load_disk_image (context);
+      if (stat (context->image_filename, &context->image_stat) == -1)
+        d64fuse_log_error ("error executing stat on image file: %s", strerror (errno));
 
-  context->nbr_files = 0;
-  for_each_file (count_files, context);
-  context->file_data = calloc (context->nbr_files, sizeof (d64fuse_file_data));
-  for_each_file (fill_file_data, context);
+      ssize_t nbr_files = 0;
+      if (is_not_null (context->disk_image))
+        {
+          nbr_files = index_image_files (context);
+          context->file_data_capacity = is_not_null (context->file_data) ? (size_t) nbr_files : 0;
+        }
+      __atomic_store_n (&context->nbr_files, nbr_files, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&context_lock);
 }
 
+/* to be called with the image lock held */
 d64fuse_file_data *find_file_data (d64fuse_context *context, const char *filename)
 {
   ensure_stats_initialized (context);
@@ -150,7 +350,7 @@ d64fuse_file_data *find_file_data (d64fuse_context *context, const char *filenam
   if (filename[0] == '/')
     for (ssize_t i = 0; i < context->nbr_files; i++)
       {
-        d64fuse_file_data *current_stat = context->file_data + i;
+        d64fuse_file_data *current_stat = context->file_data[i];
         if (strcmp (filename + 1, current_stat->filename) == 0)
           return current_stat;
       }
@@ -158,3 +358,133 @@ d64fuse_file_data *find_file_data (d64fuse_context *context, const char *filenam
   return NULL;
 }
 
+/* indexes a new directory entry; to be called with the image write lock held */
+d64fuse_file_data *add_file_data (d64fuse_context *context, RawDirEntry *rde)
+{
+  if ((size_t) context->nbr_files == context->file_data_capacity)
+    {
+      size_t capacity = (context->file_data_capacity > 0) ? context->file_data_capacity * 2 : 16;
+      d64fuse_file_data **file_data = realloc (context->file_data, capacity * sizeof (d64fuse_file_data *));
+      if (is_null (file_data))
+        return NULL;
+      context->file_data = file_data;
+      context->file_data_capacity = capacity;
+    }
+
+  d64fuse_file_data *current_stat = make_file_data (context, rde);
+  if (is_null (current_stat))
+    return NULL;
+  clock_gettime (CLOCK_REALTIME, &current_stat->mtime);
+  context->file_data[context->nbr_files] = current_stat;
+  __atomic_store_n (&context->nbr_files, context->nbr_files + 1, __ATOMIC_RELEASE);
+
+  return current_stat;
+}
+
+/* unindexes an unlinked file; its data is only freed with the context since
+   handles opened on it may still be in use. To be called with the image write
+   lock held */
+void remove_file_data (d64fuse_context *context, d64fuse_file_data *file_data)
+{
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    if (context->file_data[i] == file_data)
+      {
+        memmove (context->file_data + i, context->file_data + i + 1, (context->nbr_files - i - 1) * sizeof (d64fuse_file_data *));
+        __atomic_store_n (&context->nbr_files, context->nbr_files - 1, __ATOMIC_RELEASE);
+        break;
+      }
+
+  retire_file_data (context, file_data);
+}
+
+/* keeps the data of a file which is not indexed anymore until the context is
+   freed; to be called with the image write lock held */
+void retire_file_data (d64fuse_context *context, d64fuse_file_data *file_data)
+{
+  file_data->dir_entry = NULL;
+  file_data->next_retired = context->retired_file_data;
+  context->retired_file_data = file_data;
+}
+
+/* updates the name after the directory entry has been renamed; to be called
+   with the image write lock held */
+void rename_file_data (d64fuse_file_data *file_data)
+{
+  fill_file_name (file_data, file_data->dir_entry);
+}
+
+void d64fuse_free_context_data (d64fuse_context *context)
+{
+  d64fuse_free_search (context);
+  d64fuse_free_hashes (context);
+  d64fuse_free_snapshots (context);
+  free (context->directory_listing);
+  context->directory_listing = NULL;
+
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    free (context->file_data[i]);
+  free (context->file_data);
+  context->file_data = NULL;
+  context->file_data_capacity = 0;
+  context->nbr_files = -1;
+
+  while (is_not_null (context->retired_file_data))
+    {
+      d64fuse_file_data *next = context->retired_file_data->next_retired;
+      free (context->retired_file_data);
+      context->retired_file_data = next;
+    }
+
+  if (is_not_null (context->disk_image))
+    {
+      di_free_image (context->disk_image);
+      context->disk_image = NULL;
+    }
+}
+
+/* indexes the files of the image again after its sectors have been written
+   directly; the files still at the same directory entry keep their data,
+   updated, so that the handles opened on them stay valid. Any of them may
+   have new contents of the same size, so they all get a new mtime, which
+   makes the kernel drop their cached pages (auto_cache). To be called with
+   the image write lock held */
+void refresh_file_data (d64fuse_context *context)
+{
+  d64fuse_file_data **file_data;
+  ssize_t nbr_files = d64fuse_index_files (context, context->disk_image, &file_data);
+  if (nbr_files > 0 and is_null (file_data))
+    return;
+
+  struct timespec now;
+  clock_gettime (CLOCK_REALTIME, &now);
+
+  for (ssize_t i = 0; i < nbr_files; i++)
+    for (ssize_t j = 0; j < context->nbr_files; j++)
+      {
+        d64fuse_file_data *kept = context->file_data[j];
+        if (is_null (kept) or kept->dir_entry != file_data[i]->dir_entry)
+          continue;
+
+        kept->file_type = file_data[i]->file_type;
+        kept->splat_file = file_data[i]->splat_file;
+        kept->locked_file = file_data[i]->locked_file;
+        kept->file_size = file_data[i]->file_size;
+        kept->hashed = false;
+        memcpy (kept->filename, file_data[i]->filename, sizeof (kept->filename));
+        free (file_data[i]);
+        file_data[i] = kept;
+        context->file_data[j] = NULL;
+        break;
+      }
+  for (ssize_t i = 0; i < nbr_files; i++)
+    file_data[i]->mtime = now;
+  for (ssize_t j = 0; j < context->nbr_files; j++)
+    if (is_not_null (context->file_data[j]))
+      retire_file_data (context, context->file_data[j]);
+
+  free (context->file_data);
+  context->file_data = file_data;
+  context->file_data_capacity = nbr_files;
+  __atomic_store_n (&context->nbr_files, nbr_files, __ATOMIC_RELEASE);
+  di_name_from_rawname (context->disk_label, di_title (context->disk_image));
+}
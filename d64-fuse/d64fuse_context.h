@@ -3,36 +3,77 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+
+struct d64fuse_hashes;
+struct d64fuse_search;
+struct d64fuse_snapshot;
 
 typedef struct d64fuse_file_data
 {
   char filename[20];
-  unsigned char *rawname;
+  struct rawdirentry *dir_entry; /* points into the loaded image, NULL once unlinked */
   int file_type;
   bool splat_file;
   bool locked_file;
-  size_t use_count;
   size_t dir_file_nbr;
   off_t file_size;
-  unsigned char *contents;
+  struct timespec mtime;
+  bool hashed; /* sha256 and crc32 hold the hashes of the contents */
+  unsigned char sha256[32];
+  uint32_t crc32;
+  struct d64fuse_file_data *next_retired;
 } d64fuse_file_data;
 
 typedef struct d64fuse_context
 {
   char * image_filename;
+  char * overlay_filename; /* receives the changes instead of the image when not NULL */
+  char * journal_filename; /* write-ahead journal of the writebacks, NULL when none */
+  char * index_filename; /* library index written by d64-index, NULL when none */
+  char * hash_cache_filename; /* keeps the hashes between mounts, NULL when none */
   struct stat image_stat;
   struct diskimage * disk_image;
   char disk_label[17];
+  size_t total_blocks; /* data blocks, the directory track excluded */
+  size_t max_files;    /* directory entries */
+  bool writable;
+  unsigned int writeback_interval_ms; /* 0 writes the changes back right away */
+  unsigned long generation; /* counts the changes of the image */
   ssize_t nbr_files; /* -1 indicates that dir and file stats have not been loaded */
-  d64fuse_file_data *file_data;
+  d64fuse_file_data **file_data;
+  size_t file_data_capacity;
+  size_t next_dir_file_nbr;
+  d64fuse_file_data *retired_file_data; /* unlinked entries, still referenced by open handles */
+  struct d64fuse_snapshot *snapshots;
+  struct d64fuse_search *search; /* built at the first search, NULL until then */
+  struct d64fuse_hashes *hashes; /* loaded at the first hash, NULL until then */
+  char *directory_listing; /* the d64fuse.directory xattr, NULL until the first request */
+  unsigned long directory_listing_generation; /* the generation of the listing */
 } d64fuse_context;
 
 d64fuse_context *d64fuse_get_context ();
+void d64fuse_set_default_context (d64fuse_context *);
 
 void ensure_disk_image_loaded (d64fuse_context *);
 void ensure_stats_initialized (d64fuse_context *);
+void d64fuse_free_context_data (d64fuse_context *);
+
+/* the file data and the image are read under the read lock and modified under
+   the write lock */
+void d64fuse_read_lock_image ();
+void d64fuse_write_lock_image ();
+void d64fuse_unlock_image ();
+
+ssize_t d64fuse_index_files (d64fuse_context *, struct diskimage *, d64fuse_file_data ***);
 d64fuse_file_data *find_file_data (d64fuse_context *, const char *);
+d64fuse_file_data *add_file_data (d64fuse_context *, struct rawdirentry *);
+void remove_file_data (d64fuse_context *, d64fuse_file_data *);
+void retire_file_data (d64fuse_context *, d64fuse_file_data *);
+void rename_file_data (d64fuse_file_data *);
+void refresh_file_data (d64fuse_context *);
 
 #endif /* CONTEXT */
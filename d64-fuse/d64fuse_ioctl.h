@@ -0,0 +1,64 @@
+#ifndef D64FUSE_IOCTL
+#define D64FUSE_IOCTL 1
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/* ioctl commands of the files of a mount, for the tools built on it. The
+   structures are exchanged as is, in the byte order of the host. */
+
+/* a run of blocks of a chain on one track, each one step sectors after the
+   previous one, modulo the sectors of the track; step is 0 for a single
+   block */
+typedef struct d64fuse_extent
+{
+  uint8_t track;
+  uint8_t sector;      /* of the first block */
+  uint8_t step;
+  uint8_t nbr_blocks;
+} d64fuse_extent;
+
+#define D64FUSE_MAX_EXTENTS 1024
+
+/* D64FUSE_IOC_GET_CHAIN: the blocks of the file, in the order they are read,
+   from the extent first_extent on; a chain with more extents than fit is
+   mapped by calling again with the next first_extent, as with FIEMAP */
+typedef struct d64fuse_chain_map
+{
+  uint32_t first_extent;   /* in */
+  uint32_t nbr_extents;    /* out: the extents returned */
+  uint32_t total_extents;  /* out: the extents of the whole chain */
+  uint32_t nbr_blocks;     /* out: the blocks of the whole chain */
+  int32_t status;          /* out: the DOS error ending the chain, 0 when it
+                              ends normally, 52 when it loops, 66 on an
+                              invalid link */
+  d64fuse_extent extents[D64FUSE_MAX_EXTENTS];
+} d64fuse_chain_map;
+
+#define D64FUSE_IOC_GET_CHAIN _IOWR ('d', 1, d64fuse_chain_map)
+
+typedef struct d64fuse_sector_address
+{
+  uint8_t track;
+  uint8_t sector;
+} d64fuse_sector_address;
+
+/* as many sectors as fit in the 16 KB of an ioctl */
+#define D64FUSE_MAX_SECTORS 63
+
+/* D64FUSE_IOC_READ_SECTORS and D64FUSE_IOC_WRITE_SECTORS, on the mount point:
+   read or write the 256 bytes of each sector of addresses, in data. The
+   addresses are all checked first, an invalid one fails the whole call with
+   EINVAL. The writes are made under the same lock as the file operations,
+   which then see the directory and the BAM as written. */
+typedef struct d64fuse_sectors
+{
+  uint32_t nbr_sectors;
+  d64fuse_sector_address addresses[D64FUSE_MAX_SECTORS];
+  uint8_t data[D64FUSE_MAX_SECTORS][256];
+} d64fuse_sectors;
+
+#define D64FUSE_IOC_READ_SECTORS _IOWR ('d', 2, d64fuse_sectors)
+#define D64FUSE_IOC_WRITE_SECTORS _IOW ('d', 3, d64fuse_sectors)
+
+#endif /* D64FUSE_IOCTL */
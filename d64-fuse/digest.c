@@ -0,0 +1,316 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#define D64FUSE_DIGEST_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "digest.h"
+#include "utils.h"
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_initial_state[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define CRC32_POLYNOMIAL 0xedb88320
+
+/* the carry-less multiplication folds 64 bytes at a time, the table takes
+   the rest */
+#define CRC32_FOLD_SIZE 64
+
+typedef void (*sha256_blocks_t) (uint32_t state[8], const unsigned char *data, size_t nbr_blocks);
+typedef uint32_t (*crc32_fold_t) (uint32_t crc, const unsigned char *data, size_t length);
+
+static uint32_t crc32_table[256];
+static sha256_blocks_t sha256_blocks;
+static crc32_fold_t crc32_fold; /* NULL without the carry-less multiplication */
+static pthread_once_t digest_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t rotate_right (uint32_t value, int bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+static inline uint32_t load_be32 (const unsigned char *data)
+{
+  return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+static void sha256_blocks_scalar (uint32_t state[8], const unsigned char *data, size_t nbr_blocks)
+{
+  for (; nbr_blocks > 0; nbr_blocks--, data += 64)
+    {
+      uint32_t w[64];
+      for (int i = 0; i < 16; i++)
+        w[i] = load_be32 (data + 4 * i);
+      for (int i = 16; i < 64; i++)
+        {
+          uint32_t s0 = rotate_right (w[i - 15], 7) ^ rotate_right (w[i - 15], 18) ^ (w[i - 15] >> 3);
+          uint32_t s1 = rotate_right (w[i - 2], 17) ^ rotate_right (w[i - 2], 19) ^ (w[i - 2] >> 10);
+          w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+      for (int i = 0; i < 64; i++)
+        {
+          uint32_t s1 = rotate_right (e, 6) ^ rotate_right (e, 11) ^ rotate_right (e, 25);
+          uint32_t choice = (e & f) ^ (~e & g);
+          uint32_t t1 = h + s1 + choice + sha256_k[i] + w[i];
+          uint32_t s0 = rotate_right (a, 2) ^ rotate_right (a, 13) ^ rotate_right (a, 22);
+          uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+          uint32_t t2 = s0 + majority;
+          h = g;
+          g = f;
+          f = e;
+          e = d + t1;
+          d = c;
+          c = b;
+          b = a;
+          a = t1 + t2;
+        }
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+    }
+}
+
+static uint32_t crc32_bytes (uint32_t crc, const unsigned char *data, size_t length)
+{
+  while (length-- > 0)
+    crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+#ifdef D64FUSE_DIGEST_X86
+
+/* the state is kept as ABEF and CDGH, the order of sha256rnds2; each
+   sha256rnds2 does two rounds, with the message words and constants in the
+   low half of its third operand */
+__attribute__ ((target ("sha,sse4.1,ssse3")))
+static void sha256_blocks_sha_ni (uint32_t state[8], const unsigned char *data, size_t nbr_blocks)
+{
+  const __m128i byte_swap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i dcba = _mm_loadu_si128 ((const __m128i *) state);
+  __m128i hgfe = _mm_loadu_si128 ((const __m128i *) (state + 4));
+  __m128i cdab = _mm_shuffle_epi32 (dcba, 0xb1);
+  __m128i efgh = _mm_shuffle_epi32 (hgfe, 0x1b);
+  __m128i abef = _mm_alignr_epi8 (cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16 (efgh, cdab, 0xf0);
+
+  for (; nbr_blocks > 0; nbr_blocks--, data += 64)
+    {
+      __m128i saved_abef = abef;
+      __m128i saved_cdgh = cdgh;
+      __m128i w[4];
+
+      for (int group = 0; group < 16; group++)
+        {
+          __m128i *words = &w[group & 3];
+          if (group < 4)
+            *words = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16 * group)), byte_swap);
+          else
+            {
+              __m128i previous = w[(group - 1) & 3];
+              __m128i sum = _mm_add_epi32 (_mm_sha256msg1_epu32 (*words, w[(group - 3) & 3]),
+                                           _mm_alignr_epi8 (previous, w[(group - 2) & 3], 4));
+              *words = _mm_sha256msg2_epu32 (sum, previous);
+            }
+
+          __m128i message = _mm_add_epi32 (*words, _mm_loadu_si128 ((const __m128i *) (sha256_k + 4 * group)));
+          cdgh = _mm_sha256rnds2_epu32 (cdgh, abef, message);
+          abef = _mm_sha256rnds2_epu32 (abef, cdgh, _mm_shuffle_epi32 (message, 0x0e));
+        }
+
+      abef = _mm_add_epi32 (abef, saved_abef);
+      cdgh = _mm_add_epi32 (cdgh, saved_cdgh);
+    }
+
+  __m128i feba = _mm_shuffle_epi32 (abef, 0x1b);
+  __m128i dchg = _mm_shuffle_epi32 (cdgh, 0xb1);
+  _mm_storeu_si128 ((__m128i *) state, _mm_blend_epi16 (feba, dchg, 0xf0));
+  _mm_storeu_si128 ((__m128i *) (state + 4), _mm_alignr_epi8 (dchg, feba, 8));
+}
+
+/* folds 4 lanes of 16 bytes over the data, then folds them into one and
+   reduces it to the CRC (Barrett reduction); length is a multiple of 16, at
+   least CRC32_FOLD_SIZE. The constants are powers of x modulo the
+   polynomial, bit-reflected */
+__attribute__ ((target ("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul (uint32_t crc, const unsigned char *data, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x (0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x (0x00ccaa009e, 0x01751997d0);
+  const __m128i k5 = _mm_set_epi64x (0, 0x0163cd6124);
+  const __m128i polynomial = _mm_set_epi64x (0x01f7011641, 0x01db710641);
+  const __m128i low_32 = _mm_setr_epi32 (~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128 ((const __m128i *) data);
+  __m128i x2 = _mm_loadu_si128 ((const __m128i *) (data + 16));
+  __m128i x3 = _mm_loadu_si128 ((const __m128i *) (data + 32));
+  __m128i x4 = _mm_loadu_si128 ((const __m128i *) (data + 48));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 ((int) crc));
+  data += CRC32_FOLD_SIZE;
+  length -= CRC32_FOLD_SIZE;
+
+  for (; length >= CRC32_FOLD_SIZE; data += CRC32_FOLD_SIZE, length -= CRC32_FOLD_SIZE)
+    {
+      x1 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x1, k1k2, 0x00), _mm_clmulepi64_si128 (x1, k1k2, 0x11)),
+                          _mm_loadu_si128 ((const __m128i *) data));
+      x2 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x2, k1k2, 0x00), _mm_clmulepi64_si128 (x2, k1k2, 0x11)),
+                          _mm_loadu_si128 ((const __m128i *) (data + 16)));
+      x3 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x3, k1k2, 0x00), _mm_clmulepi64_si128 (x3, k1k2, 0x11)),
+                          _mm_loadu_si128 ((const __m128i *) (data + 32)));
+      x4 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x4, k1k2, 0x00), _mm_clmulepi64_si128 (x4, k1k2, 0x11)),
+                          _mm_loadu_si128 ((const __m128i *) (data + 48)));
+    }
+
+  x1 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x1, k3k4, 0x00), _mm_clmulepi64_si128 (x1, k3k4, 0x11)), x2);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x1, k3k4, 0x00), _mm_clmulepi64_si128 (x1, k3k4, 0x11)), x3);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x1, k3k4, 0x00), _mm_clmulepi64_si128 (x1, k3k4, 0x11)), x4);
+
+  for (; length >= 16; data += 16, length -= 16)
+    x1 = _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x1, k3k4, 0x00), _mm_clmulepi64_si128 (x1, k3k4, 0x11)),
+                        _mm_loadu_si128 ((const __m128i *) data));
+
+  /* 128 to 64 bits */
+  x2 = _mm_clmulepi64_si128 (x1, k3k4, 0x10);
+  x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_xor_si128 (_mm_clmulepi64_si128 (_mm_and_si128 (x1, low_32), k5, 0x00), x2);
+
+  /* 64 to 32 bits */
+  x2 = _mm_clmulepi64_si128 (_mm_and_si128 (x1, low_32), polynomial, 0x10);
+  x2 = _mm_clmulepi64_si128 (_mm_and_si128 (x2, low_32), polynomial, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  return (uint32_t) _mm_extract_epi32 (x1, 1);
+}
+
+#endif /* D64FUSE_DIGEST_X86 */
+
+static void select_implementations (void)
+{
+  for (uint32_t byte = 0; byte < 256; byte++)
+    {
+      uint32_t crc = byte;
+      for (int bit = 0; bit < 8; bit++)
+        crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLYNOMIAL : 0);
+      crc32_table[byte] = crc;
+    }
+
+  sha256_blocks = sha256_blocks_scalar;
+  crc32_fold = NULL;
+
+#ifdef D64FUSE_DIGEST_X86
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return;
+  bool has_sse4_1 = (ecx & bit_SSE4_1) and (ecx & bit_SSSE3);
+  if (has_sse4_1 and (ecx & bit_PCLMUL))
+    crc32_fold = crc32_fold_pclmul;
+  if (has_sse4_1 and __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx) and (ebx & bit_SHA))
+    sha256_blocks = sha256_blocks_sha_ni;
+#endif
+}
+
+void d64fuse_digest_init (d64fuse_digest *digest)
+{
+  pthread_once (&digest_once, select_implementations);
+
+  memcpy (digest->state, sha256_initial_state, sizeof (digest->state));
+  digest->length = 0;
+  digest->crc = ~0u;
+}
+
+static void update_crc (d64fuse_digest *digest, const unsigned char *data, size_t length)
+{
+  if (crc32_fold != NULL and length >= CRC32_FOLD_SIZE)
+    {
+      size_t folded = length & ~(size_t) 15;
+      digest->crc = crc32_fold (digest->crc, data, folded);
+      data += folded;
+      length -= folded;
+    }
+  digest->crc = crc32_bytes (digest->crc, data, length);
+}
+
+static void update_sha256 (d64fuse_digest *digest, const unsigned char *data, size_t length)
+{
+  size_t buffered = digest->length % 64;
+  digest->length += length;
+
+  if (buffered > 0)
+    {
+      size_t missing = 64 - buffered;
+      if (length < missing)
+        {
+          memcpy (digest->block + buffered, data, length);
+          return;
+        }
+      memcpy (digest->block + buffered, data, missing);
+      sha256_blocks (digest->state, digest->block, 1);
+      data += missing;
+      length -= missing;
+    }
+
+  if (length >= 64)
+    {
+      sha256_blocks (digest->state, data, length / 64);
+      data += length & ~(size_t) 63;
+      length %= 64;
+    }
+  memcpy (digest->block, data, length);
+}
+
+void d64fuse_digest_update (d64fuse_digest *digest, const unsigned char *data, size_t length)
+{
+  update_crc (digest, data, length);
+  update_sha256 (digest, data, length);
+}
+
+void d64fuse_digest_final (d64fuse_digest *digest, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32)
+{
+  uint64_t bit_length = digest->length * 8;
+  size_t buffered = digest->length % 64;
+
+  digest->block[buffered++] = 0x80;
+  if (buffered > 56)
+    {
+      memset (digest->block + buffered, 0, 64 - buffered);
+      sha256_blocks (digest->state, digest->block, 1);
+      buffered = 0;
+    }
+  memset (digest->block + buffered, 0, 56 - buffered);
+  for (int i = 0; i < 8; i++)
+    digest->block[56 + i] = (unsigned char) (bit_length >> (56 - 8 * i));
+  sha256_blocks (digest->state, digest->block, 1);
+
+  for (int i = 0; i < 8; i++)
+    for (int byte = 0; byte < 4; byte++)
+      sha256[4 * i + byte] = (unsigned char) (digest->state[i] >> (24 - 8 * byte));
+  *crc32 = ~digest->crc;
+}
@@ -0,0 +1,24 @@
+#ifndef D64FUSE_DIGEST
+#define D64FUSE_DIGEST 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define D64FUSE_SHA256_SIZE 32
+
+/* SHA-256 and CRC-32 (the one of zlib) of the same data, fed in pieces of
+   any size. Where the CPU has them, the SHA extensions and the carry-less
+   multiplication are used, chosen at the first d64fuse_digest_init. */
+typedef struct d64fuse_digest
+{
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  uint32_t crc; /* inverted while running */
+} d64fuse_digest;
+
+void d64fuse_digest_init (d64fuse_digest *);
+void d64fuse_digest_update (d64fuse_digest *, const unsigned char *, size_t);
+void d64fuse_digest_final (d64fuse_digest *, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32);
+
+#endif /* D64FUSE_DIGEST */
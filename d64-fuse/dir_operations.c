@@ -1,10 +1,18 @@
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <fuse.h>
 
+#include "diskimage.h"
+
+#include "control_files.h"
 #include "d64fuse_context.h"
+#include "log.h"
+#include "search.h"
+#include "snapshots.h"
 #include "utils.h"
+#include "writeback.h"
 
 
 int d64fuse_opendir (const char *dirname, struct fuse_file_info *fi)
@@ -14,6 +22,9 @@ int d64fuse_opendir (const char *dirname, struct fuse_file_info *fi)
   if (is_null (dirname))
     return -EINVAL;
 
+  if (is_control_directory (dirname) or is_snapshots_path (dirname) or is_search_path (dirname))
+    return 0;
+
   if (!is_root_directory (dirname))
     return -ENOTSUP;
 
@@ -35,25 +46,42 @@ int d64fuse_readdir (const char *dirname, void *buffer, fuse_fill_dir_t fill_dir
   if (is_null (dirname))
     return -EINVAL;
 
-  if (!is_root_directory (dirname))
-    return -ENOTSUP;
+  if (is_control_directory (dirname))
+    return d64fuse_control_readdir (dirname, buffer, fill_dir);
 
   d64fuse_context *context = d64fuse_get_context ();
   if (is_null (context))
     return -EINVAL;
 
+  if (is_snapshots_path (dirname))
+    return d64fuse_snapshots_readdir (dirname, buffer, fill_dir, context);
+
+  if (is_search_path (dirname))
+    return d64fuse_search_readdir (dirname, buffer, fill_dir, context);
+
+  if (!is_root_directory (dirname))
+    return -ENOTSUP;
+
   ensure_stats_initialized (context);
 
+  if (fill_dir (buffer, CONTROL_DIRECTORY_NAME, NULL, 0, 0) == 1
+      or fill_dir (buffer, SNAPSHOTS_DIRECTORY_NAME, NULL, 0, 0) == 1
+      or fill_dir (buffer, SEARCH_DIRECTORY_NAME, NULL, 0, 0) == 1
+      or fill_dir (buffer, DUPES_DIRECTORY_NAME, NULL, 0, 0) == 1)
+    return 0;
+
+  d64fuse_read_lock_image ();
   for (ssize_t i = 0; i < context->nbr_files; i++)
     {
-      d64fuse_file_data *current_file_data = context->file_data + i;
+      d64fuse_file_data *current_file_data = context->file_data[i];
       int result = fill_dir (buffer, current_file_data->filename, NULL, 0, 0);
       if (result == 1)
         {
-          fprintf (stderr, "d64fuse %s: buffer is full when i = %ld", __func__, i);
-          return 0;
+          d64fuse_log_warning ("buffer is full when i = %ld", i);
+          break;
         }
     }
+  d64fuse_unlock_image ();
 
   return 0;
 }
@@ -65,3 +93,139 @@ int d64fuse_releasedir (const char *dirname, struct fuse_file_info *fi)
 
   return 0;
 }
+
+static d64fuse_context *get_writable_context (const char *filename, int *result)
+{
+  *result = 0;
+  if (is_null (filename))
+    *result = -EINVAL;
+  else if (is_control_path (filename) or is_root_directory (filename))
+    *result = -EPERM;
+  else if (is_snapshots_path (filename) or is_search_path (filename))
+    *result = -EROFS;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (*result == 0 and is_null (context))
+    *result = -EINVAL;
+  else if (*result == 0 and !context->writable)
+    *result = -EROFS;
+
+  if (*result != 0)
+    return NULL;
+
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    {
+      *result = -EINVAL;
+      return NULL;
+    }
+
+  return context;
+}
+
+/* the image has no subdirectories: the only directories which can be created
+   are the snapshots */
+int d64fuse_mkdir (const char *dirname, mode_t mode)
+{
+  unused_arg (mode);
+
+  if (is_null (dirname))
+    return -EINVAL;
+
+  if (is_search_path (dirname))
+    return -EROFS;
+  if (!is_snapshots_path (dirname))
+    return -EPERM;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  return d64fuse_snapshots_mkdir (dirname, context);
+}
+
+int d64fuse_rmdir (const char *dirname)
+{
+  if (is_null (dirname))
+    return -EINVAL;
+
+  if (is_search_path (dirname))
+    return -EROFS;
+  if (!is_snapshots_path (dirname))
+    return is_control_directory (dirname) ? -EPERM : -ENOTDIR;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  return d64fuse_snapshots_rmdir (dirname, context);
+}
+
+int d64fuse_unlink (const char *filename)
+{
+  int result;
+  d64fuse_context *context = get_writable_context (filename, &result);
+  if (is_null (context))
+    return result;
+
+  d64fuse_write_lock_image ();
+  d64fuse_file_data *file_data = find_file_data (context, filename);
+  if (is_null (file_data))
+    result = -ENOENT;
+  else
+    {
+      di_delete_entry (context->disk_image, file_data->dir_entry);
+      remove_file_data (context, file_data);
+      result = d64fuse_writeback_request (context);
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+int d64fuse_rename (const char *old_filename, const char *new_filename, unsigned int flags)
+{
+  if (flags & ~RENAME_NOREPLACE)
+    return -EINVAL;
+
+  int result;
+  d64fuse_context *context = get_writable_context (old_filename, &result);
+  if (is_null (context))
+    return result;
+  if (is_null (get_writable_context (new_filename, &result)))
+    return result;
+
+  const char *new_name = new_filename + 1;
+  if (is_not_null (strchr (new_name, '/')))
+    return -ENOENT;
+  if (strlen (new_name) > 16)
+    return -ENAMETOOLONG;
+
+  unsigned char rawname[16];
+  di_rawname_from_name (rawname, (char *) new_name);
+
+  d64fuse_write_lock_image ();
+  d64fuse_file_data *file_data = find_file_data (context, old_filename);
+  d64fuse_file_data *replaced_file_data = find_file_data (context, new_filename);
+  if (is_null (file_data))
+    result = -ENOENT;
+  else if (replaced_file_data != file_data)
+    {
+      if (is_not_null (replaced_file_data) and (flags & RENAME_NOREPLACE))
+        result = -EEXIST;
+      else
+        {
+          if (is_not_null (replaced_file_data))
+            {
+              di_delete_entry (context->disk_image, replaced_file_data->dir_entry);
+              remove_file_data (context, replaced_file_data);
+            }
+          di_rename_entry (context->disk_image, file_data->dir_entry, rawname);
+          rename_file_data (file_data);
+          result = d64fuse_writeback_request (context);
+        }
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
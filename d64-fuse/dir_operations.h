@@ -6,5 +6,9 @@
 int d64fuse_opendir (const char *, struct fuse_file_info *);
 int d64fuse_readdir (const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *, enum fuse_readdir_flags);
 int d64fuse_releasedir (const char *, struct fuse_file_info *);
+int d64fuse_mkdir (const char *, mode_t);
+int d64fuse_rmdir (const char *);
+int d64fuse_unlink (const char *);
+int d64fuse_rename (const char *, const char *, unsigned int);
 
 #endif /* DIR_OPERATIONS */
@@ -1,4 +1,7 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,108 +9,591 @@
 
 #include "diskimage.h"
 
+#include "control_files.h"
 #include "d64fuse_context.h"
+#include "hashes.h"
+#include "log.h"
+#include "probes.h"
+#include "search.h"
+#include "snapshots.h"
+#include "stats.h"
 #include "utils.h"
+#include "writeback.h"
 
-static void load_file_contents (d64fuse_file_data * file_data, struct diskimage * disk_image)
+/* contents of a file, loaded once and shared by the handles opened for
+   reading on any file with the same contents: in the image, in its snapshots
+   or under another name. They are found by their SHA-256, which a commit
+   changes, so that the handles opened before keep reading a consistent copy
+   and the next ones load the new contents */
+typedef struct d64fuse_contents
 {
-  if (file_data->use_count == 0)
+  size_t refs;
+  off_t size;
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  struct d64fuse_contents *next; /* in the same bucket */
+  unsigned char data[];
+} d64fuse_contents;
+
+/* the loaded contents, by the first byte of their SHA-256 */
+#define CONTENTS_BUCKETS 256
+static d64fuse_contents *loaded_contents[CONTENTS_BUCKETS];
+
+/* stored in fi->fh; handles opened for writing buffer the whole file in
+   memory until it is committed by flush or release */
+typedef struct d64fuse_handle
+{
+  pthread_mutex_t lock; /* FUSE may call read and write concurrently on a handle */
+  d64fuse_file_data *file_data;
+  bool writable;
+  d64fuse_contents *contents; /* read-only handles */
+  unsigned char *buffer;      /* writable handles */
+  size_t size;
+  size_t capacity;
+  bool dirty;
+} d64fuse_handle;
+
+/* guards the refs of the contents and the loaded contents */
+static pthread_mutex_t contents_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reads the file_size bytes of the file into buffer; to be called with the
+   image lock held */
+static void read_file (const d64fuse_file_data * file_data, struct diskimage * disk_image, unsigned char *buffer)
+{
+  ImageFile image_file;
+
+  if (di_open_entry_r (disk_image, file_data->dir_entry, &image_file) != 0)
+    return;
+
+  off_t bytes_read = 0;
+  while (bytes_read < file_data->file_size)
     {
-      ImageFile * image_file = di_open (disk_image, file_data->rawname, file_data->file_type, "rb");
-      file_data->contents = malloc (file_data->file_size);
-      ssize_t bytes_read = 0;
-      while (bytes_read < file_data->file_size)
-        {
-          size_t remaining = file_data->file_size - bytes_read;
-          int data_len = di_read (image_file, file_data->contents + bytes_read, remaining);
-          bytes_read += data_len;
-        }
-      di_close (image_file);
+      size_t remaining = file_data->file_size - bytes_read;
+      int data_len = di_read_r (&image_file, buffer + bytes_read, remaining);
+      if (data_len == 0)
+        break;
+      bytes_read += data_len;
+    }
+}
+
+/* to be called with the contents lock held */
+static d64fuse_contents *find_contents (const unsigned char *sha256, off_t size)
+{
+  for (d64fuse_contents *contents = loaded_contents[sha256[0]]; is_not_null (contents); contents = contents->next)
+    if (contents->size == size and memcmp (contents->sha256, sha256, D64FUSE_SHA256_SIZE) == 0)
+      return contents;
+
+  return NULL;
+}
+
+/* the contents are only read when none of the files with the same hash is
+   open, or when the hash of the file is not known yet, in which case it is
+   taken from the contents read; to be called with the image lock held */
+static d64fuse_contents *load_file_contents (d64fuse_context *context, d64fuse_file_data * file_data, struct diskimage * disk_image)
+{
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  uint32_t crc32;
+  bool hashed = d64fuse_known_file_hashes (context, file_data, disk_image, sha256, &crc32);
+
+  pthread_mutex_lock (&contents_lock);
+  d64fuse_contents *contents = hashed ? find_contents (sha256, file_data->file_size) : NULL;
+  if (is_not_null (contents))
+    contents->refs++;
+  pthread_mutex_unlock (&contents_lock);
+  d64fuse_stats_record_cache (is_not_null (contents));
+  if (is_not_null (contents))
+    return contents;
+
+  contents = calloc (1, sizeof (d64fuse_contents) + file_data->file_size);
+  if (is_null (contents))
+    return NULL;
+  contents->size = file_data->file_size;
+  read_file (file_data, disk_image, contents->data);
+  if (!hashed)
+    d64fuse_hash_contents (context, file_data, disk_image, contents->data, sha256, &crc32);
+  memcpy (contents->sha256, sha256, D64FUSE_SHA256_SIZE);
+
+  if (D64FUSE_PROBE_ENABLED (cache__load))
+    D64FUSE_PROBE3 (cache__load, disk_image->filename, file_data->filename, file_data->file_size);
+
+  /* another handle may have loaded the same contents meanwhile */
+  pthread_mutex_lock (&contents_lock);
+  d64fuse_contents *loaded = find_contents (sha256, contents->size);
+  if (is_not_null (loaded))
+    {
+      free (contents);
+      contents = loaded;
+    }
+  else
+    {
+      contents->next = loaded_contents[sha256[0]];
+      loaded_contents[sha256[0]] = contents;
     }
-  file_data->use_count++;
+  contents->refs++;
+  pthread_mutex_unlock (&contents_lock);
+
+  return contents;
 }
 
-static void unload_file_contents (d64fuse_file_data * file_data)
+static void unload_file_contents (d64fuse_file_data * file_data, d64fuse_contents *contents, struct diskimage * disk_image)
 {
-  if (file_data->use_count == 0)
+  pthread_mutex_lock (&contents_lock);
+  if (contents->refs == 0)
     {
-      fprintf (stderr, "d64fuse %s: inconsistency: the use_count is already 0\n", __func__);
+      pthread_mutex_unlock (&contents_lock);
+      d64fuse_log_error ("inconsistency: the refs are already 0");
       return;
     }
 
-  file_data->use_count--;
-  if (file_data->use_count == 0)
+  contents->refs--;
+  if (contents->refs == 0)
+    {
+      if (D64FUSE_PROBE_ENABLED (cache__evict))
+        D64FUSE_PROBE3 (cache__evict, disk_image->filename, file_data->filename, contents->size);
+
+      d64fuse_contents **link = &loaded_contents[contents->sha256[0]];
+      while (*link != contents)
+        link = &(*link)->next;
+      *link = contents->next;
+      free (contents);
+    }
+  pthread_mutex_unlock (&contents_lock);
+}
+
+static size_t blocks_for_size (size_t size)
+{
+  return (size + 253) / 254;
+}
+
+/* the blocks of the file can be reused for its new contents, counted as
+   di_write_entry does; the data of an unlinked file is discarded but still
+   limited to the size of the image. A size larger than the image never fits,
+   which also keeps the block count from overflowing. To be called with the
+   image lock held */
+static bool fits_in_image (const d64fuse_file_data * file_data, struct diskimage * disk_image, size_t size)
+{
+  if (size > (size_t) disk_image->size)
+    return false;
+
+  if (is_null (file_data->dir_entry))
+    return true;
+
+  size_t available = blocks_free (disk_image) + di_chain_blocks_freed (disk_image, file_data->dir_entry->startts);
+
+  return blocks_for_size (size) <= available;
+}
+
+static int resize_buffer (d64fuse_handle *handle, size_t size)
+{
+  if (size > handle->capacity)
     {
-      free (file_data->contents);
-      file_data->contents = NULL;
+      size_t capacity = (handle->capacity > 0) ? handle->capacity : 256;
+      while (capacity < size)
+        capacity *= 2;
+      unsigned char *buffer = realloc (handle->buffer, capacity);
+      if (is_null (buffer))
+        return -ENOMEM;
+      handle->buffer = buffer;
+      handle->capacity = capacity;
     }
+  if (size > handle->size)
+    memset (handle->buffer + handle->size, 0, size - handle->size);
+  handle->size = size;
+  handle->dirty = true;
+
+  return 0;
+}
+
+/* writes the buffer of the handle to the image as a single chain; to be
+   called with the handle lock held */
+static int commit_handle (d64fuse_context *context, d64fuse_handle *handle)
+{
+  if (!handle->dirty)
+    return 0;
+
+  int result = 0;
+  d64fuse_write_lock_image ();
+  d64fuse_file_data *file_data = handle->file_data;
+  /* the data of an unlinked file is discarded */
+  if (is_not_null (file_data->dir_entry))
+    {
+      if (di_write_entry (context->disk_image, file_data->dir_entry, handle->buffer, handle->size) != 0)
+        result = -ENOSPC;
+      else
+        {
+          file_data->file_size = handle->size;
+          file_data->splat_file = false;
+          clock_gettime (CLOCK_REALTIME, &file_data->mtime);
+          /* the next handles load the new contents */
+          file_data->hashed = false;
+          result = d64fuse_writeback_request (context);
+        }
+    }
+  d64fuse_unlock_image ();
+  if (result == 0)
+    handle->dirty = false;
+
+  return result;
+}
+
+/* to be called with the image lock held */
+static int open_file_data (d64fuse_context *context, struct diskimage *disk_image, d64fuse_file_data *file_data, struct fuse_file_info *fi)
+{
+  d64fuse_handle *handle = calloc (1, sizeof (d64fuse_handle));
+  if (is_null (handle))
+    return -ENOMEM;
+
+  handle->file_data = file_data;
+  handle->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+  if (handle->writable)
+    {
+      size_t size = (fi->flags & O_TRUNC) ? 0 : file_data->file_size;
+      if (resize_buffer (handle, size) != 0)
+        {
+          free (handle);
+          return -ENOMEM;
+        }
+      if (size > 0)
+        read_file (file_data, disk_image, handle->buffer);
+      handle->dirty = (fi->flags & O_TRUNC) and file_data->file_size > 0;
+    }
+  else
+    {
+      handle->contents = load_file_contents (context, file_data, disk_image);
+      if (is_null (handle->contents))
+        {
+          free (handle);
+          return -ENOMEM;
+        }
+    }
+
+  pthread_mutex_init (&handle->lock, NULL);
+  fi->fh = (uintptr_t) handle;
+
+  return 0;
 }
 
 /* d64fuse_operations */
 
 int d64fuse_open (const char *filename, struct fuse_file_info *fi)
 {
-  unused_arg (fi);
-
   if (is_null (filename))
     return -EINVAL;
 
+  if (is_control_path (filename))
+    return d64fuse_control_open (filename, fi);
+
   d64fuse_context *context = d64fuse_get_context ();
   if (is_null (context))
     return -EINVAL;
 
+  if ((fi->flags & O_ACCMODE) != O_RDONLY and (!context->writable or is_snapshots_path (filename) or is_search_path (filename)))
+    return -EROFS;
+
   ensure_disk_image_loaded (context);
   if (is_null (context->disk_image))
     return -EINVAL;
 
-  d64fuse_file_data *file_data = find_file_data (context, filename);
-  if (is_null (file_data))
+  ensure_stats_initialized (context);
+  d64fuse_read_lock_image ();
+  struct diskimage *disk_image = context->disk_image;
+  d64fuse_file_data *file_data = is_snapshots_path (filename)
+    ? find_snapshot_file_data (context, filename, &disk_image)
+    : find_file_data (context, filename);
+  int result = is_null (file_data) ? -ENOENT : open_file_data (context, disk_image, file_data, fi);
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+int d64fuse_create (const char *filename, mode_t mode, struct fuse_file_info *fi)
+{
+  unused_arg (mode);
+
+  if (is_null (filename))
+    return -EINVAL;
+
+  if (is_control_path (filename))
+    return -EPERM;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  if (!context->writable or is_snapshots_path (filename) or is_search_path (filename))
+    return -EROFS;
+
+  const char *name = filename + 1;
+  if (filename[0] != '/' or is_not_null (strchr (name, '/')))
     return -ENOENT;
+  if (strlen (name) == 0)
+    return -EINVAL;
+  if (strlen (name) > 16)
+    return -ENAMETOOLONG;
 
-  load_file_contents (file_data, context->disk_image);
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    return -EINVAL;
 
-  return 0;
+  unsigned char rawname[16];
+  di_rawname_from_name (rawname, (char *) name);
+
+  int result = 0;
+  d64fuse_write_lock_image ();
+  if (is_not_null (find_file_data (context, filename)))
+    result = -EEXIST;
+  else
+    {
+      RawDirEntry *rde = alloc_file_entry (context->disk_image, rawname, T_PRG);
+      if (is_null (rde))
+        result = (context->disk_image->status == 72) ? -ENOSPC : -EEXIST;
+      else
+        {
+          /* closes the entry, as an empty file */
+          di_write_entry (context->disk_image, rde, NULL, 0);
+          d64fuse_file_data *file_data = add_file_data (context, rde);
+          if (is_null (file_data))
+            {
+              di_delete_entry (context->disk_image, rde);
+              result = -ENOMEM;
+            }
+          else
+            {
+              result = d64fuse_writeback_request (context);
+              if (result == 0)
+                result = open_file_data (context, context->disk_image, file_data, fi);
+            }
+        }
+    }
+  d64fuse_unlock_image ();
+
+  return result;
 }
 
 int d64fuse_read (const char *filename, char *buffer, size_t buffer_size, off_t offset, struct fuse_file_info *fi)
 {
-  unused_arg (fi);
-
   if (is_null (filename))
     return -EINVAL;
 
   if (is_null (buffer))
     return -EINVAL;
 
+  if (is_control_path (filename))
+    return d64fuse_control_read (filename, buffer, buffer_size, offset, fi);
+
+  d64fuse_handle *handle = (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle))
+    return -EBADF;
+
+  if (!handle->writable)
+    {
+      const d64fuse_contents *contents = handle->contents;
+      if (offset >= contents->size)
+        return 0;
+
+      ssize_t copy_size = buffer_size;
+      if (copy_size + offset > contents->size)
+        copy_size = contents->size - offset;
+      memcpy (buffer, contents->data + offset, copy_size);
+
+      return copy_size;
+    }
+
+  pthread_mutex_lock (&handle->lock);
+  ssize_t copy_size = 0;
+  if ((size_t) offset < handle->size)
+    {
+      copy_size = buffer_size;
+      if (copy_size + offset > (off_t) handle->size)
+        copy_size = handle->size - offset;
+      memcpy (buffer, handle->buffer + offset, copy_size);
+    }
+  pthread_mutex_unlock (&handle->lock);
+
+  return copy_size;
+}
+
+int d64fuse_write (const char *filename, const char *buffer, size_t buffer_size, off_t offset, struct fuse_file_info *fi)
+{
+  if (is_null (filename) or is_null (buffer))
+    return -EINVAL;
+
+  if (is_control_path (filename))
+    return -EBADF;
+
   d64fuse_context *context = d64fuse_get_context ();
   if (is_null (context))
     return -EINVAL;
 
-  const d64fuse_file_data *file_data = find_file_data (context, filename);
-  if (is_null (file_data))
-    return -ENOENT;
+  d64fuse_handle *handle = (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle) or !handle->writable)
+    return -EBADF;
 
-  ssize_t copy_size = buffer_size;
-  if (copy_size + offset > file_data->file_size)
-    copy_size = file_data->file_size - offset;
-  memcpy (buffer, file_data->contents + offset, copy_size);
+  size_t end = offset + buffer_size;
+  pthread_mutex_lock (&handle->lock);
+  if (end > handle->size)
+    {
+      d64fuse_read_lock_image ();
+      bool fits = fits_in_image (handle->file_data, context->disk_image, end);
+      d64fuse_unlock_image ();
+      if (!fits or resize_buffer (handle, end) != 0)
+        {
+          pthread_mutex_unlock (&handle->lock);
+          return fits ? -ENOMEM : -ENOSPC;
+        }
+    }
+  memcpy (handle->buffer + offset, buffer, buffer_size);
+  handle->dirty = true;
+  pthread_mutex_unlock (&handle->lock);
 
-  return copy_size;
+  return buffer_size;
+}
+
+int d64fuse_truncate (const char *filename, off_t size, struct fuse_file_info *fi)
+{
+  if (is_null (filename))
+    return -EINVAL;
+
+  if (is_control_path (filename))
+    return -EPERM;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  if (!context->writable or is_snapshots_path (filename) or is_search_path (filename))
+    return -EROFS;
+
+  if (size < 0)
+    return -EINVAL;
+
+  d64fuse_handle *handle = is_null (fi) ? NULL : (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_not_null (handle) and !handle->writable)
+    return -EBADF;
+
+  /* without a handle, the file is loaded in a temporary one and committed
+     right away */
+  d64fuse_handle temporary = {.writable = true};
+  if (is_null (handle))
+    {
+      ensure_stats_initialized (context);
+      d64fuse_read_lock_image ();
+      d64fuse_file_data *file_data = find_file_data (context, filename);
+      int result = is_null (file_data) ? -ENOENT : 0;
+      if (result == 0)
+        {
+          temporary.file_data = file_data;
+          result = resize_buffer (&temporary, file_data->file_size);
+          if (result == 0)
+            read_file (file_data, context->disk_image, temporary.buffer);
+        }
+      d64fuse_unlock_image ();
+      if (result != 0)
+        {
+          free (temporary.buffer);
+          return result;
+        }
+      pthread_mutex_init (&temporary.lock, NULL);
+      handle = &temporary;
+    }
+
+  pthread_mutex_lock (&handle->lock);
+  d64fuse_read_lock_image ();
+  bool fits = fits_in_image (handle->file_data, context->disk_image, size);
+  d64fuse_unlock_image ();
+  int result = fits ? resize_buffer (handle, size) : -ENOSPC;
+  if (result == 0 and handle == &temporary)
+    result = commit_handle (context, handle);
+  pthread_mutex_unlock (&handle->lock);
+
+  if (handle == &temporary)
+    {
+      pthread_mutex_destroy (&temporary.lock);
+      free (temporary.buffer);
+    }
+
+  return result;
+}
+
+int d64fuse_flush (const char *filename, struct fuse_file_info *fi)
+{
+  if (is_null (filename) or is_control_path (filename))
+    return 0;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  d64fuse_handle *handle = (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle) or !handle->writable)
+    return 0;
+
+  pthread_mutex_lock (&handle->lock);
+  int result = commit_handle (context, handle);
+  pthread_mutex_unlock (&handle->lock);
+
+  return result;
+}
+
+int d64fuse_fsync (const char *filename, int datasync, struct fuse_file_info *fi)
+{
+  unused_arg (datasync);
+
+  if (is_null (filename) or is_control_path (filename))
+    return 0;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  if (!context->writable)
+    return 0;
+
+  d64fuse_handle *handle = is_null (fi) ? NULL : (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_not_null (handle) and handle->writable)
+    {
+      pthread_mutex_lock (&handle->lock);
+      int result = commit_handle (context, handle);
+      pthread_mutex_unlock (&handle->lock);
+      if (result != 0)
+        return result;
+    }
+
+  int result = 0;
+  d64fuse_write_lock_image ();
+  if (is_not_null (context->disk_image) and di_fsync (context->disk_image) != 0)
+    result = -EIO;
+  d64fuse_unlock_image ();
+
+  return result;
 }
 
 int d64fuse_release (const char *filename, struct fuse_file_info *fi)
 {
-  unused_arg (fi);
+  if (is_control_path (filename))
+    return d64fuse_control_release (filename, fi);
 
   d64fuse_context *context = d64fuse_get_context ();
   if (is_null (context))
     return -EINVAL;
 
-  d64fuse_file_data * file_data = find_file_data (context, filename);
-  if (is_null (file_data))
-    return -ENOENT;
+  d64fuse_handle *handle = (d64fuse_handle *) (uintptr_t) fi->fh;
+  if (is_null (handle))
+    return -EBADF;
 
-  unload_file_contents (file_data);
+  int result = 0;
+  if (handle->writable)
+    {
+      result = commit_handle (context, handle);
+      if (result != 0)
+        d64fuse_log_error ("cannot commit '%s': %s", filename, strerror (-result));
+      free (handle->buffer);
+    }
+  else
+    unload_file_contents (handle->file_data, handle->contents, context->disk_image);
 
-  return 0;
+  pthread_mutex_destroy (&handle->lock);
+  free (handle);
+  fi->fh = 0;
+
+  return result;
 }
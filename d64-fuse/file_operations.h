@@ -1,10 +1,17 @@
 #ifndef FILE_OPERATIONS
 #define FILE_OPERATIONS 1
 
+#include <sys/types.h>
+
 struct fuse_file_info;
 
 int d64fuse_open (const char *, struct fuse_file_info *);
+int d64fuse_create (const char *, mode_t, struct fuse_file_info *);
 int d64fuse_read (const char *, char *, size_t, off_t, struct fuse_file_info *);
+int d64fuse_write (const char *, const char *, size_t, off_t, struct fuse_file_info *);
+int d64fuse_truncate (const char *, off_t, struct fuse_file_info *);
+int d64fuse_flush (const char *, struct fuse_file_info *);
+int d64fuse_fsync (const char *, int, struct fuse_file_info *);
 int d64fuse_release (const char *, struct fuse_file_info *);
 
 #endif /* FILE_OPERATIONS */
@@ -0,0 +1,393 @@
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "d64fuse_context.h"
+#include "digest.h"
+#include "hashes.h"
+#include "log.h"
+#include "utils.h"
+
+/* The sidecar starts with a header holding the mtime and size of the image
+   it was written for, and the hashes of the image, followed by a record per
+   hashed file. A file is recognized by its name, type, first sector and
+   size. All the integers are stored little-endian. */
+
+#define HASH_CACHE_MAGIC "D64HASHC"
+#define HASH_CACHE_VERSION 1
+
+typedef struct __attribute__ ((packed)) hash_cache_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nbr_files;
+  uint64_t mtime_ns;
+  uint64_t size;
+  uint8_t image_hashed;
+  uint8_t image_sha256[D64FUSE_SHA256_SIZE];
+  uint32_t image_crc32;
+} hash_cache_header;
+
+typedef struct __attribute__ ((packed)) hash_cache_file
+{
+  uint8_t rawname[16];
+  uint8_t type;         /* raw directory entry type */
+  uint8_t track;
+  uint8_t sector;
+  uint32_t size;
+  uint8_t sha256[D64FUSE_SHA256_SIZE];
+  uint32_t crc32;
+} hash_cache_file;
+
+typedef struct d64fuse_hashes
+{
+  hash_cache_file *saved_files; /* from the sidecar, valid while the image has not changed */
+  size_t nbr_saved_files;
+  bool image_hashed;
+  unsigned long image_generation; /* the generation of the image hashes */
+  unsigned char image_sha256[D64FUSE_SHA256_SIZE];
+  uint32_t image_crc32;
+  bool unsaved; /* hashes have been computed since the sidecar was read */
+} d64fuse_hashes;
+
+/* guards the hashes of the context and of the file data, which are computed
+   under the image read lock */
+static pthread_mutex_t hashes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t stat_mtime_ns (const struct stat *image_stat)
+{
+  return (uint64_t) image_stat->st_mtim.tv_sec * 1000000000 + image_stat->st_mtim.tv_nsec;
+}
+
+static bool has_sidecar (const d64fuse_context *context)
+{
+  /* the image file does not hold the changes of the overlay */
+  return is_not_null (context->hash_cache_filename) and is_null (context->overlay_filename);
+}
+
+static void read_sidecar (d64fuse_context *context, d64fuse_hashes *hashes)
+{
+  FILE *file = fopen (context->hash_cache_filename, "rb");
+  if (is_null (file))
+    {
+      if (errno != ENOENT)
+        d64fuse_log_warning ("cannot open the hash cache %s: %s", context->hash_cache_filename, strerror (errno));
+      return;
+    }
+
+  hash_cache_header header;
+  if (fread (&header, sizeof (header), 1, file) != 1
+      or memcmp (header.magic, HASH_CACHE_MAGIC, sizeof (header.magic)) != 0
+      or le32toh (header.version) != HASH_CACHE_VERSION)
+    d64fuse_log_warning ("%s is not a hash cache", context->hash_cache_filename);
+  else if (le64toh (header.mtime_ns) != stat_mtime_ns (&context->image_stat)
+           or le64toh (header.size) != (uint64_t) context->image_stat.st_size)
+    d64fuse_log_info ("the hash cache %s is for another version of the image", context->hash_cache_filename);
+  else
+    {
+      size_t nbr_files = le32toh (header.nbr_files);
+      hashes->saved_files = calloc (nbr_files, sizeof (hash_cache_file));
+      if (nbr_files > 0 and (is_null (hashes->saved_files)
+                             or fread (hashes->saved_files, sizeof (hash_cache_file), nbr_files, file) != nbr_files))
+        {
+          d64fuse_log_warning ("cannot read the hash cache %s", context->hash_cache_filename);
+          free (hashes->saved_files);
+          hashes->saved_files = NULL;
+        }
+      else
+        {
+          hashes->nbr_saved_files = nbr_files;
+          hashes->image_hashed = header.image_hashed;
+          hashes->image_generation = 0;
+          memcpy (hashes->image_sha256, header.image_sha256, sizeof (hashes->image_sha256));
+          hashes->image_crc32 = le32toh (header.image_crc32);
+        }
+    }
+  fclose (file);
+}
+
+/* to be called with the hashes lock held */
+static d64fuse_hashes *ensure_hashes_loaded (d64fuse_context *context)
+{
+  if (is_null (context->hashes))
+    {
+      context->hashes = calloc (1, sizeof (d64fuse_hashes));
+      if (is_not_null (context->hashes) and has_sidecar (context))
+        read_sidecar (context, context->hashes);
+    }
+
+  return context->hashes;
+}
+
+/* the saved hashes of a file of the image, NULL when there are none or when
+   the image has changed since the sidecar was read */
+static const hash_cache_file *find_saved_file (const d64fuse_context *context, const d64fuse_hashes *hashes, const d64fuse_file_data *file_data)
+{
+  const RawDirEntry *rde = file_data->dir_entry;
+  if (context->generation != 0 or is_null (rde))
+    return NULL;
+
+  for (size_t i = 0; i < hashes->nbr_saved_files; i++)
+    {
+      const hash_cache_file *saved_file = hashes->saved_files + i;
+      if (saved_file->type == rde->type and saved_file->track == rde->startts.track
+          and saved_file->sector == rde->startts.sector
+          and le32toh (saved_file->size) == (uint64_t) file_data->file_size
+          and memcmp (saved_file->rawname, rde->rawname, sizeof (saved_file->rawname)) == 0)
+        return saved_file;
+    }
+
+  return NULL;
+}
+
+/* hashes the file_size bytes read through the mount, straight from the blocks
+   of the image; like reads, the bytes missing from a broken chain are 0 */
+static void hash_file (const d64fuse_file_data *file_data, struct diskimage *disk_image, unsigned char *sha256, uint32_t *crc32)
+{
+  d64fuse_digest digest;
+  d64fuse_digest_init (&digest);
+
+  off_t remaining = file_data->file_size;
+  ImageFile image_file;
+  if (is_not_null (file_data->dir_entry) and di_open_entry_r (disk_image, file_data->dir_entry, &image_file) == 0)
+    while (remaining > 0)
+      {
+        unsigned char *data;
+        int data_len = di_read_block_r (&image_file, &data);
+        if (data_len == 0)
+          break;
+        if (data_len > remaining)
+          data_len = remaining;
+        d64fuse_digest_update (&digest, data, data_len);
+        remaining -= data_len;
+      }
+
+  static const unsigned char zeros[254];
+  while (remaining > 0)
+    {
+      size_t length = (remaining < (off_t) sizeof (zeros)) ? (size_t) remaining : sizeof (zeros);
+      d64fuse_digest_update (&digest, zeros, length);
+      remaining -= length;
+    }
+
+  d64fuse_digest_final (&digest, sha256, crc32);
+}
+
+bool d64fuse_known_file_hashes (d64fuse_context *context, d64fuse_file_data *file_data, struct diskimage *disk_image, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32)
+{
+  pthread_mutex_lock (&hashes_lock);
+  if (!file_data->hashed and disk_image == context->disk_image)
+    {
+      d64fuse_hashes *hashes = ensure_hashes_loaded (context);
+      const hash_cache_file *saved_file = is_null (hashes) ? NULL : find_saved_file (context, hashes, file_data);
+      if (is_not_null (saved_file))
+        {
+          memcpy (file_data->sha256, saved_file->sha256, sizeof (file_data->sha256));
+          file_data->crc32 = le32toh (saved_file->crc32);
+          file_data->hashed = true;
+        }
+    }
+  bool hashed = file_data->hashed;
+  if (hashed)
+    {
+      memcpy (sha256, file_data->sha256, D64FUSE_SHA256_SIZE);
+      *crc32 = file_data->crc32;
+    }
+  pthread_mutex_unlock (&hashes_lock);
+
+  return hashed;
+}
+
+static void store_file_hashes (d64fuse_context *context, d64fuse_file_data *file_data, struct diskimage *disk_image, const unsigned char *sha256, uint32_t crc32)
+{
+  pthread_mutex_lock (&hashes_lock);
+  memcpy (file_data->sha256, sha256, D64FUSE_SHA256_SIZE);
+  file_data->crc32 = crc32;
+  file_data->hashed = true;
+  if (disk_image == context->disk_image and is_not_null (context->hashes))
+    context->hashes->unsaved = true;
+  pthread_mutex_unlock (&hashes_lock);
+}
+
+void d64fuse_file_hashes (d64fuse_context *context, d64fuse_file_data *file_data, struct diskimage *disk_image, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32)
+{
+  if (d64fuse_known_file_hashes (context, file_data, disk_image, sha256, crc32))
+    return;
+
+  hash_file (file_data, disk_image, sha256, crc32);
+  store_file_hashes (context, file_data, disk_image, sha256, *crc32);
+}
+
+void d64fuse_hash_contents (d64fuse_context *context, d64fuse_file_data *file_data, struct diskimage *disk_image, const unsigned char *contents, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32)
+{
+  d64fuse_digest digest;
+  d64fuse_digest_init (&digest);
+  d64fuse_digest_update (&digest, contents, file_data->file_size);
+  d64fuse_digest_final (&digest, sha256, crc32);
+
+  store_file_hashes (context, file_data, disk_image, sha256, *crc32);
+}
+
+/* the image as mounted, the changes of the overlay included */
+void d64fuse_image_hashes (d64fuse_context *context, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32)
+{
+  pthread_mutex_lock (&hashes_lock);
+  d64fuse_hashes *hashes = ensure_hashes_loaded (context);
+  bool hashed = is_not_null (hashes) and hashes->image_hashed and hashes->image_generation == context->generation;
+  if (hashed)
+    {
+      memcpy (sha256, hashes->image_sha256, D64FUSE_SHA256_SIZE);
+      *crc32 = hashes->image_crc32;
+    }
+  pthread_mutex_unlock (&hashes_lock);
+  if (hashed)
+    return;
+
+  d64fuse_digest digest;
+  d64fuse_digest_init (&digest);
+  d64fuse_digest_update (&digest, context->disk_image->image, context->disk_image->size);
+  d64fuse_digest_final (&digest, sha256, crc32);
+
+  pthread_mutex_lock (&hashes_lock);
+  if (is_not_null (hashes))
+    {
+      memcpy (hashes->image_sha256, sha256, D64FUSE_SHA256_SIZE);
+      hashes->image_crc32 = *crc32;
+      hashes->image_generation = context->generation;
+      hashes->image_hashed = true;
+      hashes->unsaved = true;
+    }
+  pthread_mutex_unlock (&hashes_lock);
+}
+
+/* the hashes computed during the mount, and the ones of the sidecar still
+   valid; to be called with the image lock and the hashes lock held */
+static hash_cache_file *collect_files (d64fuse_context *context, size_t *nbr_files)
+{
+  hash_cache_file *files = calloc (context->nbr_files > 0 ? context->nbr_files : 1, sizeof (hash_cache_file));
+  if (is_null (files))
+    return NULL;
+
+  *nbr_files = 0;
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    {
+      const d64fuse_file_data *file_data = context->file_data[i];
+      const RawDirEntry *rde = file_data->dir_entry;
+      hash_cache_file *file = files + *nbr_files;
+      if (file_data->hashed)
+        {
+          memcpy (file->sha256, file_data->sha256, sizeof (file->sha256));
+          file->crc32 = htole32 (file_data->crc32);
+        }
+      else
+        {
+          const hash_cache_file *saved_file = find_saved_file (context, context->hashes, file_data);
+          if (is_null (saved_file))
+            continue;
+          *file = *saved_file;
+        }
+      memcpy (file->rawname, rde->rawname, sizeof (file->rawname));
+      file->type = rde->type;
+      file->track = rde->startts.track;
+      file->sector = rde->startts.sector;
+      file->size = htole32 ((uint32_t) file_data->file_size);
+      (*nbr_files)++;
+    }
+
+  return files;
+}
+
+static int write_sidecar (const char *filename, const hash_cache_header *header, const hash_cache_file *files, size_t nbr_files)
+{
+  char *temporary_filename;
+  if (asprintf (&temporary_filename, "%s.tmp", filename) == -1)
+    return -ENOMEM;
+
+  int result = 0;
+  FILE *file = fopen (temporary_filename, "wb");
+  if (is_null (file))
+    result = -errno;
+  else
+    {
+      errno = 0;
+      if (fwrite (header, sizeof (*header), 1, file) != 1
+          or fwrite (files, sizeof (hash_cache_file), nbr_files, file) != nbr_files
+          or fflush (file) != 0 or fsync (fileno (file)) != 0)
+        result = (errno != 0) ? -errno : -EIO;
+      if (fclose (file) != 0 and result == 0)
+        result = -errno;
+      if (result == 0 and rename (temporary_filename, filename) != 0)
+        result = -errno;
+      if (result != 0)
+        unlink (temporary_filename);
+    }
+  free (temporary_filename);
+
+  return result;
+}
+
+int d64fuse_save_hashes (d64fuse_context *context)
+{
+  if (!has_sidecar (context) or is_null (context->hashes) or !context->hashes->unsaved)
+    return 0;
+
+  hash_cache_header header = {.magic = HASH_CACHE_MAGIC, .version = htole32 (HASH_CACHE_VERSION)};
+  hash_cache_file *files = NULL;
+  size_t nbr_files = 0;
+  int result = 0;
+
+  d64fuse_read_lock_image ();
+  pthread_mutex_lock (&hashes_lock);
+  d64fuse_hashes *hashes = context->hashes;
+  struct stat image_stat;
+  /* the hashes would not describe the image file */
+  if (is_null (context->disk_image) or context->disk_image->modified)
+    result = -EAGAIN;
+  else if (stat (context->image_filename, &image_stat) == -1)
+    result = -errno;
+  else
+    {
+      header.mtime_ns = htole64 (stat_mtime_ns (&image_stat));
+      header.size = htole64 ((uint64_t) image_stat.st_size);
+      if (hashes->image_hashed and hashes->image_generation == context->generation)
+        {
+          header.image_hashed = 1;
+          memcpy (header.image_sha256, hashes->image_sha256, sizeof (header.image_sha256));
+          header.image_crc32 = htole32 (hashes->image_crc32);
+        }
+      files = collect_files (context, &nbr_files);
+      if (is_null (files))
+        result = -ENOMEM;
+    }
+  pthread_mutex_unlock (&hashes_lock);
+  d64fuse_unlock_image ();
+
+  if (result == 0)
+    {
+      header.nbr_files = htole32 ((uint32_t) nbr_files);
+      result = write_sidecar (context->hash_cache_filename, &header, files, nbr_files);
+    }
+  free (files);
+  if (result != 0)
+    d64fuse_log_warning ("cannot save the hash cache %s: %s", context->hash_cache_filename, strerror (-result));
+  else
+    context->hashes->unsaved = false;
+
+  return result;
+}
+
+void d64fuse_free_hashes (d64fuse_context *context)
+{
+  if (is_null (context->hashes))
+    return;
+
+  free (context->hashes->saved_files);
+  free (context->hashes);
+  context->hashes = NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef D64FUSE_HASHES
+#define D64FUSE_HASHES 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "d64fuse_context.h"
+#include "digest.h"
+
+struct diskimage;
+
+/* SHA-256 and CRC-32 of the files and of the whole image, computed at the
+   first request from the blocks of the image and kept until the file or the
+   image changes. With a hash cache, they are also saved at unmount to a
+   sidecar file, reused by the next mounts as long as the image keeps its
+   mtime and size. */
+
+/* to be called with the image lock held; disk_image is the image of the
+   file, the one of its snapshot for a snapshot file */
+void d64fuse_file_hashes (d64fuse_context *, d64fuse_file_data *, struct diskimage *, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32);
+/* the hashes of the file only when they are already known, without reading
+   it; returns whether they are */
+bool d64fuse_known_file_hashes (d64fuse_context *, d64fuse_file_data *, struct diskimage *, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32);
+/* hashes the file_size bytes of contents just read from the file */
+void d64fuse_hash_contents (d64fuse_context *, d64fuse_file_data *, struct diskimage *, const unsigned char *contents, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32);
+void d64fuse_image_hashes (d64fuse_context *, unsigned char sha256[D64FUSE_SHA256_SIZE], uint32_t *crc32);
+
+/* to be called once the changes have been written back */
+int d64fuse_save_hashes (d64fuse_context *);
+void d64fuse_free_hashes (d64fuse_context *);
+
+#endif /* D64FUSE_HASHES */
@@ -0,0 +1,350 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "digest.h"
+#include "index.h"
+#include "utils.h"
+
+#define INDEX_READ_BUFFER_SIZE 65536
+
+static inline uint64_t stat_mtime_ns (const struct stat *image_stat)
+{
+  return (uint64_t) image_stat->st_mtim.tv_sec * 1000000000 + image_stat->st_mtim.tv_nsec;
+}
+
+/* checks that every record points inside the mapping, so that the readers
+   never have to */
+static bool is_valid_index (const d64fuse_index *index)
+{
+  const d64fuse_index_header *header = index->header;
+  if (memcmp (header->magic, D64FUSE_INDEX_MAGIC, sizeof (header->magic)) != 0
+      or le32toh (header->version) != D64FUSE_INDEX_VERSION)
+    return false;
+
+  uint64_t nbr_images = le32toh (header->nbr_images);
+  uint64_t nbr_files = le32toh (header->nbr_files);
+  uint64_t paths_size = le32toh (header->paths_size);
+  if (sizeof (d64fuse_index_header) + nbr_images * sizeof (d64fuse_index_image)
+      + nbr_files * sizeof (d64fuse_index_file) + paths_size != index->size)
+    return false;
+  if (paths_size > 0 and index->paths[paths_size - 1] != '\0')
+    return false;
+
+  for (uint64_t i = 0; i < nbr_images; i++)
+    {
+      const d64fuse_index_image *image = index->images + i;
+      if (le32toh (image->path_offset) >= paths_size
+          or (uint64_t) le32toh (image->first_file) + le32toh (image->nbr_files) > nbr_files)
+        return false;
+    }
+
+  return true;
+}
+
+int d64fuse_index_open (const char *filename, d64fuse_index *index)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd == -1)
+    return -errno;
+
+  struct stat index_stat;
+  if (fstat (fd, &index_stat) == -1)
+    {
+      int error = errno;
+      close (fd);
+      return -error;
+    }
+  if ((size_t) index_stat.st_size < sizeof (d64fuse_index_header))
+    {
+      close (fd);
+      return -EINVAL;
+    }
+
+  void *data = mmap (NULL, index_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  int error = errno;
+  close (fd);
+  if (data == MAP_FAILED)
+    return -error;
+
+  const d64fuse_index_header *header = data;
+  index->data = data;
+  index->size = index_stat.st_size;
+  index->header = header;
+  index->images = (const d64fuse_index_image *) (header + 1);
+  index->files = (const d64fuse_index_file *) (index->images + le32toh (header->nbr_images));
+  index->paths = (const char *) (index->files + le32toh (header->nbr_files));
+  if (!is_valid_index (index))
+    {
+      d64fuse_index_close (index);
+      return -EINVAL;
+    }
+
+  return 0;
+}
+
+void d64fuse_index_close (d64fuse_index *index)
+{
+  if (is_not_null (index->data))
+    munmap (index->data, index->size);
+  index->data = NULL;
+}
+
+const char *d64fuse_index_image_path (const d64fuse_index *index, const d64fuse_index_image *image)
+{
+  return index->paths + le32toh (image->path_offset);
+}
+
+const d64fuse_index_file *d64fuse_index_image_files (const d64fuse_index *index, const d64fuse_index_image *image)
+{
+  return index->files + le32toh (image->first_file);
+}
+
+/* returns the record of the image at path, or NULL when it is not indexed or
+   has changed since */
+const d64fuse_index_image *d64fuse_index_find (const d64fuse_index *index, const char *path, const struct stat *image_stat)
+{
+  size_t low = 0;
+  size_t high = le32toh (index->header->nbr_images);
+
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+      const d64fuse_index_image *image = index->images + middle;
+      int order = strcmp (path, d64fuse_index_image_path (index, image));
+      if (order == 0)
+        {
+          if (le64toh (image->mtime_ns) != stat_mtime_ns (image_stat)
+              or le64toh (image->size) != (uint64_t) image_stat->st_size)
+            return NULL;
+          return image;
+        }
+      if (order < 0)
+        high = middle;
+      else
+        low = middle + 1;
+    }
+
+  return NULL;
+}
+
+static inline bool is_indexed_entry (const RawDirEntry *rde)
+{
+  return (rde->type & 0x07) < 7 and rde->rawname[0] != 0xa and rde->rawname[0] != 0;
+}
+
+static uint64_t digest_hash (d64fuse_digest *digest)
+{
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  uint32_t crc32;
+
+  d64fuse_digest_final (digest, sha256, &crc32);
+
+  return d64fuse_index_hash (sha256);
+}
+
+/* reads the whole chain, as d64-fuse does to get the exact size */
+static void scan_file (DiskImage *disk_image, RawDirEntry *rde, d64fuse_index_file *file)
+{
+  unsigned char buffer[INDEX_READ_BUFFER_SIZE];
+  ImageFile image_file;
+  d64fuse_digest digest;
+  uint32_t size = 0;
+
+  d64fuse_digest_init (&digest);
+  if (di_open_entry_r (disk_image, rde, &image_file) == 0)
+    while (true)
+      {
+        int data_len = di_read_r (&image_file, buffer, INDEX_READ_BUFFER_SIZE);
+        d64fuse_digest_update (&digest, buffer, data_len);
+        size += data_len;
+        /* a cyclic chain reports 52 (file too long) and would never end */
+        if (data_len == 0 or image_file.status != 0)
+          break;
+      }
+
+  memcpy (file->rawname, rde->rawname, sizeof (file->rawname));
+  file->type = rde->type;
+  file->blocks = htole16 ((uint16_t) rde->sizehi << 8 | rde->sizelo);
+  file->size = htole32 (size);
+  file->hash = htole64 (digest_hash (&digest));
+}
+
+/* indexes disk_image, loaded from entry->path; a directory chain with an
+   invalid or cyclic link is indexed up to it */
+int d64fuse_index_scan_image (d64fuse_index_entry *entry, DiskImage *disk_image)
+{
+  unsigned char visited[MAXTRACKS][MAXSECTORS] = {{0}};
+  size_t capacity = 0;
+  int result = 0;
+  entry->type = disk_image->type;
+  memcpy (entry->label, di_title (disk_image), sizeof (entry->label));
+  d64fuse_digest digest;
+  d64fuse_digest_init (&digest);
+  d64fuse_digest_update (&digest, disk_image->image, disk_image->size);
+  entry->hash = digest_hash (&digest);
+  entry->files = NULL;
+  entry->nbr_files = 0;
+  for (TrackSector ts = di_get_dir_ts (disk_image); ts.track != 0 and result == 0; ts = next_ts_in_chain (disk_image, ts))
+    {
+      if (!di_ts_is_valid (disk_image->type, ts) or visited[ts.track - 1][ts.sector])
+        break;
+      visited[ts.track - 1][ts.sector] = 1;
+
+      unsigned char *buffer = di_get_ts_addr (disk_image, ts);
+      for (size_t offset = 0; offset < 8; offset++)
+        {
+          RawDirEntry *rde = (RawDirEntry *) (buffer + offset * 32);
+          if (!is_indexed_entry (rde))
+            continue;
+          if (entry->nbr_files == capacity)
+            {
+              capacity = (capacity > 0) ? capacity * 2 : 64;
+              d64fuse_index_file *files = realloc (entry->files, capacity * sizeof (d64fuse_index_file));
+              if (is_null (files))
+                {
+                  result = -ENOMEM;
+                  break;
+                }
+              entry->files = files;
+            }
+          scan_file (disk_image, rde, entry->files + entry->nbr_files++);
+        }
+    }
+
+  return result;
+}
+
+/* indexes the image at entry->path, entry->image_stat being its stat */
+int d64fuse_index_scan (d64fuse_index_entry *entry)
+{
+  DiskImage *disk_image = di_load_image (entry->path);
+  if (is_null (disk_image))
+    return -EIO;
+
+  int result = d64fuse_index_scan_image (entry, disk_image);
+  di_free_image (disk_image);
+
+  return result;
+}
+
+/* fills entry from the record of an unchanged image */
+int d64fuse_index_copy (const d64fuse_index *index, const d64fuse_index_image *image, d64fuse_index_entry *entry)
+{
+  entry->nbr_files = le32toh (image->nbr_files);
+  entry->files = malloc ((entry->nbr_files > 0 ? entry->nbr_files : 1) * sizeof (d64fuse_index_file));
+  if (is_null (entry->files))
+    return -ENOMEM;
+  memcpy (entry->files, d64fuse_index_image_files (index, image), entry->nbr_files * sizeof (d64fuse_index_file));
+  entry->type = image->type;
+  memcpy (entry->label, image->label, sizeof (entry->label));
+  entry->hash = le64toh (image->hash);
+
+  return 0;
+}
+
+void d64fuse_index_free_entry (d64fuse_index_entry *entry)
+{
+  free (entry->path);
+  free (entry->files);
+  entry->path = NULL;
+  entry->files = NULL;
+}
+
+static int compare_entries (const void *left, const void *right)
+{
+  return strcmp (((const d64fuse_index_entry *) left)->path, ((const d64fuse_index_entry *) right)->path);
+}
+
+static int write_entries (FILE *file, const d64fuse_index_entry *entries, size_t nbr_entries)
+{
+  uint32_t nbr_files = 0;
+  uint32_t paths_size = 0;
+  for (size_t i = 0; i < nbr_entries; i++)
+    {
+      nbr_files += entries[i].nbr_files;
+      paths_size += strlen (entries[i].path) + 1;
+    }
+
+  d64fuse_index_header header = {.magic = D64FUSE_INDEX_MAGIC,
+                                 .version = htole32 (D64FUSE_INDEX_VERSION),
+                                 .nbr_images = htole32 (nbr_entries),
+                                 .nbr_files = htole32 (nbr_files),
+                                 .paths_size = htole32 (paths_size)};
+  if (fwrite (&header, sizeof (header), 1, file) != 1)
+    return -1;
+
+  uint32_t first_file = 0;
+  uint32_t path_offset = 0;
+  for (size_t i = 0; i < nbr_entries; i++)
+    {
+      const d64fuse_index_entry *entry = entries + i;
+      d64fuse_index_image image = {.mtime_ns = htole64 (stat_mtime_ns (&entry->image_stat)),
+                                   .size = htole64 (entry->image_stat.st_size),
+                                   .path_offset = htole32 (path_offset),
+                                   .first_file = htole32 (first_file),
+                                   .nbr_files = htole32 (entry->nbr_files),
+                                   .type = entry->type,
+                                   .hash = htole64 (entry->hash)};
+      memcpy (image.label, entry->label, sizeof (image.label));
+      if (fwrite (&image, sizeof (image), 1, file) != 1)
+        return -1;
+      first_file += entry->nbr_files;
+      path_offset += strlen (entry->path) + 1;
+    }
+
+  for (size_t i = 0; i < nbr_entries; i++)
+    if (fwrite (entries[i].files, sizeof (d64fuse_index_file), entries[i].nbr_files, file) != entries[i].nbr_files)
+      return -1;
+
+  for (size_t i = 0; i < nbr_entries; i++)
+    if (fwrite (entries[i].path, strlen (entries[i].path) + 1, 1, file) != 1)
+      return -1;
+
+  return 0;
+}
+
+/* sorts the entries, drops the duplicated paths and replaces the index at
+   filename, so that its readers never see a partial one */
+int d64fuse_index_write (const char *filename, d64fuse_index_entry *entries, size_t nbr_entries)
+{
+  qsort (entries, nbr_entries, sizeof (d64fuse_index_entry), compare_entries);
+  size_t nbr_unique = 0;
+  for (size_t i = 0; i < nbr_entries; i++)
+    if (nbr_unique == 0 or strcmp (entries[nbr_unique - 1].path, entries[i].path) != 0)
+      {
+        d64fuse_index_entry entry = entries[nbr_unique];
+        entries[nbr_unique++] = entries[i];
+        entries[i] = entry;
+      }
+
+  char *temporary_filename;
+  if (asprintf (&temporary_filename, "%s.tmp", filename) == -1)
+    return -ENOMEM;
+
+  int result = 0;
+  FILE *file = fopen (temporary_filename, "wb");
+  if (is_null (file))
+    result = -errno;
+  else
+    {
+      if (write_entries (file, entries, nbr_unique) != 0 or fflush (file) != 0 or fsync (fileno (file)) != 0)
+        result = (errno != 0) ? -errno : -EIO;
+      if (fclose (file) != 0 and result == 0)
+        result = -errno;
+      if (result == 0 and rename (temporary_filename, filename) != 0)
+        result = -errno;
+      if (result != 0)
+        unlink (temporary_filename);
+    }
+  free (temporary_filename);
+
+  return result;
+}
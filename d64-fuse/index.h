@@ -0,0 +1,96 @@
+#ifndef D64FUSE_INDEX
+#define D64FUSE_INDEX 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct diskimage;
+
+/* Library index: the directory of a set of images, written by d64-index and
+   mapped as is by the readers. It starts with a header, followed by the image
+   records sorted by path, by the file records of all the images, in directory
+   order, and by the NUL-terminated paths.
+   An image record is only valid for the file whose mtime and size match.
+   The hashes are the first 64 bits of the SHA-256 of the contents, as
+   d64fuse.sha256 reports them, so that they can be compared to the files of
+   a mount. All the integers are stored little-endian. */
+
+#define D64FUSE_INDEX_MAGIC "D64INDEX"
+#define D64FUSE_INDEX_VERSION 2
+
+typedef struct __attribute__ ((packed)) d64fuse_index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nbr_images;
+  uint32_t nbr_files;
+  uint32_t paths_size;
+} d64fuse_index_header;
+
+typedef struct __attribute__ ((packed)) d64fuse_index_image
+{
+  uint64_t mtime_ns;
+  uint64_t size;
+  uint32_t path_offset; /* from the start of the paths */
+  uint32_t first_file;
+  uint32_t nbr_files;
+  uint8_t type;         /* ImageType */
+  uint8_t label[16];    /* raw disk name */
+  uint64_t hash;        /* of the image file */
+} d64fuse_index_image;
+
+typedef struct __attribute__ ((packed)) d64fuse_index_file
+{
+  uint8_t rawname[16];
+  uint8_t type;         /* raw directory entry type */
+  uint16_t blocks;
+  uint32_t size;        /* bytes, from the block chain */
+  uint64_t hash;        /* of the contents */
+} d64fuse_index_file;
+
+/* a mapped index */
+typedef struct d64fuse_index
+{
+  void *data;
+  size_t size;
+  const d64fuse_index_header *header;
+  const d64fuse_index_image *images;
+  const d64fuse_index_file *files;
+  const char *paths;
+} d64fuse_index;
+
+/* an image being indexed */
+typedef struct d64fuse_index_entry
+{
+  char *path;
+  struct stat image_stat;
+  uint8_t type;
+  uint8_t label[16];
+  uint64_t hash;
+  d64fuse_index_file *files;
+  size_t nbr_files;
+} d64fuse_index_entry;
+
+static inline uint64_t d64fuse_index_hash (const unsigned char *sha256)
+{
+  uint64_t hash = 0;
+  for (int i = 0; i < 8; i++)
+    hash = hash << 8 | sha256[i];
+
+  return hash;
+}
+
+int d64fuse_index_open (const char *, d64fuse_index *);
+void d64fuse_index_close (d64fuse_index *);
+const d64fuse_index_image *d64fuse_index_find (const d64fuse_index *, const char *, const struct stat *);
+const d64fuse_index_file *d64fuse_index_image_files (const d64fuse_index *, const d64fuse_index_image *);
+const char *d64fuse_index_image_path (const d64fuse_index *, const d64fuse_index_image *);
+
+int d64fuse_index_scan (d64fuse_index_entry *);
+int d64fuse_index_scan_image (d64fuse_index_entry *, struct diskimage *);
+int d64fuse_index_copy (const d64fuse_index *, const d64fuse_index_image *, d64fuse_index_entry *);
+void d64fuse_index_free_entry (d64fuse_index_entry *);
+int d64fuse_index_write (const char *, d64fuse_index_entry *, size_t);
+
+#endif /* D64FUSE_INDEX */
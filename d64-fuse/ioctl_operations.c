@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fuse.h>
+
+#include "diskimage.h"
+
+#include "control_files.h"
+#include "d64fuse_context.h"
+#include "d64fuse_ioctl.h"
+#include "ioctl_operations.h"
+#include "search.h"
+#include "snapshots.h"
+#include "utils.h"
+#include "writeback.h"
+
+static void add_extent (d64fuse_chain_map *map, const d64fuse_extent *extent)
+{
+  if (map->total_extents >= map->first_extent and map->nbr_extents < D64FUSE_MAX_EXTENTS)
+    map->extents[map->nbr_extents++] = *extent;
+  map->total_extents++;
+}
+
+/* extends the current extent with the block when it continues it, with the
+   same step */
+static void add_block (d64fuse_chain_map *map, d64fuse_extent *extent, TrackSector ts, ImageType type)
+{
+  map->nbr_blocks++;
+
+  if (extent->nbr_blocks > 0 and ts.track == extent->track and extent->nbr_blocks < UINT8_MAX)
+    {
+      int nbr_sectors = di_sectors_per_track (type, ts.track);
+      int last_sector = (extent->sector + (extent->nbr_blocks - 1) * extent->step) % nbr_sectors;
+      int step = (ts.sector - last_sector + nbr_sectors) % nbr_sectors;
+      if (step != 0 and (extent->nbr_blocks == 1 or step == extent->step))
+        {
+          extent->step = step;
+          extent->nbr_blocks++;
+          return;
+        }
+    }
+
+  if (extent->nbr_blocks > 0)
+    add_extent (map, extent);
+  *extent = (d64fuse_extent) {.track = ts.track, .sector = ts.sector, .nbr_blocks = 1};
+}
+
+/* walks the chain as the reads do, so that it stops where they stop */
+static int get_chain (d64fuse_context *context, const char *filename, d64fuse_chain_map *map)
+{
+  ensure_stats_initialized (context);
+  d64fuse_read_lock_image ();
+  struct diskimage *disk_image = context->disk_image;
+  d64fuse_file_data *file_data = is_snapshots_path (filename)
+    ? find_snapshot_file_data (context, filename, &disk_image)
+    : find_file_data (context, filename);
+  if (is_null (file_data))
+    {
+      d64fuse_unlock_image ();
+      return -ENOENT;
+    }
+
+  map->nbr_extents = 0;
+  map->total_extents = 0;
+  map->nbr_blocks = 0;
+
+  ImageFile image_file;
+  d64fuse_extent extent = {0};
+  if (di_open_entry_r (disk_image, file_data->dir_entry, &image_file) == 0)
+    {
+      unsigned char *data;
+      while (di_read_block_r (&image_file, &data) > 0)
+        {
+          add_block (map, &extent, image_file.ts, disk_image->type);
+          /* a cyclic chain reports 52 (file too long) and would never end */
+          if (image_file.status != 0)
+            break;
+        }
+    }
+  if (extent.nbr_blocks > 0)
+    add_extent (map, &extent);
+  map->status = image_file.status;
+  d64fuse_unlock_image ();
+
+  return 0;
+}
+
+static int check_sectors (const d64fuse_sectors *sectors, ImageType type)
+{
+  if (sectors->nbr_sectors > D64FUSE_MAX_SECTORS)
+    return -EINVAL;
+
+  for (uint32_t i = 0; i < sectors->nbr_sectors; i++)
+    {
+      TrackSector ts = {.track = sectors->addresses[i].track, .sector = sectors->addresses[i].sector};
+      if (!di_ts_is_valid (type, ts))
+        return -EINVAL;
+    }
+
+  return 0;
+}
+
+static int read_sectors (d64fuse_context *context, d64fuse_sectors *sectors)
+{
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    return -EIO;
+
+  d64fuse_read_lock_image ();
+  int result = check_sectors (sectors, context->disk_image->type);
+  for (uint32_t i = 0; i < sectors->nbr_sectors and result == 0; i++)
+    {
+      TrackSector ts = {.track = sectors->addresses[i].track, .sector = sectors->addresses[i].sector};
+      memcpy (sectors->data[i], di_get_ts_addr (context->disk_image, ts), 256);
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+static bool is_bam_sector (const struct diskimage *disk_image, TrackSector ts)
+{
+  return (ts.track == disk_image->bam.track and ts.sector == disk_image->bam.sector)
+    or (ts.track == disk_image->bam2.track and ts.sector == disk_image->bam2.sector);
+}
+
+/* the sectors may hold the directory, the BAM or the chains of the files,
+   which are all indexed again */
+static int write_sectors (d64fuse_context *context, const d64fuse_sectors *sectors)
+{
+  if (!context->writable)
+    return -EROFS;
+
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    return -EIO;
+
+  d64fuse_write_lock_image ();
+  int result = check_sectors (sectors, context->disk_image->type);
+  if (result == 0 and sectors->nbr_sectors > 0)
+    {
+      bool bam_written = false;
+      for (uint32_t i = 0; i < sectors->nbr_sectors; i++)
+        {
+          TrackSector ts = {.track = sectors->addresses[i].track, .sector = sectors->addresses[i].sector};
+          di_mark_dirty (context->disk_image, ts);
+          memcpy (di_get_ts_addr (context->disk_image, ts), sectors->data[i], 256);
+          bam_written = bam_written or is_bam_sector (context->disk_image, ts);
+        }
+      /* the allocations and statfs go by the mirrors of the BAM */
+      if (bam_written)
+        di_reload_bam (context->disk_image);
+      refresh_file_data (context);
+      result = d64fuse_writeback_request (context);
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+/* d64fuse_operations */
+
+int d64fuse_ioctl (const char *filename, unsigned int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+  unused_arg (arg);
+  unused_arg (fi);
+
+  if (is_null (filename))
+    return -EINVAL;
+
+  if (flags & FUSE_IOCTL_COMPAT)
+    return -ENOSYS;
+
+  d64fuse_context *context = d64fuse_get_context ();
+  if (is_null (context))
+    return -EINVAL;
+
+  /* the mount point stands for the image */
+  if (is_root_directory (filename))
+    switch (cmd)
+      {
+      case D64FUSE_IOC_READ_SECTORS:
+        return read_sectors (context, data);
+      case D64FUSE_IOC_WRITE_SECTORS:
+        return write_sectors (context, data);
+      default:
+        return -ENOTTY;
+      }
+
+  if (is_control_path (filename) or is_search_path (filename)
+      or (is_snapshots_path (filename) and !is_snapshot_file_path (filename)))
+    return -ENOTTY;
+
+  switch (cmd)
+    {
+    case D64FUSE_IOC_GET_CHAIN:
+      return get_chain (context, filename, data);
+    default:
+      return -ENOTTY;
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef IOCTL_OPERATIONS
+#define IOCTL_OPERATIONS 1
+
+struct fuse_file_info;
+
+/* the commands are defined in d64fuse_ioctl.h */
+int d64fuse_ioctl (const char *, unsigned int, void *, struct fuse_file_info *, unsigned int, void *);
+
+#endif /* IOCTL_OPERATIONS */
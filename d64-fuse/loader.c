@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "loader.h"
+#include "log.h"
+#include "utils.h"
+
+/* the largest image, a D81 with its error info */
+#define LOADER_SLOT_SIZE D81ERRSIZE
+#define LOADER_QUEUE_DEPTH 16
+
+/* io_uring through its system calls, as the library needs none of liburing */
+typedef struct loader_ring
+{
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+  bool fixed_buffers; /* the slot buffers are registered */
+} loader_ring;
+
+/* an image being read */
+typedef struct loader_slot
+{
+  unsigned char *buffer;
+  int fd; /* -1 when the slot is free */
+  size_t image_nbr;
+  size_t size;
+  size_t done;
+} loader_slot;
+
+static void *map_ring (int fd, size_t size, off_t offset)
+{
+  void *ring = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+  return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+static void close_ring (loader_ring *ring)
+{
+  if (is_not_null (ring->sqes))
+    munmap (ring->sqes, ring->sqes_size);
+  if (is_not_null (ring->cq_ring) and ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (is_not_null (ring->sq_ring))
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+}
+
+static int open_ring (loader_ring *ring, unsigned char *buffers)
+{
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+  memset (ring, 0, sizeof (loader_ring));
+  ring->fd = syscall (__NR_io_uring_setup, LOADER_QUEUE_DEPTH, &params);
+  if (ring->fd == -1)
+    return -errno;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+  ring->sq_ring = map_ring (ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  if (is_not_null (ring->sq_ring))
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring : map_ring (ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  if (is_not_null (ring->cq_ring))
+    ring->sqes = map_ring (ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (is_null (ring->sqes))
+    {
+      int error = errno;
+      close_ring (ring);
+      return -error;
+    }
+
+  unsigned char *sq_ring = ring->sq_ring;
+  unsigned char *cq_ring = ring->cq_ring;
+  ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+  /* registering pins the buffers once instead of on every read, but counts
+     against RLIMIT_MEMLOCK: plain reads do without */
+  struct iovec iovecs[LOADER_QUEUE_DEPTH];
+  for (size_t i = 0; i < LOADER_QUEUE_DEPTH; i++)
+    iovecs[i] = (struct iovec) {.iov_base = buffers + i * LOADER_SLOT_SIZE, .iov_len = LOADER_SLOT_SIZE};
+  ring->fixed_buffers = syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, LOADER_QUEUE_DEPTH) == 0;
+  if (!ring->fixed_buffers)
+    d64fuse_log_debug ("cannot register the buffers: %s", strerror (errno));
+
+  return 0;
+}
+
+/* queues the read of the rest of the image; there is never more than one
+   read per slot, so the submission queue cannot be full */
+static void queue_read (loader_ring *ring, loader_slot *slot, size_t slot_nbr)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + index;
+
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  sqe->opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (uintptr_t) (slot->buffer + slot->done);
+  sqe->len = slot->size - slot->done;
+  sqe->off = slot->done;
+  sqe->buf_index = slot_nbr;
+  sqe->user_data = slot_nbr;
+  ring->sq_array[index] = index;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/* returns -1 when the image cannot be read in a slot, and should not be
+   loaded at all: only the sizes of the image types fit */
+static int start_image (loader_ring *ring, loader_slot *slot, size_t slot_nbr, const char *path)
+{
+  slot->fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (slot->fd == -1)
+    return -1;
+
+  struct stat image_stat;
+  if (fstat (slot->fd, &image_stat) == -1 or image_stat.st_size == 0 or image_stat.st_size > LOADER_SLOT_SIZE)
+    {
+      close (slot->fd);
+      slot->fd = -1;
+      return -1;
+    }
+  slot->size = image_stat.st_size;
+  slot->done = 0;
+  queue_read (ring, slot, slot_nbr);
+
+  return 0;
+}
+
+static void finish_image (loader_slot *slot, const char * const *paths, d64fuse_loaded_cb_t cb, void *data)
+{
+  close (slot->fd);
+  slot->fd = -1;
+
+  /* the slot buffer is reused for the next image, and a copy costs far less
+     than the read */
+  DiskImage *disk_image = NULL;
+  unsigned char *buffer = malloc (slot->size);
+  if (is_not_null (buffer))
+    {
+      memcpy (buffer, slot->buffer, slot->size);
+      disk_image = di_load_image_buffer (paths[slot->image_nbr], buffer, slot->size);
+    }
+  cb (slot->image_nbr, disk_image, data);
+}
+
+static void complete_read (loader_ring *ring, loader_slot *slots, const struct io_uring_cqe *cqe,
+                           const char * const *paths, d64fuse_loaded_cb_t cb, void *data)
+{
+  size_t slot_nbr = cqe->user_data;
+  loader_slot *slot = slots + slot_nbr;
+
+  if (cqe->res == -EINTR or cqe->res == -EAGAIN)
+    queue_read (ring, slot, slot_nbr);
+  else if (cqe->res < 0)
+    {
+      /* including the kernels without the read operations */
+      close (slot->fd);
+      slot->fd = -1;
+      cb (slot->image_nbr, di_load_image (paths[slot->image_nbr]), data);
+    }
+  else if (cqe->res == 0)
+    {
+      /* truncated since fstat */
+      close (slot->fd);
+      slot->fd = -1;
+      cb (slot->image_nbr, NULL, data);
+    }
+  else
+    {
+      slot->done += cqe->res;
+      if (slot->done < slot->size)
+        queue_read (ring, slot, slot_nbr);
+      else
+        finish_image (slot, paths, cb, data);
+    }
+}
+
+static size_t reap_completions (loader_ring *ring, loader_slot *slots, const char * const *paths, d64fuse_loaded_cb_t cb, void *data)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+  size_t nbr_completed = 0;
+
+  for (; head != tail; head++)
+    {
+      struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+      complete_read (ring, slots, &cqe, paths, cb, data);
+      if (slots[cqe.user_data].fd == -1)
+        nbr_completed++;
+    }
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return nbr_completed;
+}
+
+/* loads the images from *next_path on; on failure, the images from
+   *next_path on and the ones still in the slots are left to the caller */
+static int load_with_ring (loader_ring *ring, loader_slot *slots, const char * const *paths, size_t nbr_paths,
+                           size_t *next_path, d64fuse_loaded_cb_t cb, void *data)
+{
+  size_t nbr_in_flight = 0;
+
+  while (*next_path < nbr_paths or nbr_in_flight > 0)
+    {
+      for (size_t i = 0; i < LOADER_QUEUE_DEPTH and *next_path < nbr_paths; i++)
+        if (slots[i].fd == -1)
+          {
+            slots[i].image_nbr = *next_path;
+            if (start_image (ring, slots + i, i, paths[*next_path]) == 0)
+              nbr_in_flight++;
+            else
+              cb (*next_path, NULL, data);
+            (*next_path)++;
+          }
+      if (nbr_in_flight == 0)
+        continue;
+
+      int submitted = syscall (__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (submitted == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -errno;
+        }
+      ring->to_submit -= submitted;
+      nbr_in_flight -= reap_completions (ring, slots, paths, cb, data);
+    }
+
+  return 0;
+}
+
+bool d64fuse_load_images (const char * const *paths, size_t nbr_paths, d64fuse_loaded_cb_t cb, void *data)
+{
+  loader_slot slots[LOADER_QUEUE_DEPTH];
+  loader_ring ring;
+  size_t next_path = 0;
+  bool batched = false;
+
+  unsigned char *buffers = mmap (NULL, LOADER_QUEUE_DEPTH * LOADER_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  int error = (buffers == MAP_FAILED) ? -errno : open_ring (&ring, buffers);
+  if (error != 0)
+    d64fuse_log_info ("io_uring not available, loading the images one by one: %s", strerror (-error));
+  else
+    {
+      for (size_t i = 0; i < LOADER_QUEUE_DEPTH; i++)
+        slots[i] = (loader_slot) {.buffer = buffers + i * LOADER_SLOT_SIZE, .fd = -1};
+      error = load_with_ring (&ring, slots, paths, nbr_paths, &next_path, cb, data);
+      close_ring (&ring);
+      bool in_flight = false;
+      for (size_t i = 0; i < LOADER_QUEUE_DEPTH; i++)
+        if (slots[i].fd != -1)
+          {
+            close (slots[i].fd);
+            cb (slots[i].image_nbr, di_load_image (paths[slots[i].image_nbr]), data);
+            in_flight = true;
+          }
+      if (error != 0)
+        d64fuse_log_warning ("io_uring failed, loading the rest of the images one by one: %s", strerror (-error));
+      /* the ring may be torn down after close returns: the buffers of reads
+         left in flight are not unmapped, rather than risk the kernel writing
+         to memory reused since */
+      if (in_flight)
+        buffers = MAP_FAILED;
+      batched = true;
+    }
+  if (buffers != MAP_FAILED)
+    munmap (buffers, LOADER_QUEUE_DEPTH * LOADER_SLOT_SIZE);
+
+  for (; next_path < nbr_paths; next_path++)
+    cb (next_path, di_load_image (paths[next_path]), data);
+
+  return batched;
+}
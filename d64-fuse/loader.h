@@ -0,0 +1,19 @@
+#ifndef D64FUSE_LOADER
+#define D64FUSE_LOADER 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct diskimage;
+
+/* receives each image as soon as it is loaded, NULL when it could not be, in
+   no particular order; the image belongs to the callback */
+typedef void (*d64fuse_loaded_cb_t) (size_t image_nbr, struct diskimage *, void *data);
+
+/* Loads the images at paths, keeping many reads in flight with io_uring, into
+   buffers registered once for the whole batch. Falls back to di_load_image,
+   one image after the other, where io_uring is not available. Returns whether
+   io_uring was used. */
+bool d64fuse_load_images (const char * const *paths, size_t nbr_paths, d64fuse_loaded_cb_t cb, void *data);
+
+#endif /* D64FUSE_LOADER */
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "log.h"
+#include "utils.h"
+
+#define RING_SIZE 128 /* must be a power of two */
+#define MESSAGE_SIZE 232
+#define DRAIN_INTERVAL_NS 20000000
+
+d64fuse_log_level d64fuse_current_log_level = D64FUSE_LOG_WARNING;
+
+static const char *level_labels[] = {"none", "error", "warning", "info", "debug"};
+
+typedef struct log_record
+{
+  d64fuse_log_level level;
+  const char *function;
+  char message[MESSAGE_SIZE];
+} log_record;
+
+/* single producer (the owning thread), single consumer (the log thread) */
+typedef struct log_ring
+{
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  _Atomic size_t dropped;
+  _Atomic bool orphaned;
+  struct log_ring *next;
+  log_record records[RING_SIZE];
+} log_ring;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring *rings;
+
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local log_ring *thread_ring;
+static _Thread_local bool thread_exiting;
+
+static _Atomic bool draining;
+static pthread_t drain_thread;
+
+/* runs on the owning thread as it exits; the log thread frees the ring once
+   drained, so the messages of the later destructors of the thread are written
+   directly */
+static void orphan_ring (void *ring)
+{
+  thread_ring = NULL;
+  thread_exiting = true;
+  atomic_store_explicit (&((log_ring *) ring)->orphaned, true, memory_order_release);
+}
+
+static void create_ring_key ()
+{
+  pthread_key_create (&ring_key, orphan_ring);
+}
+
+static log_ring *get_thread_ring ()
+{
+  if (is_not_null (thread_ring) or thread_exiting)
+    return thread_ring;
+
+  log_ring *ring = calloc (1, sizeof (log_ring));
+  if (is_null (ring))
+    return NULL;
+
+  pthread_once (&ring_key_once, create_ring_key);
+  pthread_setspecific (ring_key, ring);
+
+  pthread_mutex_lock (&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock (&rings_lock);
+
+  thread_ring = ring;
+
+  return ring;
+}
+
+static void write_record (d64fuse_log_level level, const char *function, const char *message)
+{
+  fprintf (stderr, "d64fuse %s: [%s] %s\n", function, level_labels[level], message);
+}
+
+void d64fuse_log_message (d64fuse_log_level level, const char *function, const char *format, ...)
+{
+  va_list args;
+  log_ring *ring = NULL;
+
+  if (atomic_load_explicit (&draining, memory_order_acquire))
+    ring = get_thread_ring ();
+
+  if (is_null (ring))
+    {
+      char message[MESSAGE_SIZE];
+      va_start (args, format);
+      vsnprintf (message, sizeof (message), format, args);
+      va_end (args);
+      write_record (level, function, message);
+      return;
+    }
+
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  if (head - tail == RING_SIZE)
+    {
+      atomic_fetch_add_explicit (&ring->dropped, 1, memory_order_relaxed);
+      return;
+    }
+
+  log_record *record = ring->records + (head & (RING_SIZE - 1));
+  record->level = level;
+  record->function = function;
+  va_start (args, format);
+  vsnprintf (record->message, sizeof (record->message), format, args);
+  va_end (args);
+
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+}
+
+static bool drain_ring (log_ring *ring)
+{
+  size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  bool drained = (head != tail);
+
+  for (; tail != head; tail++)
+    {
+      const log_record *record = ring->records + (tail & (RING_SIZE - 1));
+      write_record (record->level, record->function, record->message);
+    }
+  atomic_store_explicit (&ring->tail, tail, memory_order_release);
+
+  size_t dropped = atomic_exchange_explicit (&ring->dropped, 0, memory_order_relaxed);
+  if (dropped > 0)
+    fprintf (stderr, "d64fuse %s: [%s] %zu messages dropped\n", __func__, level_labels[D64FUSE_LOG_WARNING], dropped);
+
+  return drained;
+}
+
+/* drains every ring and releases those whose thread has exited */
+static void drain_rings ()
+{
+  bool drained = false;
+
+  pthread_mutex_lock (&rings_lock);
+  log_ring **ring_ptr = &rings;
+  while (is_not_null (*ring_ptr))
+    {
+      log_ring *ring = *ring_ptr;
+      bool orphaned = atomic_load_explicit (&ring->orphaned, memory_order_acquire);
+      if (drain_ring (ring))
+        drained = true;
+      if (orphaned)
+        {
+          *ring_ptr = ring->next;
+          free (ring);
+        }
+      else
+        ring_ptr = &ring->next;
+    }
+  pthread_mutex_unlock (&rings_lock);
+
+  if (drained)
+    fflush (stderr);
+}
+
+static void *drain_loop (void *arg)
+{
+  unused_arg (arg);
+
+  const struct timespec interval = {.tv_sec = 0, .tv_nsec = DRAIN_INTERVAL_NS};
+  while (atomic_load_explicit (&draining, memory_order_acquire))
+    {
+      drain_rings ();
+      nanosleep (&interval, NULL);
+    }
+
+  return NULL;
+}
+
+int d64fuse_log_parse_level (const char *value, d64fuse_log_level *level)
+{
+  for (size_t i = 0; i < sizeof (level_labels) / sizeof (level_labels[0]); i++)
+    if (strcasecmp (value, level_labels[i]) == 0)
+      {
+        *level = i;
+        return 0;
+      }
+
+  char *end;
+  long numeric = strtol (value, &end, 10);
+  if (*value == '\0' or *end != '\0' or numeric < D64FUSE_LOG_NONE or numeric > D64FUSE_LOG_DEBUG)
+    return -1;
+  *level = numeric;
+
+  return 0;
+}
+
+void d64fuse_log_start ()
+{
+  if (atomic_exchange (&draining, true))
+    return;
+
+  if (pthread_create (&drain_thread, NULL, drain_loop, NULL) != 0)
+    {
+      atomic_store (&draining, false);
+      d64fuse_log_warning ("could not start the log thread, logging synchronously");
+    }
+}
+
+void d64fuse_log_stop ()
+{
+  if (!atomic_exchange (&draining, false))
+    return;
+
+  pthread_join (drain_thread, NULL);
+  drain_rings ();
+}
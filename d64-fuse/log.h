@@ -0,0 +1,44 @@
+#ifndef D64FUSE_LOG
+#define D64FUSE_LOG 1
+
+typedef enum d64fuse_log_level
+{
+  D64FUSE_LOG_NONE = 0,
+  D64FUSE_LOG_ERROR,
+  D64FUSE_LOG_WARNING,
+  D64FUSE_LOG_INFO,
+  D64FUSE_LOG_DEBUG
+} d64fuse_log_level;
+
+/* messages above this level are removed at compile time */
+#ifndef D64FUSE_LOG_MAX_LEVEL
+#define D64FUSE_LOG_MAX_LEVEL D64FUSE_LOG_DEBUG
+#endif
+
+extern d64fuse_log_level d64fuse_current_log_level;
+
+/* A disabled message costs a single branch: the arguments are not evaluated
+   and nothing is formatted. Enabled messages are queued in a per-thread ring
+   and written to stderr by the log thread, once started. */
+#define d64fuse_log(level, ...)                                         \
+  do                                                                    \
+    {                                                                   \
+      if ((level) <= D64FUSE_LOG_MAX_LEVEL                              \
+          && __builtin_expect ((level) <= d64fuse_current_log_level, 0)) \
+        d64fuse_log_message ((level), __func__, __VA_ARGS__);           \
+    }                                                                   \
+  while (0)
+
+#define d64fuse_log_error(...) d64fuse_log (D64FUSE_LOG_ERROR, __VA_ARGS__)
+#define d64fuse_log_warning(...) d64fuse_log (D64FUSE_LOG_WARNING, __VA_ARGS__)
+#define d64fuse_log_info(...) d64fuse_log (D64FUSE_LOG_INFO, __VA_ARGS__)
+#define d64fuse_log_debug(...) d64fuse_log (D64FUSE_LOG_DEBUG, __VA_ARGS__)
+
+int d64fuse_log_parse_level (const char *, d64fuse_log_level *);
+void d64fuse_log_message (d64fuse_log_level, const char *, const char *, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+void d64fuse_log_start ();
+void d64fuse_log_stop ();
+
+#endif /* D64FUSE_LOG */
@@ -1,37 +1,272 @@
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <fuse.h>
+
 #include "d64fuse_context.h"
 #include "file_operations.h"
+#include "hashes.h"
 #include "dir_operations.h"
 #include "common_operations.h"
+#include "ioctl_operations.h"
+#include "log.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include "writeback.h"
+
+static void *d64fuse_init (struct fuse_conn_info *conn, struct fuse_config *config)
+{
+  unused_arg (conn);
+
+  d64fuse_log_start ();
+
+  d64fuse_context *context = fuse_get_context ()->private_data;
+  /* files are modified through the mount only: their cached pages are
+     dropped when a reopen sees a new mtime or size */
+  if (is_not_null (context) and context->writable)
+    {
+      config->auto_cache = 1;
+      d64fuse_writeback_start (context);
+    }
+
+  return context;
+}
 
 static void d64fuse_destroy (void *private_data)
 {
+  d64fuse_writeback_stop ();
+  /* the image file has its last mtime once written back */
+  if (is_not_null (private_data))
+    d64fuse_save_hashes (private_data);
+  d64fuse_trace_close ();
+  d64fuse_log_stop ();
+
   if (is_null (private_data))
       return;
 
-  d64fuse_context *context = private_data;
-  if (is_null (context->disk_image))
-      return;
+  d64fuse_free_context_data (private_data);
+}
+
+#if D64FUSE_USDT
+D64FUSE_PROBE_DEFINE (op__entry);
+D64FUSE_PROBE_DEFINE (op__return);
+D64FUSE_PROBE_DEFINE (cache__load);
+D64FUSE_PROBE_DEFINE (cache__evict);
+#endif
+
+/* instrumented operations: each d64fuse_* operation is registered through a
+   wrapper which accounts for its calls, errors and latency, fires the
+   op__entry/op__return probes and records the call in the trace, if any */
+
+typedef struct op_call
+{
+  d64fuse_op op;
+  const char *path;
+  const char *name;
+  off_t offset;
+  size_t size;
+  uint64_t start;
+} op_call;
+
+static const char *probed_image_filename ()
+{
+  d64fuse_context *context = d64fuse_get_context ();
+
+  return is_null (context) ? NULL : context->image_filename;
+}
+
+static inline op_call op_begin (d64fuse_op op, const char *path, off_t offset, size_t size)
+{
+  if (D64FUSE_PROBE_ENABLED (op__entry))
+    D64FUSE_PROBE5 (op__entry, d64fuse_op_names[op], probed_image_filename (), path, offset, size);
+
+  return (op_call) {.op = op, .path = path, .name = NULL, .offset = offset, .size = size,
+                    .start = d64fuse_stats_clock ()};
+}
+
+static inline int op_end (const op_call *call, int result)
+{
+  uint64_t latency = d64fuse_stats_clock () - call->start;
+
+  d64fuse_stats_record_op (call->op, latency, result);
+
+  if (D64FUSE_PROBE_ENABLED (op__return))
+    D64FUSE_PROBE5 (op__return, d64fuse_op_names[call->op], probed_image_filename (), call->path, result, latency);
+
+  if (d64fuse_trace_enabled)
+    d64fuse_trace_record_op (call->op, call->path, call->name, call->offset, call->size, call->start, latency, result);
+
+  return result;
+}
+
+static int instrumented_open (const char *filename, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_OPEN, filename, 0, 0);
+  return op_end (&call, d64fuse_open (filename, fi));
+}
+
+static int instrumented_read (const char *filename, char *buffer, size_t buffer_size, off_t offset, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_READ, filename, offset, buffer_size);
+  int result = d64fuse_read (filename, buffer, buffer_size, offset, fi);
+  if (result > 0)
+    d64fuse_stats_record_bytes_read (result);
+  return op_end (&call, result);
+}
+
+static int instrumented_create (const char *filename, mode_t mode, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_CREATE, filename, 0, mode);
+  return op_end (&call, d64fuse_create (filename, mode, fi));
+}
+
+static int instrumented_write (const char *filename, const char *buffer, size_t buffer_size, off_t offset, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_WRITE, filename, offset, buffer_size);
+  int result = d64fuse_write (filename, buffer, buffer_size, offset, fi);
+  if (result > 0)
+    d64fuse_stats_record_bytes_written (result);
+  return op_end (&call, result);
+}
+
+static int instrumented_truncate (const char *filename, off_t size, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_TRUNCATE, filename, size, 0);
+  return op_end (&call, d64fuse_truncate (filename, size, fi));
+}
+
+static int instrumented_flush (const char *filename, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_FLUSH, filename, 0, 0);
+  return op_end (&call, d64fuse_flush (filename, fi));
+}
 
-  free (context->disk_image);
-  context->disk_image = NULL;
+static int instrumented_fsync (const char *filename, int datasync, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_FSYNC, filename, 0, datasync);
+  return op_end (&call, d64fuse_fsync (filename, datasync, fi));
+}
+
+static int instrumented_release (const char *filename, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_RELEASE, filename, 0, 0);
+  return op_end (&call, d64fuse_release (filename, fi));
+}
+
+static int instrumented_opendir (const char *dirname, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_OPENDIR, dirname, 0, 0);
+  return op_end (&call, d64fuse_opendir (dirname, fi));
+}
+
+static int instrumented_readdir (const char *dirname, void *buffer, fuse_fill_dir_t fill_dir, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+  op_call call = op_begin (D64FUSE_OP_READDIR, dirname, offset, 0);
+  return op_end (&call, d64fuse_readdir (dirname, buffer, fill_dir, offset, fi, flags));
+}
+
+static int instrumented_releasedir (const char *dirname, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_RELEASEDIR, dirname, 0, 0);
+  return op_end (&call, d64fuse_releasedir (dirname, fi));
+}
+
+static int instrumented_mkdir (const char *dirname, mode_t mode)
+{
+  op_call call = op_begin (D64FUSE_OP_MKDIR, dirname, 0, mode);
+  return op_end (&call, d64fuse_mkdir (dirname, mode));
+}
+
+static int instrumented_rmdir (const char *dirname)
+{
+  op_call call = op_begin (D64FUSE_OP_RMDIR, dirname, 0, 0);
+  return op_end (&call, d64fuse_rmdir (dirname));
+}
+
+static int instrumented_unlink (const char *filename)
+{
+  op_call call = op_begin (D64FUSE_OP_UNLINK, filename, 0, 0);
+  return op_end (&call, d64fuse_unlink (filename));
+}
+
+static int instrumented_rename (const char *old_filename, const char *new_filename, unsigned int flags)
+{
+  op_call call = op_begin (D64FUSE_OP_RENAME, old_filename, 0, flags);
+  call.name = new_filename;
+  return op_end (&call, d64fuse_rename (old_filename, new_filename, flags));
+}
+
+static int instrumented_access (const char *filename, int perms)
+{
+  op_call call = op_begin (D64FUSE_OP_ACCESS, filename, 0, perms);
+  return op_end (&call, d64fuse_access (filename, perms));
+}
+
+static int instrumented_getattr (const char *filename, struct stat *entry_stat, struct fuse_file_info *fi)
+{
+  op_call call = op_begin (D64FUSE_OP_GETATTR, filename, 0, 0);
+  return op_end (&call, d64fuse_getattr (filename, entry_stat, fi));
+}
+
+static int instrumented_statfs (const char *filename, struct statvfs *fs_stat)
+{
+  op_call call = op_begin (D64FUSE_OP_STATFS, filename, 0, 0);
+  return op_end (&call, d64fuse_statfs (filename, fs_stat));
+}
+
+static int instrumented_readlink (const char *filename, char *buffer, size_t buffer_size)
+{
+  op_call call = op_begin (D64FUSE_OP_READLINK, filename, 0, buffer_size);
+  return op_end (&call, d64fuse_readlink (filename, buffer, buffer_size));
+}
+
+static int instrumented_getxattr (const char *filename, const char *attr_name, char *attr_value, size_t attr_value_size)
+{
+  op_call call = op_begin (D64FUSE_OP_GETXATTR, filename, 0, attr_value_size);
+  call.name = attr_name;
+  return op_end (&call, d64fuse_getxattr (filename, attr_name, attr_value, attr_value_size));
+}
+
+static int instrumented_listxattr (const char *filename, char *list, size_t list_size)
+{
+  op_call call = op_begin (D64FUSE_OP_LISTXATTR, filename, 0, list_size);
+  return op_end (&call, d64fuse_listxattr (filename, list, list_size));
+}
+
+static int instrumented_ioctl (const char *filename, unsigned int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+  op_call call = op_begin (D64FUSE_OP_IOCTL, filename, 0, cmd);
+  return op_end (&call, d64fuse_ioctl (filename, cmd, arg, fi, flags, data));
 }
 
 const struct fuse_operations operations = {
-  .open = d64fuse_open,
-  .read = d64fuse_read,
-  .release = d64fuse_release,
+  .open = instrumented_open,
+  .create = instrumented_create,
+  .read = instrumented_read,
+  .write = instrumented_write,
+  .truncate = instrumented_truncate,
+  .flush = instrumented_flush,
+  .fsync = instrumented_fsync,
+  .release = instrumented_release,
 
-  .opendir = d64fuse_opendir,
-  .readdir = d64fuse_readdir,
-  .releasedir = d64fuse_releasedir,
+  .opendir = instrumented_opendir,
+  .readdir = instrumented_readdir,
+  .releasedir = instrumented_releasedir,
+  .mkdir = instrumented_mkdir,
+  .rmdir = instrumented_rmdir,
+  .unlink = instrumented_unlink,
+  .rename = instrumented_rename,
 
-  .access = d64fuse_access,
-  .getattr = d64fuse_getattr,
-  .getxattr = d64fuse_getxattr,
-  .listxattr = d64fuse_listxattr,
+  .access = instrumented_access,
+  .getattr = instrumented_getattr,
+  .statfs = instrumented_statfs,
+  .readlink = instrumented_readlink,
+  .getxattr = instrumented_getxattr,
+  .listxattr = instrumented_listxattr,
+  .ioctl = instrumented_ioctl,
 
+  .init = d64fuse_init,
   .destroy = d64fuse_destroy
 };
@@ -0,0 +1,44 @@
+#ifndef D64FUSE_PROBES
+#define D64FUSE_PROBES 1
+
+/* USDT probes of the "d64fuse" provider, for bpftrace/perf/systemtap:
+
+   op__entry (op, image, path, offset, size)
+   op__return (op, image, path, result, latency_ns)
+   cache__load (image, path, size)
+   cache__evict (image, path, size)
+
+   A probe site is a single nop until a tracer attaches to it. Each probe also
+   has a semaphore, incremented by the tracer, so that the arguments are only
+   computed when someone is listening. */
+
+#if D64FUSE_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define D64FUSE_PROBE_SEMAPHORE(name) d64fuse_##name##_semaphore
+#define D64FUSE_PROBE_DEFINE(name) \
+  unsigned short D64FUSE_PROBE_SEMAPHORE (name) __attribute__ ((section (".probes")))
+#define D64FUSE_PROBE_ENABLED(name) __builtin_expect (D64FUSE_PROBE_SEMAPHORE (name) != 0, 0)
+
+#define D64FUSE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (d64fuse, name, a1, a2, a3)
+#define D64FUSE_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5 (d64fuse, name, a1, a2, a3, a4, a5)
+
+extern unsigned short D64FUSE_PROBE_SEMAPHORE (op__entry);
+extern unsigned short D64FUSE_PROBE_SEMAPHORE (op__return);
+extern unsigned short D64FUSE_PROBE_SEMAPHORE (cache__load);
+extern unsigned short D64FUSE_PROBE_SEMAPHORE (cache__evict);
+
+#else
+
+/* the arguments are still referenced, but never evaluated */
+#define D64FUSE_PROBE_ENABLED(name) 0
+#define D64FUSE_PROBE3(name, a1, a2, a3) \
+  do { (void) sizeof (a1); (void) sizeof (a2); (void) sizeof (a3); } while (0)
+#define D64FUSE_PROBE5(name, a1, a2, a3, a4, a5) \
+  do { (void) sizeof (a1); (void) sizeof (a2); (void) sizeof (a3); (void) sizeof (a4); (void) sizeof (a5); } while (0)
+
+#endif /* D64FUSE_USDT */
+
+#endif /* D64FUSE_PROBES */
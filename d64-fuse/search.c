@@ -0,0 +1,690 @@
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fuse.h>
+
+#include "diskimage.h"
+
+#include "d64fuse_context.h"
+#include "hashes.h"
+#include "index.h"
+#include "log.h"
+#include "search.h"
+#include "snapshots.h"
+#include "utils.h"
+
+#define RAWNAME_SIZE 16
+
+/* The names are matched in a packed table, 16 bytes apart and aligned, so
+   that each one is compared to the pattern with a few vector instructions.
+   The table of the indexed images is built at the first search and kept for
+   the lifetime of the mount, with the index mapped; the one of the image and
+   of its snapshots, which change, is built by every search from their file
+   data, without reading their directories. */
+typedef struct name_table
+{
+  unsigned char (*rawnames)[RAWNAME_SIZE];
+  size_t nbr_names;
+  size_t capacity;
+} name_table;
+
+typedef struct hashed_name
+{
+  uint64_t hash;
+  uint32_t size;
+  uint32_t name_nbr;
+} hashed_name;
+
+typedef struct d64fuse_search
+{
+  d64fuse_index index;
+  name_table names;       /* the files of the indexed images, in index order */
+  uint32_t *images;       /* the image of each name */
+  hashed_name *by_hash;   /* the names sorted by the hash and size of their file */
+  int64_t mounted_image;  /* the image searched live instead, -1 when not indexed */
+} d64fuse_search;
+
+/* serializes the building of the table of the indexed images */
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct search_pattern
+{
+  unsigned char rawname[RAWNAME_SIZE];
+  unsigned int significant; /* one bit per position before the first '*' */
+} search_pattern;
+
+typedef struct search_match
+{
+  const char *source; /* the snapshot or the indexed image, NULL for the image itself */
+  bool indexed;
+  char filename[20];
+} search_match;
+
+/* returns true to stop the search */
+typedef bool (*search_cb_t) (const search_match *, void *data);
+typedef bool (*match_cb_t) (size_t name_nbr, void *data);
+
+static const char search_directory[] = "/" SEARCH_DIRECTORY_NAME;
+static const char dupes_directory[] = "/" DUPES_DIRECTORY_NAME;
+
+static bool is_dupes_path (const char *path)
+{
+  size_t length = sizeof (dupes_directory) - 1;
+
+  return (strncmp (path, dupes_directory, length) == 0
+          and (path[length] == '\0' or path[length] == '/'));
+}
+
+bool is_search_path (const char *path)
+{
+  size_t length = sizeof (search_directory) - 1;
+
+  return (strncmp (path, search_directory, length) == 0
+          and (path[length] == '\0' or path[length] == '/')) or is_dupes_path (path);
+}
+
+static bool is_search_directory (const char *path)
+{
+  return strcmp (path, search_directory) == 0 or strcmp (path, dupes_directory) == 0;
+}
+
+/* parses /.search/<pattern>[/<entry>]; *entry is NULL for the pattern
+   directory */
+static int parse_search_path (const char *path, search_pattern *pattern, const char **entry)
+{
+  const char *name = path + sizeof (search_directory);
+  const char *end = strchr (name, '/');
+  size_t length = is_null (end) ? strlen (name) : (size_t) (end - name);
+  if (length == 0 or length > RAWNAME_SIZE)
+    return -ENOENT;
+
+  char pattern_name[RAWNAME_SIZE + 1];
+  memcpy (pattern_name, name, length);
+  pattern_name[length] = '\0';
+  di_rawname_from_name (pattern->rawname, pattern_name);
+
+  const char *star = strchr (pattern_name, '*');
+  size_t nbr_significant = is_null (star) ? RAWNAME_SIZE : (size_t) (star - pattern_name);
+  pattern->significant = (1u << nbr_significant) - 1;
+
+  *entry = NULL;
+  if (is_not_null (end))
+    {
+      *entry = end + 1;
+      if (**entry == '\0' or is_not_null (strchr (*entry, '/')))
+        return -ENOENT;
+    }
+
+  return 0;
+}
+
+static int add_name (name_table *names, const unsigned char *rawname)
+{
+  if (names->nbr_names == names->capacity)
+    {
+      size_t capacity = (names->capacity > 0) ? names->capacity * 2 : 256;
+      unsigned char (*rawnames)[RAWNAME_SIZE] = aligned_alloc (RAWNAME_SIZE, capacity * RAWNAME_SIZE);
+      if (is_null (rawnames))
+        return -ENOMEM;
+      if (names->nbr_names > 0)
+        memcpy (rawnames, names->rawnames, names->nbr_names * RAWNAME_SIZE);
+      free (names->rawnames);
+      names->rawnames = rawnames;
+      names->capacity = capacity;
+    }
+  memcpy (names->rawnames[names->nbr_names++], rawname, RAWNAME_SIZE);
+
+  return 0;
+}
+
+/* calls cb with the number of every name matching the pattern, as
+   match_pattern does, until it returns true */
+static bool match_names (const name_table *names, const search_pattern *pattern, match_cb_t cb, void *data)
+{
+#ifdef __SSE2__
+  __m128i pattern_name = _mm_loadu_si128 ((const __m128i *) pattern->rawname);
+  __m128i any = _mm_cmpeq_epi8 (pattern_name, _mm_set1_epi8 ('?'));
+  __m128i padding = _mm_set1_epi8 ((char) 0xa0);
+
+  for (size_t i = 0; i < names->nbr_names; i++)
+    {
+      __m128i name = _mm_load_si128 ((const __m128i *) names->rawnames[i]);
+      __m128i name_padding = _mm_cmpeq_epi8 (name, padding);
+      /* '?' stands for any character, but not for the end of the name */
+      unsigned int equal = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (name, pattern_name),
+                                                            _mm_andnot_si128 (name_padding, any)));
+      unsigned int end = _mm_movemask_epi8 (name_padding);
+      /* the pattern must end where the name ends, so the first padding
+         position counts too, and none after it */
+      unsigned int significant = pattern->significant & (end ^ (end - 1));
+      if ((equal & significant) == significant and cb (i, data))
+        return true;
+    }
+#else
+  for (size_t i = 0; i < names->nbr_names; i++)
+    if (match_pattern ((unsigned char *) pattern->rawname, names->rawnames[i]) and cb (i, data))
+      return true;
+#endif
+
+  return false;
+}
+
+/* the files of the image and of its snapshots */
+typedef struct loaded_files
+{
+  name_table names;
+  const char **sources;
+  d64fuse_file_data **file_data;
+  size_t capacity;
+  search_cb_t cb;
+  void *data;
+} loaded_files;
+
+static void add_loaded_file (const char *source, d64fuse_file_data *file_data, struct diskimage *disk_image, void *data)
+{
+  loaded_files *files = data;
+
+  unused_arg (disk_image);
+  if (is_null (file_data->dir_entry))
+    return;
+  if (files->names.nbr_names == files->capacity)
+    {
+      size_t capacity = (files->capacity > 0) ? files->capacity * 2 : 256;
+      const char **sources = realloc (files->sources, capacity * sizeof (char *));
+      if (is_null (sources))
+        return;
+      files->sources = sources;
+      d64fuse_file_data **file_data_array = realloc (files->file_data, capacity * sizeof (d64fuse_file_data *));
+      if (is_null (file_data_array))
+        return;
+      files->file_data = file_data_array;
+      files->capacity = capacity;
+    }
+  size_t name_nbr = files->names.nbr_names;
+  if (add_name (&files->names, file_data->dir_entry->rawname) == 0)
+    {
+      files->sources[name_nbr] = source;
+      files->file_data[name_nbr] = file_data;
+    }
+}
+
+static bool report_loaded_file (size_t name_nbr, void *data)
+{
+  loaded_files *files = data;
+  search_match match = {.source = files->sources[name_nbr]};
+
+  strcpy (match.filename, files->file_data[name_nbr]->filename);
+
+  return files->cb (&match, files->data);
+}
+
+static bool search_loaded_files (d64fuse_context *context, const search_pattern *pattern, search_cb_t cb, void *data)
+{
+  loaded_files files = {.cb = cb, .data = data};
+
+  d64fuse_read_lock_image ();
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    add_loaded_file (NULL, context->file_data[i], context->disk_image, &files);
+  d64fuse_for_each_snapshot_file (context, add_loaded_file, &files);
+  bool stopped = match_names (&files.names, pattern, report_loaded_file, &files);
+  d64fuse_unlock_image ();
+
+  free (files.names.rawnames);
+  free (files.sources);
+  free (files.file_data);
+
+  return stopped;
+}
+
+static int compare_hashed_names (const void *left, const void *right)
+{
+  const hashed_name *left_name = left;
+  const hashed_name *right_name = right;
+
+  if (left_name->hash != right_name->hash)
+    return (left_name->hash < right_name->hash) ? -1 : 1;
+  if (left_name->size != right_name->size)
+    return (left_name->size < right_name->size) ? -1 : 1;
+
+  return (left_name->name_nbr < right_name->name_nbr) ? -1 : (left_name->name_nbr > right_name->name_nbr);
+}
+
+static d64fuse_search *build_search (d64fuse_context *context)
+{
+  d64fuse_search *search = calloc (1, sizeof (d64fuse_search));
+  if (is_null (search))
+    return NULL;
+  search->mounted_image = -1;
+
+  int error = d64fuse_index_open (context->index_filename, &search->index);
+  if (error != 0)
+    {
+      d64fuse_log_warning ("cannot open the index %s: %s", context->index_filename, strerror (-error));
+      return search;
+    }
+
+  const d64fuse_index_header *header = search->index.header;
+  search->images = malloc ((le32toh (header->nbr_files) + 1) * sizeof (uint32_t));
+  hashed_name *by_hash = malloc ((le32toh (header->nbr_files) + 1) * sizeof (hashed_name));
+  if (is_null (search->images) or is_null (by_hash))
+    {
+      free (by_hash);
+      return search;
+    }
+  for (uint32_t image_nbr = 0; image_nbr < le32toh (header->nbr_images); image_nbr++)
+    {
+      const d64fuse_index_image *image = search->index.images + image_nbr;
+      const d64fuse_index_file *files = d64fuse_index_image_files (&search->index, image);
+      if (strcmp (d64fuse_index_image_path (&search->index, image), context->image_filename) == 0)
+        search->mounted_image = image_nbr;
+      for (uint32_t i = 0; i < le32toh (image->nbr_files); i++)
+        {
+          if (add_name (&search->names, files[i].rawname) != 0)
+            {
+              free (by_hash);
+              return search;
+            }
+          size_t name_nbr = search->names.nbr_names - 1;
+          search->images[name_nbr] = image_nbr;
+          by_hash[name_nbr] = (hashed_name) {.hash = le64toh (files[i].hash), .size = le32toh (files[i].size), .name_nbr = name_nbr};
+        }
+    }
+  qsort (by_hash, search->names.nbr_names, sizeof (hashed_name), compare_hashed_names);
+  search->by_hash = by_hash;
+
+  return search;
+}
+
+/* returns NULL without an index */
+static d64fuse_search *get_search (d64fuse_context *context)
+{
+  if (is_null (context->index_filename))
+    return NULL;
+
+  d64fuse_search *search = __atomic_load_n (&context->search, __ATOMIC_ACQUIRE);
+  if (is_not_null (search))
+    return search;
+
+  pthread_mutex_lock (&search_lock);
+  if (is_null (context->search))
+    __atomic_store_n (&context->search, build_search (context), __ATOMIC_RELEASE);
+  search = context->search;
+  pthread_mutex_unlock (&search_lock);
+
+  return search;
+}
+
+typedef struct indexed_files
+{
+  const d64fuse_search *search;
+  search_cb_t cb;
+  void *data;
+} indexed_files;
+
+static bool report_indexed_file (size_t name_nbr, void *data)
+{
+  indexed_files *files = data;
+  const d64fuse_search *search = files->search;
+  uint32_t image_nbr = search->images[name_nbr];
+  if (image_nbr == search->mounted_image)
+    return false;
+
+  const d64fuse_index_image *image = search->index.images + image_nbr;
+  search_match match = {.source = d64fuse_index_image_path (&search->index, image), .indexed = true};
+  di_name_from_rawname (match.filename, search->names.rawnames[name_nbr]);
+  for (char *current = match.filename; *current != '\0'; current++)
+    if (*current == '/')
+      *current = '_';
+
+  return files->cb (&match, files->data);
+}
+
+static void search_files (d64fuse_context *context, const search_pattern *pattern, search_cb_t cb, void *data)
+{
+  if (search_loaded_files (context, pattern, cb, data))
+    return;
+
+  indexed_files files = {.search = get_search (context), .cb = cb, .data = data};
+  if (is_not_null (files.search))
+    match_names (&files.search->names, pattern, report_indexed_file, &files);
+}
+
+/* the duplicates of a file of the image */
+typedef struct file_dupes
+{
+  d64fuse_context *context;
+  d64fuse_file_data *file_data;
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  search_cb_t cb;
+  void *data;
+  bool stopped;
+} file_dupes;
+
+static bool is_dupe (file_dupes *dupes, d64fuse_file_data *file_data, struct diskimage *disk_image)
+{
+  if (file_data == dupes->file_data or is_null (file_data->dir_entry) or file_data->file_size != dupes->file_data->file_size)
+    return false;
+
+  unsigned char sha256[D64FUSE_SHA256_SIZE];
+  uint32_t crc32;
+  d64fuse_file_hashes (dupes->context, file_data, disk_image, sha256, &crc32);
+
+  return memcmp (sha256, dupes->sha256, D64FUSE_SHA256_SIZE) == 0;
+}
+
+static void report_dupe (const char *source, d64fuse_file_data *file_data, struct diskimage *disk_image, void *data)
+{
+  file_dupes *dupes = data;
+  if (dupes->stopped or !is_dupe (dupes, file_data, disk_image))
+    return;
+
+  search_match match = {.source = source};
+  strcpy (match.filename, file_data->filename);
+  dupes->stopped = dupes->cb (&match, dupes->data);
+}
+
+/* calls cb on the files with the same contents as the file, in the image, in
+   its snapshots and in the indexed images, until it returns true; the empty
+   files have none. To be called with the image lock held. */
+static void search_dupes (d64fuse_context *context, d64fuse_file_data *file_data, search_cb_t cb, void *data)
+{
+  if (file_data->file_size == 0)
+    return;
+
+  file_dupes dupes = {.context = context, .file_data = file_data, .cb = cb, .data = data};
+  uint32_t crc32;
+  d64fuse_file_hashes (context, file_data, context->disk_image, dupes.sha256, &crc32);
+
+  for (ssize_t i = 0; i < context->nbr_files; i++)
+    report_dupe (NULL, context->file_data[i], context->disk_image, &dupes);
+  d64fuse_for_each_snapshot_file (context, report_dupe, &dupes);
+
+  const d64fuse_search *search = get_search (context);
+  if (dupes.stopped or is_null (search) or is_null (search->by_hash))
+    return;
+
+  hashed_name key = {.hash = d64fuse_index_hash (dupes.sha256), .size = file_data->file_size};
+  size_t first = 0;
+  size_t end = search->names.nbr_names;
+  while (first < end)
+    {
+      size_t middle = first + (end - first) / 2;
+      if (compare_hashed_names (search->by_hash + middle, &key) < 0)
+        first = middle + 1;
+      else
+        end = middle;
+    }
+
+  indexed_files files = {.search = search, .cb = cb, .data = data};
+  for (size_t i = first; i < search->names.nbr_names and search->by_hash[i].hash == key.hash
+                         and search->by_hash[i].size == key.size; i++)
+    if (report_indexed_file (search->by_hash[i].name_nbr, &files))
+      return;
+}
+
+static bool find_any_dupe (const search_match *match, void *data)
+{
+  unused_arg (match);
+  *(bool *) data = true;
+
+  return true;
+}
+
+static bool has_dupes (d64fuse_context *context, d64fuse_file_data *file_data)
+{
+  bool found = false;
+  search_dupes (context, file_data, find_any_dupe, &found);
+
+  return found;
+}
+
+/* parses /.dupes/<file>[/<entry>] into the file data, with the image lock
+   held; *entry is NULL for the file directory */
+static int parse_dupes_path (const char *path, d64fuse_context *context, d64fuse_file_data **file_data, const char **entry)
+{
+  const char *name = path + sizeof (dupes_directory);
+  const char *end = strchr (name, '/');
+  size_t length = is_null (end) ? strlen (name) : (size_t) (end - name);
+
+  *file_data = NULL;
+  for (ssize_t i = 0; i < context->nbr_files and is_null (*file_data); i++)
+    if (strlen (context->file_data[i]->filename) == length
+        and strncmp (context->file_data[i]->filename, name, length) == 0)
+      *file_data = context->file_data[i];
+  if (is_null (*file_data) or !has_dupes (context, *file_data))
+    return -ENOENT;
+
+  *entry = NULL;
+  if (is_not_null (end))
+    {
+      *entry = end + 1;
+      if (**entry == '\0' or is_not_null (strchr (*entry, '/')))
+        return -ENOENT;
+    }
+
+  return 0;
+}
+
+static int format_entry_name (const search_match *match, char *buffer, size_t size)
+{
+  if (is_null (match->source))
+    return snprintf (buffer, size, "%s", match->filename);
+
+  const char *source = match->source;
+  if (match->indexed)
+    {
+      const char *slash = strrchr (source, '/');
+      if (is_not_null (slash))
+        source = slash + 1;
+    }
+
+  return snprintf (buffer, size, "%s:%s", source, match->filename);
+}
+
+static int format_target (const search_match *match, char *buffer, size_t size)
+{
+  if (is_null (match->source))
+    return snprintf (buffer, size, "../../%s", match->filename);
+  if (match->indexed)
+    return snprintf (buffer, size, "%s", match->source);
+
+  return snprintf (buffer, size, "../../%s/%s/%s", SNAPSHOTS_DIRECTORY_NAME, match->source, match->filename);
+}
+
+typedef struct found_entry
+{
+  const char *name;
+  char target[PATH_MAX];
+  bool found;
+} found_entry;
+
+static bool find_entry (const search_match *match, void *data)
+{
+  found_entry *entry = data;
+  char name[PATH_MAX];
+
+  format_entry_name (match, name, sizeof (name));
+  if (strcmp (name, entry->name) != 0)
+    return false;
+
+  format_target (match, entry->target, sizeof (entry->target));
+  entry->found = true;
+
+  return true;
+}
+
+static int find_dupes_entry (const char *path, found_entry *entry, d64fuse_context *context)
+{
+  d64fuse_file_data *file_data;
+
+  d64fuse_read_lock_image ();
+  int result = parse_dupes_path (path, context, &file_data, &entry->name);
+  if (result == 0 and is_null (entry->name))
+    result = -EISDIR;
+  if (result == 0)
+    {
+      entry->found = false;
+      search_dupes (context, file_data, find_entry, entry);
+      result = entry->found ? 0 : -ENOENT;
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+static int find_search_entry (const char *path, found_entry *entry, d64fuse_context *context)
+{
+  if (is_dupes_path (path))
+    return find_dupes_entry (path, entry, context);
+
+  search_pattern pattern;
+  int result = parse_search_path (path, &pattern, &entry->name);
+  if (result != 0)
+    return result;
+  if (is_null (entry->name))
+    return -EISDIR;
+
+  entry->found = false;
+  search_files (context, &pattern, find_entry, entry);
+
+  return entry->found ? 0 : -ENOENT;
+}
+
+int d64fuse_search_getattr (const char *path, struct stat *entry_stat, d64fuse_context *context)
+{
+  ensure_stats_initialized (context);
+
+  mode_t read_mode = context->image_stat.st_mode & 0444;
+  entry_stat->st_nlink = 2;
+  entry_stat->st_mode = S_IFDIR | read_mode | (read_mode >> 2);
+  if (is_search_directory (path))
+    return 0;
+
+  found_entry entry;
+  int result = find_search_entry (path, &entry, context);
+  if (result == -EISDIR)
+    return 0;
+  if (result != 0)
+    return result;
+
+  entry_stat->st_nlink = 1;
+  entry_stat->st_mode = S_IFLNK | 0777;
+  entry_stat->st_size = strlen (entry.target);
+
+  return 0;
+}
+
+typedef struct listed_entries
+{
+  void *buffer;
+  fuse_fill_dir_t fill_dir;
+} listed_entries;
+
+static bool list_entry (const search_match *match, void *data)
+{
+  listed_entries *entries = data;
+  char name[PATH_MAX];
+
+  format_entry_name (match, name, sizeof (name));
+
+  return entries->fill_dir (entries->buffer, name, NULL, 0, 0) == 1;
+}
+
+static int dupes_readdir (const char *path, void *buffer, fuse_fill_dir_t fill_dir, d64fuse_context *context)
+{
+  int result = 0;
+
+  ensure_stats_initialized (context);
+  d64fuse_read_lock_image ();
+  if (is_search_directory (path))
+    {
+      for (ssize_t i = 0; i < context->nbr_files; i++)
+        if (has_dupes (context, context->file_data[i])
+            and fill_dir (buffer, context->file_data[i]->filename, NULL, 0, 0) == 1)
+          break;
+    }
+  else
+    {
+      d64fuse_file_data *file_data;
+      const char *entry_name;
+      result = parse_dupes_path (path, context, &file_data, &entry_name);
+      if (result == 0 and is_not_null (entry_name))
+        result = -ENOTDIR;
+      if (result == 0)
+        {
+          listed_entries entries = {.buffer = buffer, .fill_dir = fill_dir};
+          search_dupes (context, file_data, list_entry, &entries);
+        }
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+/* the patterns are looked up, not listed */
+int d64fuse_search_readdir (const char *path, void *buffer, fuse_fill_dir_t fill_dir, d64fuse_context *context)
+{
+  if (is_dupes_path (path))
+    return dupes_readdir (path, buffer, fill_dir, context);
+
+  if (is_search_directory (path))
+    return 0;
+
+  search_pattern pattern;
+  const char *entry_name;
+  int result = parse_search_path (path, &pattern, &entry_name);
+  if (result != 0)
+    return result;
+  if (is_not_null (entry_name))
+    return -ENOTDIR;
+
+  ensure_stats_initialized (context);
+  listed_entries entries = {.buffer = buffer, .fill_dir = fill_dir};
+  search_files (context, &pattern, list_entry, &entries);
+
+  return 0;
+}
+
+int d64fuse_search_readlink (const char *path, char *buffer, size_t size, d64fuse_context *context)
+{
+  if (is_search_directory (path))
+    return -EINVAL;
+
+  ensure_stats_initialized (context);
+  found_entry entry;
+  int result = find_search_entry (path, &entry, context);
+  if (result == -EISDIR)
+    return -EINVAL;
+  if (result != 0)
+    return result;
+  if (size == 0)
+    return -EINVAL;
+
+  snprintf (buffer, size, "%s", entry.target);
+
+  return 0;
+}
+
+void d64fuse_free_search (d64fuse_context *context)
+{
+  d64fuse_search *search = context->search;
+  if (is_null (search))
+    return;
+
+  d64fuse_index_close (&search->index);
+  free (search->names.rawnames);
+  free (search->images);
+  free (search->by_hash);
+  free (search);
+  context->search = NULL;
+}
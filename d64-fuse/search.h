@@ -0,0 +1,38 @@
+#ifndef D64FUSE_SEARCH
+#define D64FUSE_SEARCH 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "d64fuse_context.h"
+
+/* virtual directory searching the files by name: /.search/<pattern> holds a
+   symlink to every file matching the pattern, with the CBM wildcards ('*'
+   ends the pattern, '?' stands for any character), in the image, in its
+   snapshots and in the images of the library index.
+   The links to the files of the image are named after them and point to
+   them, the links to the files of a snapshot or of another image are named
+   <snapshot>:<file> or <image file>:<file> and point to the snapshot file or
+   to the image file. */
+#define SEARCH_DIRECTORY_NAME ".search"
+
+/* virtual directory of the duplicates: /.dupes/<file> is there for every file
+   of the image with the same contents as other files, and holds symlinks to
+   them, named as in the search directory. The files are compared by their
+   SHA-256 and size, with the first 64 bits of the SHA-256 for the files of
+   the library index. */
+#define DUPES_DIRECTORY_NAME ".dupes"
+
+/* true for the search and the dupes directories */
+bool is_search_path (const char *);
+
+int d64fuse_search_getattr (const char *, struct stat *, d64fuse_context *);
+int d64fuse_search_readdir (const char *, void *, fuse_fill_dir_t, d64fuse_context *);
+int d64fuse_search_readlink (const char *, char *, size_t, d64fuse_context *);
+
+void d64fuse_free_search (d64fuse_context *);
+
+#endif /* D64FUSE_SEARCH */
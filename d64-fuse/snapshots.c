@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fuse.h>
+
+#include "diskimage.h"
+
+#include "d64fuse_context.h"
+#include "log.h"
+#include "snapshots.h"
+#include "utils.h"
+
+/* The snapshot images share the sectors of the image until it modifies them
+   (see di_snapshot), so that taking one does not depend on the size of the
+   image. The snapshot list and the snapshot images are modified under the
+   image write lock, and read under the read lock. A snapshot lost when it
+   could not get its copy of a modified sector keeps its directory, for rmdir,
+   but its files are gone. */
+typedef struct d64fuse_snapshot
+{
+  char *name;
+  struct diskimage *disk_image;
+  struct timespec ctime;
+  pthread_mutex_t index_lock; /* serializes the lazy indexing of the files */
+  ssize_t nbr_files;          /* -1 until the files are first looked up */
+  d64fuse_file_data **file_data;
+  struct d64fuse_snapshot *next;
+} d64fuse_snapshot;
+
+static const char snapshots_directory[] = "/" SNAPSHOTS_DIRECTORY_NAME;
+
+bool is_snapshots_path (const char *path)
+{
+  size_t length = sizeof (snapshots_directory) - 1;
+
+  return (strncmp (path, snapshots_directory, length) == 0
+          and (path[length] == '\0' or path[length] == '/'));
+}
+
+static bool is_snapshots_directory (const char *path)
+{
+  return strcmp (path, snapshots_directory) == 0;
+}
+
+/* the snapshot name in the path and its length, NULL for the snapshots
+   directory itself */
+static const char *snapshot_name (const char *path, size_t *length)
+{
+  if (!is_snapshots_path (path) or is_snapshots_directory (path))
+    return NULL;
+
+  const char *name = path + sizeof (snapshots_directory);
+  const char *end = strchr (name, '/');
+  *length = is_null (end) ? strlen (name) : (size_t) (end - name);
+
+  return name;
+}
+
+/* the path of the file within the snapshot, "/" included, NULL when the path
+   is not the one of a snapshot file */
+static const char *snapshot_file_name (const char *path)
+{
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  if (is_null (name) or name[length] == '\0')
+    return NULL;
+
+  return name + length;
+}
+
+bool is_snapshot_file_path (const char *path)
+{
+  return is_not_null (snapshot_file_name (path));
+}
+
+/* to be called with the image lock held */
+static bool is_lost (const d64fuse_snapshot *snapshot)
+{
+  return di_snapshot_is_lost (snapshot->disk_image);
+}
+
+/* to be called with the image lock held */
+static d64fuse_snapshot *find_snapshot (d64fuse_context *context, const char *name, size_t length)
+{
+  for (d64fuse_snapshot *snapshot = context->snapshots; is_not_null (snapshot); snapshot = snapshot->next)
+    if (strncmp (snapshot->name, name, length) == 0 and snapshot->name[length] == '\0')
+      return snapshot;
+
+  return NULL;
+}
+
+/* to be called with the image lock held */
+static void ensure_snapshot_indexed (d64fuse_context *context, d64fuse_snapshot *snapshot)
+{
+  if (__atomic_load_n (&snapshot->nbr_files, __ATOMIC_ACQUIRE) > -1)
+    return;
+
+  pthread_mutex_lock (&snapshot->index_lock);
+  if (snapshot->nbr_files == -1)
+    {
+      ssize_t nbr_files = d64fuse_index_files (context, snapshot->disk_image, &snapshot->file_data);
+      for (ssize_t i = 0; i < nbr_files; i++)
+        snapshot->file_data[i]->mtime = snapshot->ctime;
+      __atomic_store_n (&snapshot->nbr_files, nbr_files, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&snapshot->index_lock);
+}
+
+d64fuse_file_data *find_snapshot_file_data (d64fuse_context *context, const char *path, struct diskimage **disk_image)
+{
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  const char *filename = snapshot_file_name (path);
+  if (is_null (filename))
+    return NULL;
+
+  d64fuse_snapshot *snapshot = find_snapshot (context, name, length);
+  if (is_null (snapshot) or is_lost (snapshot))
+    return NULL;
+
+  ensure_snapshot_indexed (context, snapshot);
+  for (ssize_t i = 0; i < snapshot->nbr_files; i++)
+    if (strcmp (filename + 1, snapshot->file_data[i]->filename) == 0)
+      {
+        if (is_not_null (disk_image))
+          *disk_image = snapshot->disk_image;
+        return snapshot->file_data[i];
+      }
+
+  return NULL;
+}
+
+void d64fuse_for_each_snapshot_file (d64fuse_context *context, void (*cb) (const char *, d64fuse_file_data *, struct diskimage *, void *), void *data)
+{
+  for (d64fuse_snapshot *snapshot = context->snapshots; is_not_null (snapshot); snapshot = snapshot->next)
+    {
+      if (is_lost (snapshot))
+        continue;
+      ensure_snapshot_indexed (context, snapshot);
+      for (ssize_t i = 0; i < snapshot->nbr_files; i++)
+        cb (snapshot->name, snapshot->file_data[i], snapshot->disk_image, data);
+    }
+}
+
+/* the snapshot files are handled by the file operations, through
+   find_snapshot_file_data */
+int d64fuse_snapshots_getattr (const char *path, struct stat *entry_stat, d64fuse_context *context)
+{
+  ensure_stats_initialized (context);
+
+  mode_t read_mode = context->image_stat.st_mode & 0444;
+
+  if (is_snapshots_directory (path))
+    {
+      size_t nbr_snapshots = 0;
+      d64fuse_read_lock_image ();
+      for (d64fuse_snapshot *snapshot = context->snapshots; is_not_null (snapshot); snapshot = snapshot->next)
+        nbr_snapshots++;
+      d64fuse_unlock_image ();
+
+      entry_stat->st_nlink = 2 + nbr_snapshots;
+      entry_stat->st_mode = S_IFDIR | read_mode | (read_mode >> 2);
+      if (context->writable)
+        entry_stat->st_mode |= context->image_stat.st_mode & S_IWUSR;
+      return 0;
+    }
+
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  if (name[length] != '\0')
+    return -ENOENT;
+
+  int result = -ENOENT;
+  d64fuse_read_lock_image ();
+  d64fuse_snapshot *snapshot = find_snapshot (context, name, length);
+  if (is_not_null (snapshot))
+    {
+      entry_stat->st_nlink = 2;
+      entry_stat->st_mode = S_IFDIR | read_mode | (read_mode >> 2);
+      entry_stat->st_mtim = snapshot->ctime;
+      entry_stat->st_ctim = snapshot->ctime;
+      result = 0;
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+int d64fuse_snapshots_readdir (const char *path, void *buffer, fuse_fill_dir_t fill_dir, d64fuse_context *context)
+{
+  ensure_stats_initialized (context);
+
+  if (is_snapshots_directory (path))
+    {
+      d64fuse_read_lock_image ();
+      for (d64fuse_snapshot *snapshot = context->snapshots; is_not_null (snapshot); snapshot = snapshot->next)
+        if (fill_dir (buffer, snapshot->name, NULL, 0, 0) == 1)
+          break;
+      d64fuse_unlock_image ();
+      return 0;
+    }
+
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  if (name[length] != '\0')
+    return -ENOTDIR;
+
+  int result = -ENOENT;
+  d64fuse_read_lock_image ();
+  d64fuse_snapshot *snapshot = find_snapshot (context, name, length);
+  if (is_not_null (snapshot) and is_lost (snapshot))
+    result = -EIO;
+  else if (is_not_null (snapshot))
+    {
+      ensure_snapshot_indexed (context, snapshot);
+      for (ssize_t i = 0; i < snapshot->nbr_files; i++)
+        if (fill_dir (buffer, snapshot->file_data[i]->filename, NULL, 0, 0) == 1)
+          break;
+      result = 0;
+    }
+  d64fuse_unlock_image ();
+
+  return result;
+}
+
+int d64fuse_snapshots_mkdir (const char *path, d64fuse_context *context)
+{
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  if (is_null (name))
+    return -EEXIST;
+  /* the snapshots themselves are read-only */
+  if (name[length] != '\0')
+    return -EROFS;
+  if (length == 0)
+    return -EINVAL;
+
+  if (!context->writable)
+    return -EROFS;
+
+  ensure_stats_initialized (context);
+  if (is_null (context->disk_image))
+    return -EIO;
+
+  d64fuse_snapshot *snapshot = calloc (1, sizeof (d64fuse_snapshot));
+  if (is_null (snapshot))
+    return -ENOMEM;
+  snapshot->name = strndup (name, length);
+  if (is_null (snapshot->name))
+    {
+      free (snapshot);
+      return -ENOMEM;
+    }
+  snapshot->nbr_files = -1;
+  pthread_mutex_init (&snapshot->index_lock, NULL);
+  clock_gettime (CLOCK_REALTIME, &snapshot->ctime);
+
+  int result = 0;
+  d64fuse_write_lock_image ();
+  if (is_not_null (find_snapshot (context, name, length)))
+    result = -EEXIST;
+  else
+    {
+      /* the data of the files open for writing is only in the image once
+         they are flushed */
+      snapshot->disk_image = di_snapshot (context->disk_image);
+      if (is_null (snapshot->disk_image))
+        result = -ENOMEM;
+      else
+        {
+          snapshot->next = context->snapshots;
+          context->snapshots = snapshot;
+        }
+    }
+  d64fuse_unlock_image ();
+
+  if (result != 0)
+    {
+      pthread_mutex_destroy (&snapshot->index_lock);
+      free (snapshot->name);
+      free (snapshot);
+    }
+  else
+    d64fuse_log_info ("took the snapshot %s", snapshot->name);
+
+  return result;
+}
+
+static void free_snapshot (d64fuse_snapshot *snapshot)
+{
+  di_free_image (snapshot->disk_image);
+  pthread_mutex_destroy (&snapshot->index_lock);
+  free (snapshot->file_data);
+  free (snapshot->name);
+  free (snapshot);
+}
+
+/* a snapshot is removed along with its files, which are read-only */
+int d64fuse_snapshots_rmdir (const char *path, d64fuse_context *context)
+{
+  size_t length;
+  const char *name = snapshot_name (path, &length);
+  if (is_null (name))
+    return -EPERM;
+  if (name[length] != '\0')
+    return is_null (strchr (name + length + 1, '/')) ? -ENOTDIR : -ENOENT;
+
+  d64fuse_write_lock_image ();
+  d64fuse_snapshot **link = &context->snapshots;
+  while (is_not_null (*link) and (strncmp ((*link)->name, name, length) != 0 or (*link)->name[length] != '\0'))
+    link = &(*link)->next;
+  d64fuse_snapshot *snapshot = *link;
+  if (is_not_null (snapshot))
+    {
+      *link = snapshot->next;
+      /* the handles opened on its files may still be in use */
+      for (ssize_t i = 0; i < snapshot->nbr_files; i++)
+        retire_file_data (context, snapshot->file_data[i]);
+      free_snapshot (snapshot);
+    }
+  d64fuse_unlock_image ();
+
+  return is_null (snapshot) ? -ENOENT : 0;
+}
+
+void d64fuse_free_snapshots (d64fuse_context *context)
+{
+  while (is_not_null (context->snapshots))
+    {
+      d64fuse_snapshot *snapshot = context->snapshots;
+      context->snapshots = snapshot->next;
+      for (ssize_t i = 0; i < snapshot->nbr_files; i++)
+        free (snapshot->file_data[i]);
+      free_snapshot (snapshot);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef D64FUSE_SNAPSHOTS
+#define D64FUSE_SNAPSHOTS 1
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "d64fuse_context.h"
+
+/* virtual directory holding read-only snapshots of the image, next to the
+   image files: creating a directory in it takes a snapshot of the image,
+   removing the directory drops it. The snapshots last as long as the mount. */
+#define SNAPSHOTS_DIRECTORY_NAME ".snapshots"
+
+bool is_snapshots_path (const char *);
+bool is_snapshot_file_path (const char *);
+
+int d64fuse_snapshots_getattr (const char *, struct stat *, d64fuse_context *);
+int d64fuse_snapshots_readdir (const char *, void *, fuse_fill_dir_t, d64fuse_context *);
+int d64fuse_snapshots_mkdir (const char *, d64fuse_context *);
+int d64fuse_snapshots_rmdir (const char *, d64fuse_context *);
+
+/* to be called with the image lock held; sets *disk_image to the image of the
+   snapshot when not NULL */
+d64fuse_file_data *find_snapshot_file_data (d64fuse_context *, const char *, struct diskimage **);
+
+/* calls cb on the files of every snapshot, with the snapshot name and image;
+   to be called with the image lock held */
+void d64fuse_for_each_snapshot_file (d64fuse_context *, void (*cb) (const char *, d64fuse_file_data *, struct diskimage *, void *), void *);
+
+void d64fuse_free_snapshots (d64fuse_context *);
+
+#endif /* D64FUSE_SNAPSHOTS */
@@ -0,0 +1,198 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+#include "utils.h"
+
+const char *d64fuse_op_names[D64FUSE_OP_COUNT] = {
+  "open", "read", "release",
+  "opendir", "readdir", "releasedir",
+  "access", "getattr", "getxattr", "listxattr",
+  "create", "write", "truncate", "flush", "unlink", "rename",
+  "fsync", "statfs", "mkdir", "rmdir", "readlink",
+  "ioctl"
+};
+
+/* Counters are only ever written by their owning thread, so they are updated
+   with plain relaxed loads and stores instead of locked read-modify-writes. The
+   atomics merely make concurrent reads from d64fuse_stats_collect well defined. */
+typedef struct thread_stats
+{
+  _Atomic uint64_t calls[D64FUSE_OP_COUNT];
+  _Atomic uint64_t errors[D64FUSE_OP_COUNT];
+  _Atomic uint64_t latency[D64FUSE_OP_COUNT][D64FUSE_LATENCY_BUCKETS];
+  _Atomic uint64_t bytes_read;
+  _Atomic uint64_t bytes_written;
+  _Atomic uint64_t cache_hits;
+  _Atomic uint64_t cache_misses;
+  struct thread_stats *next;
+} thread_stats;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats *registry;
+static d64fuse_stats retired_stats; /* totals of the threads that have exited */
+
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static _Thread_local thread_stats *current_stats;
+
+static inline void bump (_Atomic uint64_t *counter, uint64_t value)
+{
+  atomic_store_explicit (counter, atomic_load_explicit (counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void add_thread_stats (d64fuse_stats *totals, thread_stats *stats)
+{
+  for (size_t op = 0; op < D64FUSE_OP_COUNT; op++)
+    {
+      totals->calls[op] += atomic_load_explicit (&stats->calls[op], memory_order_relaxed);
+      totals->errors[op] += atomic_load_explicit (&stats->errors[op], memory_order_relaxed);
+      for (size_t bucket = 0; bucket < D64FUSE_LATENCY_BUCKETS; bucket++)
+        totals->latency[op][bucket] += atomic_load_explicit (&stats->latency[op][bucket], memory_order_relaxed);
+    }
+  totals->bytes_read += atomic_load_explicit (&stats->bytes_read, memory_order_relaxed);
+  totals->bytes_written += atomic_load_explicit (&stats->bytes_written, memory_order_relaxed);
+  totals->cache_hits += atomic_load_explicit (&stats->cache_hits, memory_order_relaxed);
+  totals->cache_misses += atomic_load_explicit (&stats->cache_misses, memory_order_relaxed);
+}
+
+static void retire_thread_stats (void *data)
+{
+  thread_stats *stats = data;
+
+  pthread_mutex_lock (&registry_lock);
+  add_thread_stats (&retired_stats, stats);
+  for (thread_stats **stats_ptr = &registry; is_not_null (*stats_ptr); stats_ptr = &(*stats_ptr)->next)
+    if (*stats_ptr == stats)
+      {
+        *stats_ptr = stats->next;
+        break;
+      }
+  pthread_mutex_unlock (&registry_lock);
+
+  free (stats);
+}
+
+static void create_stats_key ()
+{
+  pthread_key_create (&stats_key, retire_thread_stats);
+}
+
+static thread_stats *get_thread_stats ()
+{
+  if (is_not_null (current_stats))
+    return current_stats;
+
+  thread_stats *stats = calloc (1, sizeof (thread_stats));
+  if (is_null (stats))
+    return NULL;
+
+  pthread_once (&stats_key_once, create_stats_key);
+  pthread_setspecific (stats_key, stats);
+
+  pthread_mutex_lock (&registry_lock);
+  stats->next = registry;
+  registry = stats;
+  pthread_mutex_unlock (&registry_lock);
+
+  current_stats = stats;
+
+  return stats;
+}
+
+uint64_t d64fuse_stats_clock ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void d64fuse_stats_record_op (d64fuse_op op, uint64_t latency, int result)
+{
+  thread_stats *stats = get_thread_stats ();
+  if (is_null (stats))
+    return;
+
+  size_t bucket = (latency == 0) ? 0 : 64 - __builtin_clzll (latency);
+  if (bucket >= D64FUSE_LATENCY_BUCKETS)
+    bucket = D64FUSE_LATENCY_BUCKETS - 1;
+
+  bump (&stats->calls[op], 1);
+  if (result < 0)
+    bump (&stats->errors[op], 1);
+  bump (&stats->latency[op][bucket], 1);
+}
+
+void d64fuse_stats_record_bytes_read (size_t bytes)
+{
+  thread_stats *stats = get_thread_stats ();
+  if (is_not_null (stats))
+    bump (&stats->bytes_read, bytes);
+}
+
+void d64fuse_stats_record_bytes_written (size_t bytes)
+{
+  thread_stats *stats = get_thread_stats ();
+  if (is_not_null (stats))
+    bump (&stats->bytes_written, bytes);
+}
+
+void d64fuse_stats_record_cache (bool hit)
+{
+  thread_stats *stats = get_thread_stats ();
+  if (is_not_null (stats))
+    bump (hit ? &stats->cache_hits : &stats->cache_misses, 1);
+}
+
+void d64fuse_stats_collect (d64fuse_stats *totals)
+{
+  pthread_mutex_lock (&registry_lock);
+  *totals = retired_stats;
+  for (thread_stats *stats = registry; is_not_null (stats); stats = stats->next)
+    add_thread_stats (totals, stats);
+  pthread_mutex_unlock (&registry_lock);
+}
+
+/* returns a malloc'ed text report, one "key value" pair per line */
+char *d64fuse_stats_format (size_t *length)
+{
+  d64fuse_stats totals;
+  char *report = NULL;
+  size_t report_size = 0;
+
+  d64fuse_stats_collect (&totals);
+
+  FILE *stream = open_memstream (&report, &report_size);
+  if (is_null (stream))
+    return NULL;
+
+  uint64_t cache_lookups = totals.cache_hits + totals.cache_misses;
+  fprintf (stream, "bytes_read %" PRIu64 "\n", totals.bytes_read);
+  fprintf (stream, "bytes_written %" PRIu64 "\n", totals.bytes_written);
+  fprintf (stream, "cache_hits %" PRIu64 "\n", totals.cache_hits);
+  fprintf (stream, "cache_misses %" PRIu64 "\n", totals.cache_misses);
+  fprintf (stream, "cache_hit_rate %.3f\n", cache_lookups ? (double) totals.cache_hits / cache_lookups : 0.0);
+
+  for (size_t op = 0; op < D64FUSE_OP_COUNT; op++)
+    {
+      fprintf (stream, "op.%s.calls %" PRIu64 "\n", d64fuse_op_names[op], totals.calls[op]);
+      fprintf (stream, "op.%s.errors %" PRIu64 "\n", d64fuse_op_names[op], totals.errors[op]);
+      fprintf (stream, "op.%s.latency_ns", d64fuse_op_names[op]);
+      for (size_t bucket = 0; bucket < D64FUSE_LATENCY_BUCKETS; bucket++)
+        if (totals.latency[op][bucket] > 0)
+          fprintf (stream, " <%" PRIu64 ":%" PRIu64, UINT64_C (1) << bucket, totals.latency[op][bucket]);
+      fprintf (stream, "\n");
+    }
+
+  fclose (stream);
+  if (is_not_null (length))
+    *length = report_size;
+
+  return report;
+}
@@ -0,0 +1,60 @@
+#ifndef D64FUSE_STATS
+#define D64FUSE_STATS 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum d64fuse_op
+{
+  D64FUSE_OP_OPEN = 0,
+  D64FUSE_OP_READ,
+  D64FUSE_OP_RELEASE,
+  D64FUSE_OP_OPENDIR,
+  D64FUSE_OP_READDIR,
+  D64FUSE_OP_RELEASEDIR,
+  D64FUSE_OP_ACCESS,
+  D64FUSE_OP_GETATTR,
+  D64FUSE_OP_GETXATTR,
+  D64FUSE_OP_LISTXATTR,
+  D64FUSE_OP_CREATE,
+  D64FUSE_OP_WRITE,
+  D64FUSE_OP_TRUNCATE,
+  D64FUSE_OP_FLUSH,
+  D64FUSE_OP_UNLINK,
+  D64FUSE_OP_RENAME,
+  D64FUSE_OP_FSYNC,
+  D64FUSE_OP_STATFS,
+  D64FUSE_OP_MKDIR,
+  D64FUSE_OP_RMDIR,
+  D64FUSE_OP_READLINK,
+  D64FUSE_OP_IOCTL,
+  D64FUSE_OP_COUNT
+} d64fuse_op;
+
+/* bucket n counts the calls that took less than 2^n ns (and at least 2^(n-1)) */
+#define D64FUSE_LATENCY_BUCKETS 32
+
+typedef struct d64fuse_stats
+{
+  uint64_t calls[D64FUSE_OP_COUNT];
+  uint64_t errors[D64FUSE_OP_COUNT];
+  uint64_t latency[D64FUSE_OP_COUNT][D64FUSE_LATENCY_BUCKETS];
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+} d64fuse_stats;
+
+extern const char *d64fuse_op_names[D64FUSE_OP_COUNT];
+
+uint64_t d64fuse_stats_clock ();
+void d64fuse_stats_record_op (d64fuse_op, uint64_t, int);
+void d64fuse_stats_record_bytes_read (size_t);
+void d64fuse_stats_record_bytes_written (size_t);
+void d64fuse_stats_record_cache (bool);
+
+void d64fuse_stats_collect (d64fuse_stats *);
+char *d64fuse_stats_format (size_t *);
+
+#endif /* D64FUSE_STATS */
@@ -0,0 +1,142 @@
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+bool d64fuse_trace_enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static uint64_t trace_start;
+
+int d64fuse_trace_open (const char *filename, const char *image_filename)
+{
+  trace_file = fopen (filename, "wb");
+  if (is_null (trace_file))
+    return -errno;
+  setvbuf (trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+  size_t image_filename_length = strlen (image_filename);
+  d64fuse_trace_header header = {.magic = D64FUSE_TRACE_MAGIC,
+                                 .version = htole32 (D64FUSE_TRACE_VERSION),
+                                 .image_filename_length = htole32 (image_filename_length)};
+  if (fwrite (&header, sizeof (header), 1, trace_file) != 1
+      or fwrite (image_filename, 1, image_filename_length, trace_file) != image_filename_length)
+    {
+      int error = errno;
+      fclose (trace_file);
+      trace_file = NULL;
+      return -error;
+    }
+
+  trace_start = d64fuse_stats_clock ();
+  d64fuse_trace_enabled = true;
+
+  return 0;
+}
+
+static inline size_t trace_length (const char *str)
+{
+  size_t length = is_null (str) ? 0 : strlen (str);
+
+  return (length > D64FUSE_TRACE_MAX_PATH) ? D64FUSE_TRACE_MAX_PATH : length;
+}
+
+void d64fuse_trace_record_op (d64fuse_op op, const char *path, const char *name, off_t offset, size_t size, uint64_t start, uint64_t latency, int result)
+{
+  size_t path_length = trace_length (path);
+  size_t name_length = trace_length (name);
+
+  d64fuse_trace_record record = {.timestamp = htole64 (start - trace_start),
+                                 .offset = htole64 (offset),
+                                 .size = htole32 (size),
+                                 .latency = htole32 (latency > UINT32_MAX ? UINT32_MAX : latency),
+                                 .result = htole32 (result),
+                                 .op = op,
+                                 .path_length = path_length,
+                                 .name_length = name_length};
+
+  pthread_mutex_lock (&trace_lock);
+  if (is_not_null (trace_file))
+    {
+      fwrite (&record, sizeof (record), 1, trace_file);
+      if (path_length > 0)
+        fwrite (path, 1, path_length, trace_file);
+      if (name_length > 0)
+        fwrite (name, 1, name_length, trace_file);
+    }
+  pthread_mutex_unlock (&trace_lock);
+}
+
+void d64fuse_trace_close ()
+{
+  pthread_mutex_lock (&trace_lock);
+  d64fuse_trace_enabled = false;
+  if (is_not_null (trace_file))
+    {
+      if (fclose (trace_file) != 0)
+        d64fuse_log_error ("error closing the trace file: %s", strerror (errno));
+      trace_file = NULL;
+    }
+  pthread_mutex_unlock (&trace_lock);
+}
+
+/* reads the header and returns the malloc'ed image filename */
+int d64fuse_trace_read_header (FILE *file, char **image_filename)
+{
+  d64fuse_trace_header header;
+
+  if (fread (&header, sizeof (header), 1, file) != 1)
+    return -EIO;
+  if (memcmp (header.magic, D64FUSE_TRACE_MAGIC, sizeof (header.magic)) != 0
+      or le32toh (header.version) != D64FUSE_TRACE_VERSION)
+    return -EINVAL;
+
+  size_t length = le32toh (header.image_filename_length);
+  *image_filename = malloc (length + 1);
+  if (is_null (*image_filename))
+    return -ENOMEM;
+  if (fread (*image_filename, 1, length, file) != length)
+    {
+      free (*image_filename);
+      *image_filename = NULL;
+      return -EIO;
+    }
+  (*image_filename)[length] = '\0';
+
+  return 0;
+}
+
+/* path and name must hold D64FUSE_TRACE_MAX_PATH + 1 bytes each; returns 1 at
+   the end of the trace */
+int d64fuse_trace_read_record (FILE *file, d64fuse_trace_record *record, char *path, char *name)
+{
+  if (fread (record, sizeof (*record), 1, file) != 1)
+    return feof (file) ? 1 : -EIO;
+
+  record->timestamp = le64toh (record->timestamp);
+  record->offset = le64toh (record->offset);
+  record->size = le32toh (record->size);
+  record->latency = le32toh (record->latency);
+  record->result = le32toh (record->result);
+  if (record->op >= D64FUSE_OP_COUNT)
+    return -EINVAL;
+
+  if (fread (path, 1, record->path_length, file) != record->path_length)
+    return -EIO;
+  path[record->path_length] = '\0';
+
+  if (fread (name, 1, record->name_length, file) != record->name_length)
+    return -EIO;
+  name[record->name_length] = '\0';
+
+  return 0;
+}
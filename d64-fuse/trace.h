@@ -0,0 +1,49 @@
+#ifndef D64FUSE_TRACE
+#define D64FUSE_TRACE 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/* Trace files start with a header followed by one record per operation, each
+   record being directly followed by its path_length bytes of path and its
+   name_length bytes of attribute name (getxattr) or of new path (rename),
+   without terminators.
+   All the integers are stored little-endian. */
+
+#define D64FUSE_TRACE_MAGIC "D64TRACE"
+#define D64FUSE_TRACE_VERSION 1
+#define D64FUSE_TRACE_MAX_PATH 255
+
+typedef struct __attribute__ ((packed)) d64fuse_trace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t image_filename_length; /* followed by the image filename */
+} d64fuse_trace_header;
+
+typedef struct __attribute__ ((packed)) d64fuse_trace_record
+{
+  uint64_t timestamp;  /* ns since the start of the recording */
+  uint64_t offset;     /* new size for truncate */
+  uint32_t size;       /* perms for access, mode for create and mkdir, flags for rename, datasync for fsync */
+  uint32_t latency;    /* ns */
+  int32_t result;
+  uint8_t op;          /* d64fuse_op */
+  uint8_t path_length;
+  uint8_t name_length;
+} d64fuse_trace_record;
+
+extern bool d64fuse_trace_enabled;
+
+int d64fuse_trace_open (const char *, const char *);
+void d64fuse_trace_record_op (d64fuse_op, const char *, const char *, off_t, size_t, uint64_t, uint64_t, int);
+void d64fuse_trace_close ();
+
+int d64fuse_trace_read_header (FILE *, char **);
+int d64fuse_trace_read_record (FILE *, d64fuse_trace_record *, char *, char *);
+
+#endif /* D64FUSE_TRACE */
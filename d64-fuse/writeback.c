@@ -0,0 +1,103 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "diskimage.h"
+
+#include "d64fuse_context.h"
+#include "log.h"
+#include "utils.h"
+#include "writeback.h"
+
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static bool running;
+static pthread_t writeback_thread;
+
+/* to be called with the image write lock held */
+static int sync_image (d64fuse_context *context)
+{
+  if (is_null (context->disk_image) or !context->disk_image->modified)
+    return 0;
+
+  if (di_sync (context->disk_image) != 0)
+    {
+      d64fuse_log_error ("cannot write back the image %s", is_not_null (context->overlay_filename) ? context->overlay_filename : context->image_filename);
+      return -EIO;
+    }
+
+  return 0;
+}
+
+static void *writeback_loop (void *arg)
+{
+  d64fuse_context *context = arg;
+
+  pthread_mutex_lock (&writeback_lock);
+  while (running)
+    {
+      struct timespec deadline;
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += context->writeback_interval_ms / 1000;
+      deadline.tv_nsec += (context->writeback_interval_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+      pthread_cond_timedwait (&writeback_cond, &writeback_lock, &deadline);
+
+      pthread_mutex_unlock (&writeback_lock);
+      d64fuse_write_lock_image ();
+      sync_image (context);
+      d64fuse_unlock_image ();
+      pthread_mutex_lock (&writeback_lock);
+    }
+  pthread_mutex_unlock (&writeback_lock);
+
+  return NULL;
+}
+
+void d64fuse_writeback_start (d64fuse_context *context)
+{
+  if (context->writeback_interval_ms == 0)
+    return;
+
+  pthread_mutex_lock (&writeback_lock);
+  if (!running)
+    {
+      running = true;
+      if (pthread_create (&writeback_thread, NULL, writeback_loop, context) != 0)
+        {
+          running = false;
+          d64fuse_log_warning ("could not start the writeback thread, writing back synchronously");
+        }
+    }
+  pthread_mutex_unlock (&writeback_lock);
+}
+
+/* the last changes are written back by the thread before it exits */
+void d64fuse_writeback_stop ()
+{
+  pthread_mutex_lock (&writeback_lock);
+  bool was_running = running;
+  running = false;
+  pthread_cond_signal (&writeback_cond);
+  pthread_mutex_unlock (&writeback_lock);
+
+  if (was_running)
+    pthread_join (writeback_thread, NULL);
+}
+
+/* to be called with the image write lock held, after modifying the image */
+int d64fuse_writeback_request (d64fuse_context *context)
+{
+  context->generation++;
+
+  pthread_mutex_lock (&writeback_lock);
+  bool batched = running;
+  pthread_mutex_unlock (&writeback_lock);
+
+  return batched ? 0 : sync_image (context);
+}
@@ -0,0 +1,22 @@
+#ifndef D64FUSE_WRITEBACK
+#define D64FUSE_WRITEBACK 1
+
+#include "d64fuse_context.h"
+
+/* The changes made to the image are written back to the image file by the
+   writeback thread every writeback_interval_ms, as a few pwrites of the dirty
+   sectors, and at fsync. Without the thread (writeback_interval_ms of 0, or
+   outside of a FUSE session) they are written back at each request.
+
+   With a journal, each writeback first commits the dirty sectors to the
+   journal, so that all the requests since the previous one share its two
+   fdatasyncs; concurrent fsyncs wait on the image lock and find their
+   changes already committed by the first one. */
+
+#define D64FUSE_DEFAULT_WRITEBACK_INTERVAL_MS 1000
+
+void d64fuse_writeback_start (d64fuse_context *);
+void d64fuse_writeback_stop ();
+int d64fuse_writeback_request (d64fuse_context *);
+
+#endif /* D64FUSE_WRITEBACK */
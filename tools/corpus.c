@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diskimage.h"
+
+#include "corpus.h"
+#include "utils.h"
+
+typedef struct corpus_preset_entry
+{
+  const char *name;
+  corpus_spec spec;
+} corpus_preset_entry;
+
+static const corpus_preset_entry corpus_presets[] = {
+  {"empty", {.label = "EMPTY", .image_size = D64SIZE, .fill_ratio = 0.0, .streams = 1}},
+  {"full", {.label = "FULL", .image_size = D64SIZE, .fill_ratio = 1.0, .sizes = CORPUS_SIZES_UNIFORM, .min_size = 1, .max_size = 16384, .streams = 1}},
+  {"tiny", {.label = "TINY", .image_size = D64SIZE, .fill_ratio = 1.0, .sizes = CORPUS_SIZES_UNIFORM, .min_size = 1, .max_size = CORPUS_BLOCK_SIZE, .streams = 1}},
+  {"huge", {.label = "HUGE", .image_size = D64SIZE, .fill_ratio = 1.0, .max_files = 4, .sizes = CORPUS_SIZES_EVEN, .streams = 1}},
+  {"fragmented", {.label = "FRAGMENTED", .image_size = D64SIZE, .fill_ratio = 0.9, .sizes = CORPUS_SIZES_UNIFORM, .min_size = CORPUS_BLOCK_SIZE, .max_size = 8192, .streams = 8}},
+  {"cyclic", {.label = "CYCLIC", .image_size = D64SIZE, .fill_ratio = 0.5, .sizes = CORPUS_SIZES_UNIFORM, .min_size = CORPUS_BLOCK_SIZE, .max_size = 4096, .streams = 1, .corruption = CORPUS_CORRUPTION_CYCLIC, .nbr_corrupted = 4}},
+  {"dangling", {.label = "DANGLING", .image_size = D64SIZE, .fill_ratio = 0.5, .sizes = CORPUS_SIZES_UNIFORM, .min_size = CORPUS_BLOCK_SIZE, .max_size = 4096, .streams = 1, .corruption = CORPUS_CORRUPTION_DANGLING, .nbr_corrupted = 4}},
+  {"maxdir", {.label = "MAXDIR", .image_size = D64SIZE, .fill_ratio = 1.0, .sizes = CORPUS_SIZES_FIXED, .min_size = 0, .streams = 1}},
+};
+
+#define NBR_CORPUS_PRESETS (sizeof (corpus_presets) / sizeof (corpus_presets[0]))
+
+const char *corpus_preset_names[] = {"empty", "full", "tiny", "huge", "fragmented", "cyclic", "dangling", "maxdir", NULL};
+
+typedef struct corpus_stream
+{
+  ImageFile *image_file;
+  size_t size;
+  size_t written;
+  uint64_t contents_state;
+} corpus_stream;
+
+/* splitmix64 */
+static uint64_t next_random (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+
+  return z ^ (z >> 31);
+}
+
+static uint64_t contents_seed (uint64_t seed, size_t file_nbr)
+{
+  uint64_t state = seed ^ ((uint64_t) file_nbr * 0xd1b54a32d192ed03);
+
+  return next_random (&state);
+}
+
+static void fill_contents (unsigned char *buffer, size_t length, uint64_t *state)
+{
+  for (size_t i = 0; i < length; i++)
+    buffer[i] = next_random (state) >> 56;
+}
+
+/* the contents of file number file_nbr of an image generated with seed */
+void corpus_file_contents (unsigned char *buffer, size_t length, uint64_t seed, size_t file_nbr)
+{
+  uint64_t state = contents_seed (seed, file_nbr);
+
+  fill_contents (buffer, length, &state);
+}
+
+int corpus_preset (const char *name, corpus_spec *spec)
+{
+  for (size_t i = 0; i < NBR_CORPUS_PRESETS; i++)
+    if (strcmp (corpus_presets[i].name, name) == 0)
+      {
+        *spec = corpus_presets[i].spec;
+        return 0;
+      }
+
+  return -EINVAL;
+}
+
+static size_t draw_size (const corpus_spec *spec, uint64_t *state, size_t target_blocks)
+{
+  size_t range = (spec->max_size > spec->min_size) ? spec->max_size - spec->min_size : 0;
+
+  switch (spec->sizes)
+    {
+    case CORPUS_SIZES_UNIFORM:
+      return spec->min_size + next_random (state) % (range + 1);
+    case CORPUS_SIZES_EXPONENTIAL:
+      {
+        /* the tail mean is a quarter of the range */
+        double u = (next_random (state) >> 11) * 0x1.0p-53;
+        double tail = -log1p (-u) * range / 4;
+        return spec->min_size + ((tail < range) ? (size_t) tail : range);
+      }
+    case CORPUS_SIZES_EVEN:
+      return target_blocks / spec->max_files * CORPUS_BLOCK_SIZE;
+    case CORPUS_SIZES_FIXED:
+    default:
+      return spec->min_size;
+    }
+}
+
+static ImageFile *create_file (DiskImage *disk_image, size_t file_nbr)
+{
+  unsigned char rawname[16];
+  char name[32];
+
+  snprintf (name, sizeof (name), CORPUS_FILE_NAME, file_nbr);
+  di_rawname_from_name (rawname, name);
+
+  return di_open (disk_image, rawname, T_PRG, "wb");
+}
+
+static void corrupt_file (DiskImage *disk_image, const corpus_spec *spec, size_t file_nbr)
+{
+  unsigned char rawname[16];
+  char name[32];
+
+  snprintf (name, sizeof (name), CORPUS_FILE_NAME, file_nbr);
+  di_rawname_from_name (rawname, name);
+
+  RawDirEntry *entry = find_file_entry (disk_image, rawname, T_PRG);
+  if (is_null (entry) or entry->startts.track == 0)
+    return;
+
+  TrackSector last = entry->startts;
+  for (TrackSector ts = last; ts.track != 0; ts = next_ts_in_chain (disk_image, ts))
+    last = ts;
+
+  unsigned char *block = di_get_ts_addr (disk_image, last);
+  di_mark_dirty (disk_image, last);
+  if (spec->corruption == CORPUS_CORRUPTION_CYCLIC)
+    {
+      block[0] = entry->startts.track;
+      block[1] = entry->startts.sector;
+    }
+  else
+    {
+      block[0] = di_tracks (disk_image->type) + 1;
+      block[1] = 0;
+    }
+}
+
+/* writes one block of the stream; returns 1 once the file is complete or the
+   disk full */
+static int write_stream_block (corpus_stream *stream, bool *disk_full)
+{
+  unsigned char block[CORPUS_BLOCK_SIZE];
+  size_t length = stream->size - stream->written;
+
+  if (length > CORPUS_BLOCK_SIZE)
+    length = CORPUS_BLOCK_SIZE;
+  fill_contents (block, length, &stream->contents_state);
+
+  if (di_write (stream->image_file, block, length) != (int) length)
+    *disk_full = true;
+  stream->written += length;
+
+  if (stream->written < stream->size and !*disk_full)
+    return 0;
+
+  di_close (stream->image_file);
+  stream->image_file = NULL;
+
+  return 1;
+}
+
+/* returns the number of files written, or a negative errno */
+int corpus_create_image (const char *filename, const corpus_spec *spec)
+{
+  unsigned char rawname[16];
+  unsigned char rawid[2] = {'A' + spec->seed % 26, 'A' + spec->seed / 26 % 26};
+  size_t nbr_streams = (spec->streams > 0) ? spec->streams : 1;
+
+  if (spec->sizes == CORPUS_SIZES_EVEN and spec->max_files == 0)
+    return -EINVAL;
+
+  corpus_stream *streams = calloc (nbr_streams, sizeof (corpus_stream));
+  if (is_null (streams))
+    return -ENOMEM;
+
+  DiskImage *disk_image = di_create_image ((char *) filename, spec->image_size);
+  if (is_null (disk_image))
+    {
+      free (streams);
+      return -EIO;
+    }
+
+  di_rawname_from_name (rawname, (char *) spec->label);
+  di_format (disk_image, rawname, rawid);
+  if (spec->interleave > 0)
+    disk_image->interleave = spec->interleave;
+
+  uint64_t state = spec->seed;
+  size_t target_blocks = spec->fill_ratio * disk_image->blocksfree;
+  size_t planned_blocks = 0;
+  size_t nbr_files = 0;
+  size_t nbr_active = 0;
+  bool disk_full = false;
+  int result = 0;
+
+  for (;;)
+    {
+      for (size_t i = 0; i < nbr_streams and result == 0; i++)
+        {
+          corpus_stream *stream = streams + i;
+          if (is_not_null (stream->image_file)
+              or disk_full
+              or planned_blocks >= target_blocks
+              or (spec->max_files != 0 and nbr_files >= spec->max_files))
+            continue;
+
+          size_t size = draw_size (spec, &state, target_blocks);
+          size_t remaining = (target_blocks - planned_blocks) * CORPUS_BLOCK_SIZE;
+          if (size > remaining)
+            size = remaining;
+
+          stream->image_file = create_file (disk_image, nbr_files);
+          if (is_null (stream->image_file))
+            {
+              /* 72 is "disk full", here a full directory */
+              if (disk_image->status == 72)
+                disk_full = true;
+              else
+                result = -EIO;
+              continue;
+            }
+          stream->size = size;
+          stream->written = 0;
+          stream->contents_state = contents_seed (spec->seed, nbr_files);
+          planned_blocks += (size + CORPUS_BLOCK_SIZE - 1) / CORPUS_BLOCK_SIZE;
+          nbr_files++;
+          nbr_active++;
+        }
+
+      if (nbr_active == 0)
+        break;
+
+      for (size_t i = 0; i < nbr_streams; i++)
+        if (is_not_null (streams[i].image_file))
+          nbr_active -= write_stream_block (streams + i, &disk_full);
+    }
+
+  /* spread over distinct files, since walking an already cyclic chain would
+     never end */
+  size_t nbr_corrupted = (spec->nbr_corrupted < nbr_files) ? spec->nbr_corrupted : nbr_files;
+  if (result == 0 and spec->corruption != CORPUS_CORRUPTION_NONE)
+    for (size_t i = 0; i < nbr_corrupted; i++)
+      corrupt_file (disk_image, spec, i * nbr_files / nbr_corrupted);
+
+  free (streams);
+  di_free_image (disk_image);
+
+  return (result == 0) ? (int) nbr_files : result;
+}
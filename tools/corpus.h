@@ -0,0 +1,51 @@
+#ifndef D64_CORPUS
+#define D64_CORPUS 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Deterministic image generator: the same spec, seed included, always produces
+   the same image, byte for byte. */
+
+#define CORPUS_BLOCK_SIZE 254
+#define CORPUS_FILE_NAME "FILE%04zu"
+
+typedef enum corpus_sizes
+{
+  CORPUS_SIZES_FIXED = 0,    /* min_size bytes */
+  CORPUS_SIZES_UNIFORM,      /* between min_size and max_size */
+  CORPUS_SIZES_EXPONENTIAL,  /* min_size plus an exponential tail of mean max_size - min_size, capped at max_size */
+  CORPUS_SIZES_EVEN          /* the fill target split evenly across max_files */
+} corpus_sizes;
+
+typedef enum corpus_corruption
+{
+  CORPUS_CORRUPTION_NONE = 0,
+  CORPUS_CORRUPTION_CYCLIC,   /* the last block links back to the first one */
+  CORPUS_CORRUPTION_DANGLING  /* the last block links past the last track */
+} corpus_corruption;
+
+typedef struct corpus_spec
+{
+  const char *label;     /* disk name */
+  int image_size;        /* D64SIZE, D71SIZE or D81SIZE */
+  uint64_t seed;
+  int interleave;        /* 0 keeps the default of the image type */
+  double fill_ratio;     /* fraction of the free blocks to fill */
+  size_t max_files;      /* 0 for as many as the directory holds */
+  corpus_sizes sizes;
+  size_t min_size;
+  size_t max_size;
+  size_t streams;        /* files written at the same time, one block each in
+                            turn; more streams means more fragmented chains */
+  corpus_corruption corruption;
+  size_t nbr_corrupted;
+} corpus_spec;
+
+extern const char *corpus_preset_names[];
+
+int corpus_preset (const char *, corpus_spec *);
+int corpus_create_image (const char *, const corpus_spec *);
+void corpus_file_contents (unsigned char *, size_t, uint64_t, size_t);
+
+#endif /* D64_CORPUS */
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "diskimage.h"
+
+#include "corpus.h"
+#include "utils.h"
+
+/* Generates a disk image from a preset and/or explicit layout parameters. The
+   image only depends on the parameters, so that benchmarks and stress tests
+   can be run against the same corpus on every machine. */
+
+static const struct option long_options[] = {
+  {"preset", required_argument, NULL, 'p'},
+  {"type", required_argument, NULL, 't'},
+  {"seed", required_argument, NULL, 's'},
+  {"interleave", required_argument, NULL, 'i'},
+  {"fill", required_argument, NULL, 'f'},
+  {"files", required_argument, NULL, 'n'},
+  {"sizes", required_argument, NULL, 'z'},
+  {"streams", required_argument, NULL, 'S'},
+  {"corrupt", required_argument, NULL, 'c'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s [--preset=<preset>] [--type=d64|d71|d81] [--seed=N] [--interleave=N]\n"
+           "       [--fill=<ratio>] [--files=N] [--sizes=fixed:N|uniform:MIN-MAX|exponential:MIN-MAX|even]\n"
+           "       [--streams=N] [--corrupt=cyclic:N|dangling:N] <image>\n", progname);
+  fprintf (stderr, "presets:");
+  for (const char **name = corpus_preset_names; is_not_null (*name); name++)
+    fprintf (stderr, " %s", *name);
+  fprintf (stderr, " (default: full)\n");
+}
+
+static int parse_type (const char *type, corpus_spec *spec)
+{
+  if (strcasecmp (type, "d64") == 0)
+    spec->image_size = D64SIZE;
+  else if (strcasecmp (type, "d71") == 0)
+    spec->image_size = D71SIZE;
+  else if (strcasecmp (type, "d81") == 0)
+    spec->image_size = D81SIZE;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
+static int parse_sizes (const char *sizes, corpus_spec *spec)
+{
+  if (strcmp (sizes, "even") == 0)
+    {
+      spec->sizes = CORPUS_SIZES_EVEN;
+      return 0;
+    }
+  if (sscanf (sizes, "fixed:%zu", &spec->min_size) == 1)
+    {
+      spec->sizes = CORPUS_SIZES_FIXED;
+      spec->max_size = spec->min_size;
+      return 0;
+    }
+  if (sscanf (sizes, "uniform:%zu-%zu", &spec->min_size, &spec->max_size) == 2)
+    spec->sizes = CORPUS_SIZES_UNIFORM;
+  else if (sscanf (sizes, "exponential:%zu-%zu", &spec->min_size, &spec->max_size) == 2)
+    spec->sizes = CORPUS_SIZES_EXPONENTIAL;
+  else
+    return -EINVAL;
+
+  return (spec->min_size <= spec->max_size) ? 0 : -EINVAL;
+}
+
+static int parse_corruption (const char *corruption, corpus_spec *spec)
+{
+  if (sscanf (corruption, "cyclic:%zu", &spec->nbr_corrupted) == 1)
+    spec->corruption = CORPUS_CORRUPTION_CYCLIC;
+  else if (sscanf (corruption, "dangling:%zu", &spec->nbr_corrupted) == 1)
+    spec->corruption = CORPUS_CORRUPTION_DANGLING;
+  else if (strcmp (corruption, "none") == 0)
+    spec->corruption = CORPUS_CORRUPTION_NONE;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
+/* the preset is applied first, whatever its position, and the other options
+   override its values */
+static int parse_args (int argc, char *argv[], corpus_spec *spec, const char **image_filename)
+{
+  const char *preset = "full";
+  int option;
+
+  while ((option = getopt_long (argc, argv, "p:t:s:i:f:n:z:S:c:h", long_options, NULL)) != -1)
+    if (option == 'p')
+      preset = optarg;
+    else if (option == 'h' or option == '?')
+      return -1;
+  if (corpus_preset (preset, spec) != 0)
+    {
+      fprintf (stderr, "Unknown preset '%s'\n", preset);
+      return -1;
+    }
+
+  int result = 0;
+  optind = 0; /* reinitializes getopt after the first pass */
+  while ((option = getopt_long (argc, argv, "p:t:s:i:f:n:z:S:c:h", long_options, NULL)) != -1 and result == 0)
+    switch (option)
+      {
+      case 't':
+        result = parse_type (optarg, spec);
+        break;
+      case 's':
+        spec->seed = strtoull (optarg, NULL, 0);
+        break;
+      case 'i':
+        spec->interleave = strtol (optarg, NULL, 10);
+        break;
+      case 'f':
+        spec->fill_ratio = strtod (optarg, NULL);
+        if (spec->fill_ratio < 0 or spec->fill_ratio > 1)
+          result = -EINVAL;
+        break;
+      case 'n':
+        spec->max_files = strtoul (optarg, NULL, 10);
+        break;
+      case 'z':
+        result = parse_sizes (optarg, spec);
+        break;
+      case 'S':
+        spec->streams = strtoul (optarg, NULL, 10);
+        break;
+      case 'c':
+        result = parse_corruption (optarg, spec);
+        break;
+      default:
+        break;
+      }
+
+  if (result != 0 or optind != argc - 1)
+    return -1;
+  *image_filename = argv[optind];
+
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  corpus_spec spec;
+  const char *image_filename;
+
+  if (parse_args (argc, argv, &spec, &image_filename) != 0)
+    {
+      show_help (argv[0]);
+      return -1;
+    }
+
+  int result = corpus_create_image (image_filename, &spec);
+  if (result < 0)
+    {
+      fprintf (stderr, "Cannot create '%s': %s\n", image_filename, strerror (-result));
+      return -1;
+    }
+  printf ("%s: %d files\n", image_filename, result);
+
+  return 0;
+}
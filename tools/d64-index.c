@@ -0,0 +1,523 @@
+#include <endian.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#include "index.h"
+#include "loader.h"
+#include "utils.h"
+
+/* Indexes a library of images on a thread pool into the index read by
+   d64-fuse --index. The main thread loads the images, many at once, and
+   queues them for the scanning threads. With --update, the images which have
+   not changed since the previous index are copied from it instead of being
+   loaded again. With --dupes, lists the images and the files of an index which
+   have the same contents. */
+
+#define NFTW_MAX_FDS 16
+#define LOADED_QUEUE_SIZE 64
+
+typedef struct index_options
+{
+  const char *output_filename;
+  const char *list_filename;
+  const char *dupes_filename;
+  size_t nbr_threads;
+  bool update;
+} index_options;
+
+/* an image loaded and not scanned yet */
+typedef struct loaded_image
+{
+  size_t entry_nbr;
+  DiskImage *disk_image;
+} loaded_image;
+
+typedef struct index_job
+{
+  d64fuse_index_entry *entries;
+  int *results;
+  size_t nbr_entries;
+  const d64fuse_index *previous; /* NULL without --update */
+  size_t nbr_unchanged;
+  size_t *loaded_entries; /* the entry numbers of the images to load */
+  const char **loaded_paths;
+  size_t nbr_loaded;
+  size_t nbr_threads; /* 0 scans on the loading thread */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  loaded_image queue[LOADED_QUEUE_SIZE];
+  size_t queue_head;
+  size_t queue_length;
+  bool loading_done;
+} index_job;
+
+/* the images found so far, nftw taking no user data */
+static char **image_paths;
+static size_t nbr_image_paths;
+static size_t image_paths_capacity;
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s --output=<index> [--threads=N] [--update] <image|directory>...\n"
+           "       %s --list=<index>\n"
+           "       %s --dupes=<index>\n", progname, progname, progname);
+}
+
+static int parse_args (int argc, char *argv[], index_options *options)
+{
+  static const struct option long_options[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"list", required_argument, NULL, 'l'},
+    {"dupes", required_argument, NULL, 'd'},
+    {"threads", required_argument, NULL, 't'},
+    {"update", no_argument, NULL, 'u'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  long nbr_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  *options = (index_options) {.nbr_threads = (nbr_cpus > 0) ? nbr_cpus : 1};
+
+  int option;
+  while ((option = getopt_long (argc, argv, "o:l:d:t:uh", long_options, NULL)) != -1)
+    switch (option)
+      {
+      case 'o':
+        options->output_filename = optarg;
+        break;
+      case 'l':
+        options->list_filename = optarg;
+        break;
+      case 'd':
+        options->dupes_filename = optarg;
+        break;
+      case 't':
+        options->nbr_threads = strtoul (optarg, NULL, 10);
+        break;
+      case 'u':
+        options->update = true;
+        break;
+      default:
+        return -1;
+      }
+
+  if (is_not_null (options->list_filename) or is_not_null (options->dupes_filename))
+    return (optind == argc and is_null (options->output_filename)
+            and (is_null (options->list_filename) or is_null (options->dupes_filename))) ? 0 : -1;
+  if (is_null (options->output_filename) or optind == argc or options->nbr_threads == 0)
+    return -1;
+
+  return 0;
+}
+
+static bool is_image_filename (const char *filename)
+{
+  const char *extension = strrchr (filename, '.');
+
+  return is_not_null (extension)
+    and (strcasecmp (extension, ".d64") == 0 or strcasecmp (extension, ".d71") == 0 or strcasecmp (extension, ".d81") == 0);
+}
+
+static int add_image_path (const char *path)
+{
+  if (nbr_image_paths == image_paths_capacity)
+    {
+      size_t capacity = (image_paths_capacity > 0) ? image_paths_capacity * 2 : 1024;
+      char **paths = realloc (image_paths, capacity * sizeof (char *));
+      if (is_null (paths))
+        return -1;
+      image_paths = paths;
+      image_paths_capacity = capacity;
+    }
+
+  /* the same path as d64-fuse looks up */
+  char *canonical_path = canonicalize_file_name (path);
+  if (is_null (canonical_path))
+    return -1;
+  image_paths[nbr_image_paths++] = canonical_path;
+
+  return 0;
+}
+
+static int add_found_image (const char *path, const struct stat *path_stat, int type, struct FTW *ftw)
+{
+  unused_arg (path_stat);
+  unused_arg (ftw);
+
+  if (type == FTW_F and is_image_filename (path))
+    return add_image_path (path);
+
+  return 0;
+}
+
+/* images named explicitly are indexed whatever their extension */
+static int find_images (int nbr_args, char *args[])
+{
+  for (int i = 0; i < nbr_args; i++)
+    {
+      struct stat arg_stat;
+      int result;
+      if (stat (args[i], &arg_stat) == -1)
+        result = -1;
+      else if (S_ISDIR (arg_stat.st_mode))
+        result = nftw (args[i], add_found_image, NFTW_MAX_FDS, FTW_PHYS);
+      else
+        result = add_image_path (args[i]);
+      if (result != 0)
+        {
+          fprintf (stderr, "Cannot index '%s': %s\n", args[i], strerror (errno));
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/* copies the images which have not changed from the previous index, and
+   lists the others to be loaded */
+static int check_images (index_job *job)
+{
+  job->loaded_entries = calloc (job->nbr_entries, sizeof (size_t));
+  job->loaded_paths = calloc (job->nbr_entries, sizeof (char *));
+  if ((is_null (job->loaded_entries) or is_null (job->loaded_paths)) and job->nbr_entries > 0)
+    return -1;
+
+  for (size_t i = 0; i < job->nbr_entries; i++)
+    {
+      d64fuse_index_entry *entry = job->entries + i;
+      if (stat (entry->path, &entry->image_stat) == -1)
+        {
+          job->results[i] = -errno;
+          continue;
+        }
+
+      const d64fuse_index_image *image = is_not_null (job->previous) ? d64fuse_index_find (job->previous, entry->path, &entry->image_stat) : NULL;
+      if (is_not_null (image))
+        {
+          job->results[i] = d64fuse_index_copy (job->previous, image, entry);
+          if (job->results[i] == 0)
+            job->nbr_unchanged++;
+        }
+      else
+        {
+          job->loaded_entries[job->nbr_loaded] = i;
+          job->loaded_paths[job->nbr_loaded++] = entry->path;
+        }
+    }
+
+  return 0;
+}
+
+static void scan_image (index_job *job, size_t entry_nbr, DiskImage *disk_image)
+{
+  job->results[entry_nbr] = d64fuse_index_scan_image (job->entries + entry_nbr, disk_image);
+  di_free_image (disk_image);
+}
+
+/* waits for a free place in the queue, so that the loading never runs too far
+   ahead of the scanning */
+static void queue_loaded_image (size_t image_nbr, DiskImage *disk_image, void *data)
+{
+  index_job *job = data;
+  size_t entry_nbr = job->loaded_entries[image_nbr];
+
+  if (is_null (disk_image))
+    {
+      job->results[entry_nbr] = -EIO;
+      return;
+    }
+  if (job->nbr_threads == 0)
+    {
+      scan_image (job, entry_nbr, disk_image);
+      return;
+    }
+
+  pthread_mutex_lock (&job->lock);
+  while (job->queue_length == LOADED_QUEUE_SIZE)
+    pthread_cond_wait (&job->not_full, &job->lock);
+  job->queue[(job->queue_head + job->queue_length++) % LOADED_QUEUE_SIZE] = (loaded_image) {entry_nbr, disk_image};
+  pthread_cond_signal (&job->not_empty);
+  pthread_mutex_unlock (&job->lock);
+}
+
+static void *scan_loop (void *arg)
+{
+  index_job *job = arg;
+
+  while (true)
+    {
+      pthread_mutex_lock (&job->lock);
+      while (job->queue_length == 0 and !job->loading_done)
+        pthread_cond_wait (&job->not_empty, &job->lock);
+      if (job->queue_length == 0)
+        {
+          pthread_mutex_unlock (&job->lock);
+          break;
+        }
+      loaded_image image = job->queue[job->queue_head];
+      job->queue_head = (job->queue_head + 1) % LOADED_QUEUE_SIZE;
+      job->queue_length--;
+      pthread_cond_signal (&job->not_full);
+      pthread_mutex_unlock (&job->lock);
+
+      scan_image (job, image.entry_nbr, image.disk_image);
+    }
+
+  return NULL;
+}
+
+/* returns whether the images were loaded with io_uring */
+static bool run_job (index_job *job, size_t nbr_threads)
+{
+  pthread_t *threads = calloc (nbr_threads, sizeof (pthread_t));
+
+  pthread_mutex_init (&job->lock, NULL);
+  pthread_cond_init (&job->not_empty, NULL);
+  pthread_cond_init (&job->not_full, NULL);
+  /* without any scanning thread, the loading thread scans the images itself */
+  job->nbr_threads = 0;
+  while (is_not_null (threads) and job->nbr_threads < nbr_threads
+         and pthread_create (threads + job->nbr_threads, NULL, scan_loop, job) == 0)
+    job->nbr_threads++;
+
+  bool batched = d64fuse_load_images (job->loaded_paths, job->nbr_loaded, queue_loaded_image, job);
+
+  pthread_mutex_lock (&job->lock);
+  job->loading_done = true;
+  pthread_cond_broadcast (&job->not_empty);
+  pthread_mutex_unlock (&job->lock);
+  for (size_t i = 0; i < job->nbr_threads; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+
+  return batched;
+}
+
+static int list_index (const char *filename)
+{
+  d64fuse_index index;
+  int error = d64fuse_index_open (filename, &index);
+  if (error != 0)
+    {
+      fprintf (stderr, "Cannot open the index '%s': %s\n", filename, strerror (-error));
+      return -1;
+    }
+
+  char name[17];
+  for (uint32_t i = 0; i < le32toh (index.header->nbr_images); i++)
+    {
+      const d64fuse_index_image *image = index.images + i;
+      const d64fuse_index_file *files = d64fuse_index_image_files (&index, image);
+      di_name_from_rawname (name, (unsigned char *) image->label);
+      printf ("%s: \"%s\", %" PRIu32 " files\n", d64fuse_index_image_path (&index, image), name, le32toh (image->nbr_files));
+      for (uint32_t j = 0; j < le32toh (image->nbr_files); j++)
+        {
+          di_name_from_rawname (name, (unsigned char *) files[j].rawname);
+          printf ("  %-16s %02x %5" PRIu16 " %7" PRIu32 " %016" PRIx64 "\n", name, files[j].type,
+                  le16toh (files[j].blocks), le32toh (files[j].size), le64toh (files[j].hash));
+        }
+    }
+  d64fuse_index_close (&index);
+
+  return 0;
+}
+
+/* an image, or a file of an image, with its contents hash */
+typedef struct indexed_copy
+{
+  uint64_t hash;
+  uint64_t size;
+  uint32_t image_nbr;
+  uint32_t file_nbr;
+} indexed_copy;
+
+static int compare_copies (const void *left, const void *right)
+{
+  const indexed_copy *left_copy = left;
+  const indexed_copy *right_copy = right;
+
+  if (left_copy->hash != right_copy->hash)
+    return (left_copy->hash < right_copy->hash) ? -1 : 1;
+  if (left_copy->size != right_copy->size)
+    return (left_copy->size < right_copy->size) ? -1 : 1;
+  if (left_copy->image_nbr != right_copy->image_nbr)
+    return (left_copy->image_nbr < right_copy->image_nbr) ? -1 : 1;
+  if (left_copy->file_nbr != right_copy->file_nbr)
+    return (left_copy->file_nbr < right_copy->file_nbr) ? -1 : 1;
+
+  return 0;
+}
+
+/* returns the end of the group of copies with the same contents starting at
+   first */
+static size_t group_end (const indexed_copy *copies, size_t nbr_copies, size_t first)
+{
+  size_t end = first + 1;
+  while (end < nbr_copies and copies[end].hash == copies[first].hash and copies[end].size == copies[first].size)
+    end++;
+
+  return end;
+}
+
+/* the files of the second and next copies of an image are not listed again,
+   nor the empty files */
+static int list_dupes (const char *filename)
+{
+  d64fuse_index index;
+  int error = d64fuse_index_open (filename, &index);
+  if (error != 0)
+    {
+      fprintf (stderr, "Cannot open the index '%s': %s\n", filename, strerror (-error));
+      return -1;
+    }
+
+  uint32_t nbr_images = le32toh (index.header->nbr_images);
+  uint32_t nbr_files = le32toh (index.header->nbr_files);
+  indexed_copy *copies = calloc ((nbr_images > nbr_files ? nbr_images : nbr_files) + 1, sizeof (indexed_copy));
+  bool *is_duplicate_image = calloc (nbr_images + 1, sizeof (bool));
+  if (is_null (copies) or is_null (is_duplicate_image))
+    {
+      free (copies);
+      free (is_duplicate_image);
+      d64fuse_index_close (&index);
+      return -1;
+    }
+
+  for (uint32_t i = 0; i < nbr_images; i++)
+    copies[i] = (indexed_copy) {.hash = le64toh (index.images[i].hash), .size = le64toh (index.images[i].size), .image_nbr = i};
+  qsort (copies, nbr_images, sizeof (indexed_copy), compare_copies);
+  size_t nbr_duplicate_images = 0;
+  for (size_t first = 0, end; first < nbr_images; first = end)
+    {
+      end = group_end (copies, nbr_images, first);
+      if (end - first < 2)
+        continue;
+      printf ("image %016" PRIx64 ", %" PRIu64 " bytes, %zu copies\n", copies[first].hash, copies[first].size, end - first);
+      for (size_t i = first; i < end; i++)
+        {
+          printf ("  %s\n", d64fuse_index_image_path (&index, index.images + copies[i].image_nbr));
+          is_duplicate_image[copies[i].image_nbr] = (i > first);
+        }
+      nbr_duplicate_images += end - first - 1;
+    }
+
+  size_t nbr_copies = 0;
+  for (uint32_t i = 0; i < nbr_images; i++)
+    {
+      const d64fuse_index_file *files = d64fuse_index_image_files (&index, index.images + i);
+      for (uint32_t j = 0; j < le32toh (index.images[i].nbr_files) and !is_duplicate_image[i]; j++)
+        if (files[j].size != 0)
+          copies[nbr_copies++] = (indexed_copy) {.hash = le64toh (files[j].hash), .size = le32toh (files[j].size),
+                                                 .image_nbr = i, .file_nbr = j};
+    }
+  qsort (copies, nbr_copies, sizeof (indexed_copy), compare_copies);
+  size_t nbr_duplicate_files = 0;
+  uint64_t duplicate_size = 0;
+  char name[17];
+  for (size_t first = 0, end; first < nbr_copies; first = end)
+    {
+      end = group_end (copies, nbr_copies, first);
+      if (end - first < 2)
+        continue;
+      printf ("file %016" PRIx64 ", %" PRIu64 " bytes, %zu copies\n", copies[first].hash, copies[first].size, end - first);
+      for (size_t i = first; i < end; i++)
+        {
+          const d64fuse_index_image *image = index.images + copies[i].image_nbr;
+          di_name_from_rawname (name, (unsigned char *) d64fuse_index_image_files (&index, image)[copies[i].file_nbr].rawname);
+          printf ("  %s:%s\n", d64fuse_index_image_path (&index, image), name);
+        }
+      nbr_duplicate_files += end - first - 1;
+      duplicate_size += (end - first - 1) * copies[first].size;
+    }
+  printf ("%zu duplicate images, %zu duplicate files (%" PRIu64 " bytes)\n", nbr_duplicate_images, nbr_duplicate_files, duplicate_size);
+
+  free (copies);
+  free (is_duplicate_image);
+  d64fuse_index_close (&index);
+
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  index_options options;
+
+  if (parse_args (argc, argv, &options) != 0)
+    {
+      show_help (argv[0]);
+      return -1;
+    }
+
+  if (is_not_null (options.list_filename))
+    return list_index (options.list_filename);
+  if (is_not_null (options.dupes_filename))
+    return list_dupes (options.dupes_filename);
+
+  if (find_images (argc - optind, argv + optind) != 0)
+    return -1;
+
+  index_job job = {.entries = calloc (nbr_image_paths, sizeof (d64fuse_index_entry)),
+                   .results = calloc (nbr_image_paths, sizeof (int)),
+                   .nbr_entries = nbr_image_paths};
+  if ((is_null (job.entries) or is_null (job.results)) and nbr_image_paths > 0)
+    return -1;
+  for (size_t i = 0; i < nbr_image_paths; i++)
+    job.entries[i].path = image_paths[i];
+
+  d64fuse_index previous = {.data = NULL};
+  if (options.update)
+    {
+      int error = d64fuse_index_open (options.output_filename, &previous);
+      if (error == 0)
+        job.previous = &previous;
+      else if (error != -ENOENT)
+        fprintf (stderr, "Ignoring the index '%s': %s\n", options.output_filename, strerror (-error));
+    }
+
+  if (check_images (&job) != 0)
+    return -1;
+  bool batched = run_job (&job, options.nbr_threads);
+  d64fuse_index_close (&previous);
+
+  /* the images which could not be read are left out of the index */
+  size_t nbr_indexed = 0;
+  for (size_t i = 0; i < job.nbr_entries; i++)
+    if (job.results[i] == 0)
+      {
+        d64fuse_index_entry entry = job.entries[nbr_indexed];
+        job.entries[nbr_indexed++] = job.entries[i];
+        job.entries[i] = entry;
+      }
+    else
+      fprintf (stderr, "Cannot index '%s': %s\n", job.entries[i].path, strerror (-job.results[i]));
+
+  int error = d64fuse_index_write (options.output_filename, job.entries, nbr_indexed);
+  if (error != 0)
+    fprintf (stderr, "Cannot write the index '%s': %s\n", options.output_filename, strerror (-error));
+  else
+    printf ("%s: %zu images, %zu scanned, %zu unchanged, %zu failed (%s)\n", options.output_filename, nbr_indexed,
+            nbr_indexed - job.nbr_unchanged, job.nbr_unchanged, job.nbr_entries - nbr_indexed,
+            batched ? "loaded with io_uring" : "loaded one by one");
+
+  for (size_t i = 0; i < job.nbr_entries; i++)
+    d64fuse_index_free_entry (job.entries + i);
+  free (job.entries);
+  free (job.results);
+  free (job.loaded_entries);
+  free (job.loaded_paths);
+  free (image_paths);
+
+  return (error == 0) ? 0 : -1;
+}
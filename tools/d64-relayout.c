@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diskimage.h"
+
+#include "utils.h"
+
+/* Rewrites the chains of the files of an image with a chosen interleave and
+   track order, so that they load faster, and reports the load time of every
+   file before and after, estimated with a simple rotational model of the
+   drive. The blocks are allocated by di_alloc_next_ts_on_track, which keeps
+   the BAM up to date, and the directory entries get the new start and block
+   count.
+   Only the closed SEQ, PRG and USR files with a sound chain are moved; the
+   REL files, the partitions and the files with a broken or cyclic chain are
+   left where they are. */
+
+#define BLOCK_DATA_SIZE 254
+
+/* the model: a revolution takes 200 ms at 300 rpm, the head needs a step time
+   per track and a settle time at the end of a move. The block time is the
+   time between the end of the read of a block and the moment the drive is
+   ready to read the next one, which the loader sets. */
+#define REVOLUTION_TIME_MS 200.0
+#define STEP_TIME_MS 6.0
+#define SETTLE_TIME_MS 15.0
+#define DEFAULT_BLOCK_TIME_MS 20.0
+
+typedef enum track_order
+{
+  TRACKS_ASCENDING,
+  TRACKS_OUTWARD    /* from the directory track outward, as the DOS does */
+} track_order;
+
+typedef struct relayout_options
+{
+  const char *output_filename;
+  int interleave;   /* 0 for the one fitting the block time */
+  track_order tracks;
+  double block_time_ms;
+  bool dry_run;
+} relayout_options;
+
+/* a file moved, with its contents and its blocks before and after */
+typedef struct moved_file
+{
+  RawDirEntry *dir_entry;
+  TrackSector dir_ts;   /* the directory sector holding the entry */
+  unsigned char *contents;
+  size_t size;
+  TrackSector *old_blocks;
+  size_t nbr_old_blocks;
+  TrackSector *new_blocks;
+  size_t nbr_new_blocks;
+} moved_file;
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s [--interleave=N] [--tracks=ascending|outward] [--block-time=MS] [--dry-run] [--output=<image>] <image>\n",
+           progname);
+}
+
+static int parse_args (int argc, char *argv[], relayout_options *options)
+{
+  static const struct option long_options[] = {
+    {"interleave", required_argument, NULL, 'i'},
+    {"tracks", required_argument, NULL, 't'},
+    {"block-time", required_argument, NULL, 'b'},
+    {"dry-run", no_argument, NULL, 'n'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  *options = (relayout_options) {.tracks = TRACKS_OUTWARD, .block_time_ms = DEFAULT_BLOCK_TIME_MS};
+
+  int option;
+  while ((option = getopt_long (argc, argv, "i:t:b:no:h", long_options, NULL)) != -1)
+    switch (option)
+      {
+      case 'i':
+        options->interleave = atoi (optarg);
+        if (options->interleave <= 0)
+          return -1;
+        break;
+      case 't':
+        if (strcmp (optarg, "ascending") == 0)
+          options->tracks = TRACKS_ASCENDING;
+        else if (strcmp (optarg, "outward") == 0)
+          options->tracks = TRACKS_OUTWARD;
+        else
+          return -1;
+        break;
+      case 'b':
+        options->block_time_ms = atof (optarg);
+        if (options->block_time_ms < 0)
+          return -1;
+        break;
+      case 'n':
+        options->dry_run = true;
+        break;
+      case 'o':
+        options->output_filename = optarg;
+        break;
+      default:
+        return -1;
+      }
+
+  return (optind == argc - 1) ? 0 : -1;
+}
+
+/* the cylinder under the head for a track: the second side of a D71 repeats
+   the tracks of the first one, a D81 track spans both sides */
+static int track_cylinder (ImageType type, int track)
+{
+  return (type == D71 and track > 35) ? track - 35 : track;
+}
+
+/* estimates the time to load the blocks, from the directory track with the
+   disk at sector 0: for every block, the head moves to its track, waits for
+   the sector to come under it and reads it, then the drive spends the block
+   time */
+static double estimate_load_time (DiskImage *disk_image, const TrackSector *blocks, size_t nbr_blocks, double block_time_ms)
+{
+  double time = 0.0;
+  int cylinder = track_cylinder (disk_image->type, disk_image->dir.track);
+
+  for (size_t i = 0; i < nbr_blocks; i++)
+    {
+      int block_cylinder = track_cylinder (disk_image->type, blocks[i].track);
+      if (block_cylinder != cylinder)
+        {
+          time += abs (block_cylinder - cylinder) * STEP_TIME_MS + SETTLE_TIME_MS;
+          cylinder = block_cylinder;
+        }
+
+      int nbr_sectors = di_sectors_per_track (disk_image->type, blocks[i].track);
+      double sector_time = REVOLUTION_TIME_MS / nbr_sectors;
+      double position = time / sector_time;
+      double wait = blocks[i].sector - (position - (long) (position / nbr_sectors) * nbr_sectors);
+      if (wait < 0)
+        wait += nbr_sectors;
+      time += (wait + 1) * sector_time + block_time_ms;
+    }
+
+  return time;
+}
+
+/* the smallest interleave leaving the block time between two blocks on the
+   tracks with the most sectors, where they pass the fastest */
+static int fitting_interleave (DiskImage *disk_image, double block_time_ms)
+{
+  int nbr_sectors = di_sectors_per_track (disk_image->type, 1);
+  double sector_time = REVOLUTION_TIME_MS / nbr_sectors;
+  int interleave = 1;
+
+  while (interleave < nbr_sectors - 1 and (interleave - 1) * sector_time < block_time_ms)
+    interleave++;
+
+  return interleave;
+}
+
+static size_t count_extents (const TrackSector *blocks, size_t nbr_blocks)
+{
+  size_t nbr_extents = 0;
+
+  for (size_t i = 0; i < nbr_blocks; i++)
+    if (i == 0 or blocks[i].track != blocks[i - 1].track)
+      nbr_extents++;
+
+  return nbr_extents;
+}
+
+static bool is_moved_entry (const RawDirEntry *rde)
+{
+  int type = rde->type & 0x07;
+
+  /* closed SEQ, PRG or USR */
+  return (rde->type & 0x80) != 0 and type >= 1 and type <= 3;
+}
+
+/* reads the contents and the blocks of the file; returns false when its
+   chain is broken or cyclic */
+static bool read_file (DiskImage *disk_image, moved_file *file)
+{
+  unsigned char visited[MAXTRACKS][MAXSECTORS] = {{0}};
+  size_t capacity = disk_image->size / 256;
+
+  file->old_blocks = malloc (capacity * sizeof (TrackSector));
+  file->contents = malloc (capacity * BLOCK_DATA_SIZE);
+  if (is_null (file->old_blocks) or is_null (file->contents))
+    return false;
+
+  for (TrackSector ts = file->dir_entry->startts; ts.track != 0; ts = next_ts_in_chain (disk_image, ts))
+    {
+      if (!di_ts_is_valid (disk_image->type, ts) or visited[ts.track - 1][ts.sector])
+        return false;
+      visited[ts.track - 1][ts.sector] = 1;
+      file->old_blocks[file->nbr_old_blocks++] = ts;
+    }
+  if (file->nbr_old_blocks == 0)
+    return false;
+
+  ImageFile image_file;
+  if (di_open_entry_r (disk_image, file->dir_entry, &image_file) != 0)
+    return false;
+  while (true)
+    {
+      int data_len = di_read_r (&image_file, file->contents + file->size, capacity * BLOCK_DATA_SIZE - file->size);
+      file->size += data_len;
+      if (image_file.status != 0)
+        return false;
+      if (data_len == 0)
+        break;
+    }
+
+  return true;
+}
+
+/* marks the blocks of a chain of a file left in place, so that they are not
+   freed if a moved file shares them */
+static void keep_chain (DiskImage *disk_image, TrackSector ts, unsigned char kept[MAXTRACKS][MAXSECTORS])
+{
+  unsigned char visited[MAXTRACKS][MAXSECTORS] = {{0}};
+
+  for (; ts.track != 0 and di_ts_is_valid (disk_image->type, ts) and !visited[ts.track - 1][ts.sector];
+       ts = next_ts_in_chain (disk_image, ts))
+    {
+      visited[ts.track - 1][ts.sector] = 1;
+      kept[ts.track - 1][ts.sector] = 1;
+    }
+}
+
+static void free_files (moved_file *files, size_t nbr_files)
+{
+  for (size_t i = 0; i < nbr_files; i++)
+    {
+      free (files[i].contents);
+      free (files[i].old_blocks);
+      free (files[i].new_blocks);
+    }
+  free (files);
+}
+
+/* collects the files to move, in directory order, and marks the blocks of
+   the other ones in kept */
+static moved_file *find_files (DiskImage *disk_image, size_t *nbr_files, size_t *nbr_skipped, unsigned char kept[MAXTRACKS][MAXSECTORS])
+{
+  unsigned char visited[MAXTRACKS][MAXSECTORS] = {{0}};
+  moved_file *files = calloc (disk_image->size / 256, sizeof (moved_file));
+  if (is_null (files))
+    return NULL;
+
+  *nbr_files = 0;
+  *nbr_skipped = 0;
+  for (TrackSector ts = di_get_dir_ts (disk_image); ts.track != 0; ts = next_ts_in_chain (disk_image, ts))
+    {
+      if (!di_ts_is_valid (disk_image->type, ts) or visited[ts.track - 1][ts.sector])
+        break;
+      visited[ts.track - 1][ts.sector] = 1;
+
+      unsigned char *sector = di_get_ts_addr (disk_image, ts);
+      for (int i = 0; i < 8; i++)
+        {
+          RawDirEntry *rde = (RawDirEntry *) (sector + i * 32);
+          if ((rde->type & 0x07) == 0 or rde->rawname[0] == 0 or rde->rawname[0] == 0xa)
+            continue;
+
+          moved_file *file = files + *nbr_files;
+          *file = (moved_file) {.dir_entry = rde, .dir_ts = ts};
+          if (is_moved_entry (rde) and read_file (disk_image, file))
+            (*nbr_files)++;
+          else
+            {
+              free (file->contents);
+              free (file->old_blocks);
+              keep_chain (disk_image, rde->startts, kept);
+              if ((rde->type & 0x07) == 4)
+                keep_chain (disk_image, rde->relsidets, kept);
+              (*nbr_skipped)++;
+            }
+        }
+    }
+
+  return files;
+}
+
+/* the tracks in the order of the policy, the directory tracks included, which
+   di_alloc_next_ts_on_track skips anyway */
+static int make_track_order (DiskImage *disk_image, track_order tracks, int *order)
+{
+  int nbr_tracks = di_tracks (disk_image->type);
+  int dir_track = disk_image->dir.track;
+
+  if (tracks == TRACKS_ASCENDING)
+    for (int i = 0; i < nbr_tracks; i++)
+      order[i] = i + 1;
+  else
+    {
+      int nbr_ordered = 0;
+      for (int distance = 1; nbr_ordered < nbr_tracks - 1; distance++)
+        {
+          if (dir_track - distance >= 1)
+            order[nbr_ordered++] = dir_track - distance;
+          if (dir_track + distance <= nbr_tracks)
+            order[nbr_ordered++] = dir_track + distance;
+        }
+      order[nbr_ordered] = dir_track;
+    }
+
+  return nbr_tracks;
+}
+
+/* allocates the block following prevts on the track chosen by the policy:
+   the track of prevts while it has free blocks, else the first one of the
+   order with free blocks */
+static TrackSector alloc_block (DiskImage *disk_image, TrackSector prevts, const int *order, int nbr_tracks)
+{
+  TrackSector ts = {.track = 0, .sector = 0};
+
+  if (prevts.track != 0)
+    ts = di_alloc_next_ts_on_track (disk_image, prevts, prevts.track);
+  for (int i = 0; i < nbr_tracks and ts.track == 0; i++)
+    ts = di_alloc_next_ts_on_track (disk_image, prevts, order[i]);
+
+  return ts;
+}
+
+static size_t file_blocks (const moved_file *file)
+{
+  size_t nbr_blocks = (file->size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+
+  return (nbr_blocks == 0) ? 1 : nbr_blocks;
+}
+
+/* whether the files fit in the free blocks and the ones freed by relayout,
+   counted once when the chains are cross-linked, outside the directory track
+   as for blocks_free */
+static bool files_fit (DiskImage *disk_image, const moved_file *files, size_t nbr_files, unsigned char kept[MAXTRACKS][MAXSECTORS])
+{
+  unsigned char freed[MAXTRACKS][MAXSECTORS] = {{0}};
+  size_t nbr_needed = 0;
+  size_t nbr_available = blocks_free (disk_image);
+
+  for (size_t i = 0; i < nbr_files; i++)
+    {
+      nbr_needed += file_blocks (files + i);
+      for (size_t j = 0; j < files[i].nbr_old_blocks; j++)
+        {
+          TrackSector ts = files[i].old_blocks[j];
+          if (!kept[ts.track - 1][ts.sector] and !freed[ts.track - 1][ts.sector] and !di_is_ts_free (disk_image, ts)
+              and ts.track != disk_image->dir.track)
+            {
+              freed[ts.track - 1][ts.sector] = 1;
+              nbr_available++;
+            }
+        }
+    }
+
+  return nbr_needed <= nbr_available;
+}
+
+static int write_file (DiskImage *disk_image, moved_file *file, TrackSector *prevts, const int *order, int nbr_tracks)
+{
+  size_t nbr_blocks = file_blocks (file);
+
+  file->new_blocks = malloc (nbr_blocks * sizeof (TrackSector));
+  if (is_null (file->new_blocks))
+    return -ENOMEM;
+  for (size_t i = 0; i < nbr_blocks; i++)
+    {
+      *prevts = alloc_block (disk_image, *prevts, order, nbr_tracks);
+      if (prevts->track == 0)
+        return -ENOSPC;
+      file->new_blocks[file->nbr_new_blocks++] = *prevts;
+    }
+
+  for (size_t i = 0; i < nbr_blocks; i++)
+    {
+      size_t offset = i * BLOCK_DATA_SIZE;
+      size_t length = (file->size - offset < BLOCK_DATA_SIZE) ? file->size - offset : BLOCK_DATA_SIZE;
+      if (file->size == 0)
+        length = 0;
+
+      di_mark_dirty (disk_image, file->new_blocks[i]);
+      unsigned char *block = di_get_ts_addr (disk_image, file->new_blocks[i]);
+      memset (block, 0, 256);
+      if (i + 1 < nbr_blocks)
+        {
+          block[0] = file->new_blocks[i + 1].track;
+          block[1] = file->new_blocks[i + 1].sector;
+        }
+      else
+        {
+          /* the last block holds the offset of its last byte */
+          block[0] = 0;
+          block[1] = length + 1;
+        }
+      memcpy (block + 2, file->contents + offset, length);
+    }
+
+  di_mark_dirty (disk_image, file->dir_ts);
+  file->dir_entry->startts = file->new_blocks[0];
+  file->dir_entry->sizelo = nbr_blocks & 0xff;
+  file->dir_entry->sizehi = nbr_blocks >> 8;
+
+  return 0;
+}
+
+/* frees the blocks of all the files first, so that each one can take the
+   best blocks, then writes them again in directory order. Nothing is changed
+   when the files do not fit; a failure afterwards leaves the image half
+   written, to be dropped */
+static int relayout (DiskImage *disk_image, moved_file *files, size_t nbr_files, unsigned char kept[MAXTRACKS][MAXSECTORS],
+                     const relayout_options *options)
+{
+  int order[MAXTRACKS];
+  int nbr_tracks = make_track_order (disk_image, options->tracks, order);
+
+  if (!files_fit (disk_image, files, nbr_files, kept))
+    return -ENOSPC;
+
+  disk_image->interleave = (options->interleave > 0) ? options->interleave : fitting_interleave (disk_image, options->block_time_ms);
+
+  for (size_t i = 0; i < nbr_files; i++)
+    for (size_t j = 0; j < files[i].nbr_old_blocks; j++)
+      {
+        TrackSector ts = files[i].old_blocks[j];
+        if (!kept[ts.track - 1][ts.sector] and !di_is_ts_free (disk_image, ts))
+          di_free_ts (disk_image, ts);
+      }
+
+  TrackSector prevts = {.track = 0, .sector = 0};
+  for (size_t i = 0; i < nbr_files; i++)
+    {
+      int result = write_file (disk_image, files + i, &prevts, order, nbr_tracks);
+      if (result != 0)
+        return result;
+    }
+
+  return 0;
+}
+
+static void report (DiskImage *disk_image, const moved_file *files, size_t nbr_files, size_t nbr_skipped, const relayout_options *options)
+{
+  double total_before = 0.0;
+  double total_after = 0.0;
+  char name[17];
+
+  printf ("%-16s %6s %14s %14s %12s %12s\n", "file", "blocks", "extents_before", "extents_after", "before_ms", "after_ms");
+  for (size_t i = 0; i < nbr_files; i++)
+    {
+      const moved_file *file = files + i;
+      double before = estimate_load_time (disk_image, file->old_blocks, file->nbr_old_blocks, options->block_time_ms);
+      double after = estimate_load_time (disk_image, file->new_blocks, file->nbr_new_blocks, options->block_time_ms);
+      total_before += before;
+      total_after += after;
+
+      di_name_from_rawname (name, file->dir_entry->rawname);
+      printf ("%-16s %6zu %14zu %14zu %12.1f %12.1f\n", name, file->nbr_new_blocks,
+              count_extents (file->old_blocks, file->nbr_old_blocks), count_extents (file->new_blocks, file->nbr_new_blocks),
+              before, after);
+    }
+
+  printf ("%zu files moved, %zu left in place, interleave %d, %s tracks, block time %.1f ms\n", nbr_files, nbr_skipped,
+          disk_image->interleave, (options->tracks == TRACKS_ASCENDING) ? "ascending" : "outward", options->block_time_ms);
+  printf ("estimated load time: %.1f s before, %.1f s after (%.1f%% faster)\n", total_before / 1000, total_after / 1000,
+          (total_before > 0) ? 100.0 * (total_before - total_after) / total_before : 0.0);
+}
+
+static int copy_file (const char *source, const char *destination)
+{
+  FILE *input = fopen (source, "rb");
+  if (is_null (input))
+    return -1;
+  FILE *output = fopen (destination, "wb");
+  if (is_null (output))
+    {
+      fclose (input);
+      return -1;
+    }
+
+  char buffer[65536];
+  size_t length;
+  int result = 0;
+  while ((length = fread (buffer, 1, sizeof (buffer), input)) > 0)
+    if (fwrite (buffer, 1, length, output) != length)
+      result = -1;
+  if (ferror (input))
+    result = -1;
+  fclose (input);
+  if (fclose (output) != 0)
+    result = -1;
+
+  return result;
+}
+
+int main (int argc, char *argv[])
+{
+  relayout_options options;
+
+  if (parse_args (argc, argv, &options) != 0)
+    {
+      show_help (argv[0]);
+      return -1;
+    }
+
+  const char *filename = argv[optind];
+  if (is_not_null (options.output_filename) and !options.dry_run)
+    {
+      if (copy_file (filename, options.output_filename) != 0)
+        {
+          fprintf (stderr, "Cannot copy '%s' to '%s'\n", filename, options.output_filename);
+          return -1;
+        }
+      filename = options.output_filename;
+    }
+
+  DiskImage *disk_image = di_load_image (filename);
+  if (is_null (disk_image))
+    {
+      fprintf (stderr, "Cannot load the image '%s'\n", filename);
+      return -1;
+    }
+
+  static unsigned char kept[MAXTRACKS][MAXSECTORS];
+  size_t nbr_files;
+  size_t nbr_skipped;
+  moved_file *files = find_files (disk_image, &nbr_files, &nbr_skipped, kept);
+  if (is_null (files))
+    {
+      di_free_image (disk_image);
+      return -1;
+    }
+
+  int result = relayout (disk_image, files, nbr_files, kept, &options);
+  if (result != 0)
+    fprintf (stderr, "Cannot lay out the files of '%s' again: %s\n", filename, strerror (-result));
+  else
+    {
+      report (disk_image, files, nbr_files, nbr_skipped, &options);
+      if (!options.dry_run and di_fsync (disk_image) != 0)
+        {
+          fprintf (stderr, "Cannot write '%s'\n", filename);
+          result = -1;
+        }
+    }
+  /* di_free_image would write back a dry run or a half written layout */
+  if (result != 0 or options.dry_run)
+    disk_image->modified = 0;
+
+  free_files (files, nbr_files);
+  di_free_image (disk_image);
+
+  return (result == 0) ? 0 : -1;
+}
@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include <fuse.h>
+
+#include "d64fuse_context.h"
+#include "operations.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Replays a trace recorded with "d64-fuse --record-trace" by calling the
+   operations directly, without a kernel mount. The records are spread over
+   the threads by path, so that the open/read/release sequence of a file is
+   always replayed in order by the same thread. */
+
+#define MAX_OPEN_HANDLES 64
+
+typedef struct replay_record
+{
+  d64fuse_trace_record trace;
+  char *path;
+  char *name;
+} replay_record;
+
+typedef struct open_handle
+{
+  const char *path;
+  struct fuse_file_info fi;
+} open_handle;
+
+typedef struct replay_thread
+{
+  pthread_t thread;
+  size_t thread_nbr;
+  size_t nbr_threads;
+  const replay_record *records;
+  size_t nbr_records;
+  char *buffer;
+  open_handle handles[MAX_OPEN_HANDLES];
+  size_t nbr_handles;
+  uint64_t *latencies; /* replayed latency of each record, 0 for the records of other threads */
+  size_t mismatches;
+} replay_thread;
+
+typedef struct replay_options
+{
+  const char *image_filename;
+  size_t nbr_threads;
+  size_t repeat;
+  const char *trace_filename;
+} replay_options;
+
+static size_t max_buffer_size;
+
+static void show_help (const char *progname)
+{
+  fprintf (stderr, "usage: %s [--image=<image>] [--threads=N] [--repeat=N] <trace>\n", progname);
+}
+
+static int parse_args (int argc, char *argv[], replay_options *options)
+{
+  static const struct option long_options[] = {
+    {"image", required_argument, NULL, 'I'},
+    {"threads", required_argument, NULL, 't'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  *options = (replay_options) {.nbr_threads = 1, .repeat = 1};
+
+  int option;
+  while ((option = getopt_long (argc, argv, "I:t:r:h", long_options, NULL)) != -1)
+    switch (option)
+      {
+      case 'I':
+        options->image_filename = optarg;
+        break;
+      case 't':
+        options->nbr_threads = strtoul (optarg, NULL, 10);
+        break;
+      case 'r':
+        options->repeat = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        return -1;
+      }
+
+  if (optind != argc - 1 or options->nbr_threads == 0 or options->repeat == 0)
+    return -1;
+  options->trace_filename = argv[optind];
+
+  return 0;
+}
+
+static replay_record *load_trace (const char *filename, char **image_filename, size_t *nbr_records)
+{
+  FILE *file = fopen (filename, "rb");
+  if (is_null (file))
+    {
+      perror ("Cannot open the trace");
+      return NULL;
+    }
+
+  int error = d64fuse_trace_read_header (file, image_filename);
+  if (error != 0)
+    {
+      fprintf (stderr, "Invalid trace header: %s\n", strerror (-error));
+      fclose (file);
+      return NULL;
+    }
+
+  replay_record *records = NULL;
+  size_t capacity = 0;
+  char path[D64FUSE_TRACE_MAX_PATH + 1];
+  char name[D64FUSE_TRACE_MAX_PATH + 1];
+
+  *nbr_records = 0;
+  while (true)
+    {
+      d64fuse_trace_record trace;
+      error = d64fuse_trace_read_record (file, &trace, path, name);
+      if (error == 1)
+        break;
+      if (error != 0)
+        {
+          fprintf (stderr, "Invalid trace record %zu: %s\n", *nbr_records, strerror (-error));
+          break;
+        }
+
+      if (*nbr_records == capacity)
+        {
+          capacity = capacity ? capacity * 2 : 1024;
+          records = realloc (records, capacity * sizeof (replay_record));
+          if (is_null (records))
+            {
+              fclose (file);
+              return NULL;
+            }
+        }
+      records[*nbr_records] = (replay_record) {.trace = trace, .path = strdup (path), .name = strdup (name)};
+      if (trace.size > max_buffer_size)
+        max_buffer_size = trace.size;
+      (*nbr_records)++;
+    }
+  fclose (file);
+
+  return records;
+}
+
+static size_t path_thread (const char *path, size_t nbr_threads)
+{
+  size_t hash = 5381;
+
+  for (const char *current = path; *current != '\0'; current++)
+    hash = hash * 33 + (unsigned char) *current;
+
+  return hash % nbr_threads;
+}
+
+static struct fuse_file_info *find_handle (replay_thread *thread, const char *path)
+{
+  for (size_t i = thread->nbr_handles; i > 0; i--)
+    if (strcmp (thread->handles[i - 1].path, path) == 0)
+      return &thread->handles[i - 1].fi;
+
+  return NULL;
+}
+
+static struct fuse_file_info *push_handle (replay_thread *thread, const char *path)
+{
+  if (thread->nbr_handles == MAX_OPEN_HANDLES)
+    return NULL;
+
+  open_handle *handle = thread->handles + thread->nbr_handles++;
+  *handle = (open_handle) {.path = path, .fi = {.flags = O_RDONLY}};
+
+  return &handle->fi;
+}
+
+static void pop_handle (replay_thread *thread, struct fuse_file_info *fi)
+{
+  open_handle *handle = (open_handle *) ((char *) fi - offsetof (open_handle, fi));
+  size_t index = handle - thread->handles;
+
+  memmove (handle, handle + 1, (thread->nbr_handles - index - 1) * sizeof (open_handle));
+  thread->nbr_handles--;
+}
+
+static int discard_entry (void *buffer, const char *name, const struct stat *entry_stat, off_t offset, enum fuse_fill_dir_flags flags)
+{
+  unused_arg (buffer);
+  unused_arg (name);
+  unused_arg (entry_stat);
+  unused_arg (offset);
+  unused_arg (flags);
+
+  return 0;
+}
+
+static int replay_one (replay_thread *thread, const replay_record *record)
+{
+  const d64fuse_trace_record *trace = &record->trace;
+  struct fuse_file_info no_handle = {.flags = O_RDONLY};
+  struct fuse_file_info *fi;
+  struct stat entry_stat;
+  struct statvfs fs_stat;
+  int result;
+
+  switch (trace->op)
+    {
+    case D64FUSE_OP_OPEN:
+    case D64FUSE_OP_OPENDIR:
+      fi = push_handle (thread, record->path);
+      if (is_null (fi))
+        return -EMFILE;
+      result = (trace->op == D64FUSE_OP_OPEN)
+        ? operations.open (record->path, fi)
+        : operations.opendir (record->path, fi);
+      if (result != 0)
+        pop_handle (thread, fi);
+      return result;
+    case D64FUSE_OP_READ:
+      fi = find_handle (thread, record->path);
+      return operations.read (record->path, thread->buffer, trace->size, trace->offset, fi ? fi : &no_handle);
+    case D64FUSE_OP_RELEASE:
+    case D64FUSE_OP_RELEASEDIR:
+      fi = find_handle (thread, record->path);
+      if (is_null (fi))
+        return -EBADF;
+      result = (trace->op == D64FUSE_OP_RELEASE)
+        ? operations.release (record->path, fi)
+        : operations.releasedir (record->path, fi);
+      pop_handle (thread, fi);
+      return result;
+    case D64FUSE_OP_READDIR:
+      fi = find_handle (thread, record->path);
+      return operations.readdir (record->path, NULL, discard_entry, trace->offset, fi ? fi : &no_handle, 0);
+    case D64FUSE_OP_ACCESS:
+      return operations.access (record->path, trace->size);
+    case D64FUSE_OP_GETATTR:
+      return operations.getattr (record->path, &entry_stat, NULL);
+    case D64FUSE_OP_STATFS:
+      return operations.statfs (record->path, &fs_stat);
+    case D64FUSE_OP_GETXATTR:
+      return operations.getxattr (record->path, record->name, thread->buffer, trace->size);
+    case D64FUSE_OP_LISTXATTR:
+      return operations.listxattr (record->path, thread->buffer, trace->size);
+    case D64FUSE_OP_READLINK:
+      return operations.readlink (record->path, thread->buffer, trace->size);
+    default:
+      /* the image is replayed read-only: the modifying operations are not
+         replayed */
+      return -ENOSYS;
+    }
+}
+
+static void *replay_loop (void *arg)
+{
+  replay_thread *thread = arg;
+
+  for (size_t i = 0; i < thread->nbr_records; i++)
+    {
+      const replay_record *record = thread->records + i;
+      if (path_thread (record->path, thread->nbr_threads) != thread->thread_nbr)
+        continue;
+
+      uint64_t start = d64fuse_stats_clock ();
+      int result = replay_one (thread, record);
+      thread->latencies[i] = d64fuse_stats_clock () - start;
+      if (result != record->trace.result)
+        thread->mismatches++;
+    }
+
+  return NULL;
+}
+
+static int compare_latencies (const void *left, const void *right)
+{
+  uint64_t left_latency = *(const uint64_t *) left;
+  uint64_t right_latency = *(const uint64_t *) right;
+
+  return (left_latency > right_latency) - (left_latency < right_latency);
+}
+
+static void report_latencies (const replay_record *records, size_t nbr_records, replay_thread *threads, size_t nbr_threads, size_t repeat)
+{
+  uint64_t *samples = malloc (nbr_records * repeat * sizeof (uint64_t));
+  if (is_null (samples))
+    return;
+
+  printf ("%-10s %9s %12s %12s %12s %12s %12s\n", "op", "calls", "recorded_us", "mean_us", "p50_us", "p99_us", "max_us");
+  for (size_t op = 0; op < D64FUSE_OP_COUNT; op++)
+    {
+      size_t nbr_samples = 0;
+      uint64_t recorded_total = 0;
+      uint64_t replayed_total = 0;
+
+      for (size_t run = 0; run < repeat; run++)
+        for (size_t i = 0; i < nbr_records; i++)
+          if (records[i].trace.op == op)
+            {
+              size_t thread_nbr = path_thread (records[i].path, nbr_threads);
+              uint64_t latency = threads[run * nbr_threads + thread_nbr].latencies[i];
+              samples[nbr_samples++] = latency;
+              replayed_total += latency;
+              recorded_total += records[i].trace.latency;
+            }
+      if (nbr_samples == 0)
+        continue;
+
+      qsort (samples, nbr_samples, sizeof (uint64_t), compare_latencies);
+      printf ("%-10s %9zu %12.2f %12.2f %12.2f %12.2f %12.2f\n", d64fuse_op_names[op], nbr_samples,
+              recorded_total / 1000.0 / nbr_samples, replayed_total / 1000.0 / nbr_samples,
+              samples[nbr_samples / 2] / 1000.0, samples[(nbr_samples * 99) / 100] / 1000.0,
+              samples[nbr_samples - 1] / 1000.0);
+    }
+
+  free (samples);
+}
+
+int main (int argc, char *argv[])
+{
+  replay_options options;
+
+  if (parse_args (argc, argv, &options) != 0)
+    {
+      show_help (argv[0]);
+      return -1;
+    }
+
+  char *trace_image_filename = NULL;
+  size_t nbr_records = 0;
+  replay_record *records = load_trace (options.trace_filename, &trace_image_filename, &nbr_records);
+  if (is_null (records))
+    return -1;
+
+  const char *image_filename = is_not_null (options.image_filename) ? options.image_filename : trace_image_filename;
+  d64fuse_context context;
+  memset (&context, 0, sizeof (context));
+  context.nbr_files = -1;
+  context.image_filename = canonicalize_file_name (image_filename);
+  if (is_null (context.image_filename))
+    {
+      fprintf (stderr, "Cannot find the image '%s': %s\n", image_filename, strerror (errno));
+      return -1;
+    }
+  d64fuse_set_default_context (&context);
+
+  /* the lazy initialization is not part of what is being measured */
+  ensure_stats_initialized (&context);
+
+  size_t nbr_runs = options.nbr_threads * options.repeat;
+  replay_thread *threads = calloc (nbr_runs, sizeof (replay_thread));
+  if (is_null (threads))
+    return -1;
+
+  size_t mismatches = 0;
+  uint64_t start = d64fuse_stats_clock ();
+  for (size_t run = 0; run < options.repeat; run++)
+    {
+      replay_thread *run_threads = threads + run * options.nbr_threads;
+      for (size_t i = 0; i < options.nbr_threads; i++)
+        {
+          replay_thread *thread = run_threads + i;
+          *thread = (replay_thread) {.thread_nbr = i, .nbr_threads = options.nbr_threads,
+                                     .records = records, .nbr_records = nbr_records,
+                                     .buffer = malloc (max_buffer_size + 1),
+                                     .latencies = calloc (nbr_records, sizeof (uint64_t))};
+          if (is_null (thread->buffer) or is_null (thread->latencies)
+              or pthread_create (&thread->thread, NULL, replay_loop, thread) != 0)
+            {
+              fprintf (stderr, "Cannot start replay thread %zu\n", i);
+              return -1;
+            }
+        }
+      for (size_t i = 0; i < options.nbr_threads; i++)
+        {
+          pthread_join (run_threads[i].thread, NULL);
+          mismatches += run_threads[i].mismatches;
+          free (run_threads[i].buffer);
+        }
+    }
+  uint64_t elapsed = d64fuse_stats_clock () - start;
+
+  size_t nbr_ops = nbr_records * options.repeat;
+  printf ("image: %s\n", context.image_filename);
+  printf ("threads: %zu, repeat: %zu, operations: %zu, mismatched results: %zu\n",
+          options.nbr_threads, options.repeat, nbr_ops, mismatches);
+  printf ("elapsed: %.3f ms, %.0f ops/s\n", elapsed / 1e6, nbr_ops / (elapsed / 1e9));
+  report_latencies (records, nbr_records, threads, options.nbr_threads, options.repeat);
+
+  for (size_t run = 0; run < nbr_runs; run++)
+    free (threads[run].latencies);
+  free (threads);
+  for (size_t i = 0; i < nbr_records; i++)
+    {
+      free (records[i].path);
+      free (records[i].name);
+    }
+  free (records);
+  free (trace_image_filename);
+  d64fuse_free_context_data (&context);
+  free (context.image_filename);
+
+  return 0;
+}